@@ -0,0 +1,225 @@
+#define _GNU_SOURCE //memmem
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/http.h"
+#include "../include/http_scan.h"
+
+//Compares parse_http_request() with the previous strncmp/memmem based parser
+//on request headers captured from real browsers.
+//Usage: bench_http_parser [iterations]
+
+static const char* const corpus[] = {
+        //Chrome
+        "GET /httptest/wikipedia_russia.html HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Connection: keep-alive\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+        "Sec-Fetch-Site: none\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-User: ?1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: ru-RU,ru;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+        "If-None-Match: \"1a2b3c-4d5e-6f70\"\r\n"
+        "If-Modified-Since: Tue, 03 Mar 2020 12:40:15 GMT\r\n"
+        "\r\n",
+        //Firefox
+        "GET /httptest/splash.css HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/119.0\r\n"
+        "Accept: text/css,*/*;q=0.1\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Connection: keep-alive\r\n"
+        "Referer: http://localhost/httptest/wikipedia_russia.html\r\n"
+        "Sec-Fetch-Dest: style\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "\r\n",
+        //curl
+        "GET /httptest/dir2/space%20in%20name.txt?arg=value HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "User-Agent: curl/7.68.0\r\n"
+        "Accept: */*\r\n"
+        "\r\n",
+        //ab
+        "GET /httptest/wikipedia_russia.html HTTP/1.0\r\n"
+        "Host: localhost\r\n"
+        "User-Agent: ApacheBench/2.3\r\n"
+        "Accept: */*\r\n"
+        "\r\n",
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+struct legacy_header_t {
+    char* text;
+    size_t len;
+};
+
+struct legacy_request_t {
+    enum request_method_t method;
+    char* URI;
+    enum http_version_t http_version;
+    struct legacy_header_t headers[HTTP_MAX_HEADERS_COUNT];
+    size_t headers_count;
+};
+
+//Request line and header parsing as it was before the single-pass parser, URL decoding left out
+static enum http_state_t legacy_parse_http_request(char* req_str, size_t req_len, struct legacy_request_t* req) {
+    char* cursor = req_str;
+    char* req_end = req_str + req_len;
+    while (cursor < req_end && (*cursor == '\r' || *cursor == '\n')) {
+        cursor++;
+    }
+    char* line_end = memmem(cursor, req_end - cursor, "\r\n", 2);
+    if (line_end == NULL) {
+        return BAD_REQUEST;
+    }
+
+    if (strncmp(cursor, "GET", 3) == 0 && cursor[3] == ' ') {
+        req->method = GET;
+        cursor += 4;
+    } else if (strncmp(cursor, "HEAD", 4) == 0 && cursor[4] == ' ') {
+        req->method = HEAD;
+        cursor += 5;
+    } else {
+        return METHOD_NOT_ALLOWED;
+    }
+
+    char* uri_end = memchr(cursor, ' ', line_end - cursor);
+    if (uri_end == NULL) {
+        return BAD_REQUEST;
+    }
+    req->URI = cursor;
+    *uri_end = '\0';
+    char* query_start = memchr(req->URI, '?', uri_end - req->URI);
+    if (query_start != NULL) {
+        *query_start = '\0';
+    }
+    cursor = uri_end + 1;
+
+    if (line_end - cursor == 8 && strncmp(cursor, "HTTP/1.0", 8) == 0) {
+        req->http_version = HTTPv1_0;
+    } else if (line_end - cursor == 8 && strncmp(cursor, "HTTP/1.1", 8) == 0) {
+        req->http_version = HTTPv1_1;
+    } else {
+        return BAD_REQUEST;
+    }
+    cursor = line_end + 2;
+
+    req->headers_count = 0;
+    while (1) {
+        char* header_end = memmem(cursor, req_end - cursor, "\r\n", 2);
+        if (header_end == NULL) {
+            return BAD_REQUEST;
+        }
+        if (header_end == cursor) {
+            return OK;
+        }
+        if (req->headers_count == HTTP_MAX_HEADERS_COUNT) {
+            return BAD_REQUEST;
+        }
+        req->headers[req->headers_count].text = cursor;
+        req->headers[req->headers_count].len = header_end - cursor + 2;
+        req->headers_count++;
+        cursor = header_end + 2;
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static char scratch[CORPUS_SIZE][4096];
+static size_t lengths[CORPUS_SIZE];
+
+static void reset_scratch(size_t i) {
+    memcpy(scratch[i], corpus[i], lengths[i]);
+}
+
+static double bench_legacy(long iterations, size_t* headers_total) {
+    double start = now_ns();
+    for (long it = 0; it < iterations; it++) {
+        for (size_t i = 0; i < CORPUS_SIZE; i++) {
+            reset_scratch(i);
+            struct legacy_request_t req;
+            if (legacy_parse_http_request(scratch[i], lengths[i], &req) != OK) {
+                fprintf(stderr, "legacy parser failed on request %zu\n", i);
+                exit(EXIT_FAILURE);
+            }
+            *headers_total += req.headers_count;
+        }
+    }
+    return (now_ns() - start) / ((double)iterations * CORPUS_SIZE);
+}
+
+static double bench_current(long iterations, size_t* headers_total) {
+    double start = now_ns();
+    for (long it = 0; it < iterations; it++) {
+        for (size_t i = 0; i < CORPUS_SIZE; i++) {
+            reset_scratch(i);
+            struct http_request_t req = HTTP_REQUEST_INITIALIZER;
+            struct http_field_t headers[HTTP_MAX_HEADERS_COUNT];
+            req.headers = headers;
+            req.headers_capacity = HTTP_MAX_HEADERS_COUNT;
+            if (parse_http_request(scratch[i], lengths[i], &req) != OK) {
+                fprintf(stderr, "parser failed on request %zu\n", i);
+                exit(EXIT_FAILURE);
+            }
+            *headers_total += req.headers_count;
+        }
+    }
+    return (now_ns() - start) / ((double)iterations * CORPUS_SIZE);
+}
+
+static double bench_copy_only(long iterations) {
+    double start = now_ns();
+    for (long it = 0; it < iterations; it++) {
+        for (size_t i = 0; i < CORPUS_SIZE; i++) {
+            reset_scratch(i);
+            __asm__ volatile("" : : "r"(scratch[i]) : "memory");
+        }
+    }
+    return (now_ns() - start) / ((double)iterations * CORPUS_SIZE);
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        lengths[i] = strlen(corpus[i]);
+    }
+
+    size_t legacy_headers = 0;
+    size_t headers = 0;
+    double copy_ns = bench_copy_only(iterations);
+    printf("%-10s %8.1f ns/op (request copy, included in every row)\n", "copy", copy_ns);
+    printf("%-10s %8.1f ns/op\n", "legacy", bench_legacy(iterations, &legacy_headers));
+
+    const enum http_scan_impl_t impls[] = {HTTP_SCAN_IMPL_SCALAR, HTTP_SCAN_IMPL_SSE42, HTTP_SCAN_IMPL_AVX2};
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (http_scan_set_impl(impls[i]) != impls[i]) {
+            printf("%-10s not supported by this CPU\n", http_scan_impl_t_to_string(impls[i]));
+            continue;
+        }
+        headers = 0;
+        printf("%-10s %8.1f ns/op\n", http_scan_impl_t_to_string(impls[i]), bench_current(iterations, &headers));
+    }
+
+    if (headers != legacy_headers) {
+        fprintf(stderr, "parsers disagree on headers count: %zu vs %zu\n", headers, legacy_headers);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include "../include/http.h"
+#include "../include/http_header.h"
+
+//Compares serialize_http_response_head() with the previous header building:
+//strftime() for Date, sprintf() for Content-Length, strcat() for Content-Type
+//and one evbuffer_add() per header. libevent allocations are counted as well.
+//Usage: bench_http_response [iterations]
+
+static unsigned long allocations = 0;
+
+static void* counting_malloc(size_t size) {
+    allocations++;
+    return malloc(size);
+}
+
+static void* counting_realloc(void* ptr, size_t size) {
+    allocations++;
+    return realloc(ptr, size);
+}
+
+struct legacy_header_t {
+    char* text;
+    size_t len;
+};
+#define LEGACY_HEADER_BUFFER_SIZE 64
+#define LEGACY_HEADERS_COUNT 5
+
+static void legacy_build_date_header(struct legacy_header_t* header) {
+    time_t raw_time = time(NULL);
+    struct tm* time_info = localtime(&raw_time);
+    strftime(header->text, LEGACY_HEADER_BUFFER_SIZE, "Date: %a, %d %b %Y %X %Z\r\n", time_info);
+    header->len = strlen(header->text);
+}
+
+static void legacy_respond(struct evbuffer* output, enum http_version_t version, int64_t content_len, const struct mime_type_t* mime_type) {
+    char buffers[LEGACY_HEADERS_COUNT][LEGACY_HEADER_BUFFER_SIZE];
+    struct legacy_header_t headers[LEGACY_HEADERS_COUNT];
+    for (size_t i = 0; i < LEGACY_HEADERS_COUNT; i++) {
+        headers[i].text = buffers[i];
+    }
+    headers[0] = (struct legacy_header_t){STR_CONNECTION_KEEP_ALIVE_HEADER, strlen(STR_CONNECTION_KEEP_ALIVE_HEADER)};
+    legacy_build_date_header(&headers[1]);
+    strcpy(headers[2].text, STR_CONTENT_LENGTH_HEADER);
+    sprintf(headers[2].text + strlen(headers[2].text), "%ld\r\n", (long)content_len);
+    headers[2].len = strlen(headers[2].text);
+    strcpy(headers[3].text, STR_CONTENT_TYPE_HEADER);
+    strcat(headers[3].text, mime_type->name);
+    strcat(headers[3].text, "\r\n\0");
+    headers[3].len = strlen(headers[3].text);
+    headers[4] = (struct legacy_header_t){STR_SERVER_HEADER, strlen(STR_SERVER_HEADER)};
+
+    const char* version_str = http_version_t_to_string(version);
+    evbuffer_add(output, version_str, strlen(version_str));
+    evbuffer_add(output, " ", 1);
+    evbuffer_add(output, STR_200_OK, strlen(STR_200_OK));
+    evbuffer_add(output, "\r\n", 2);
+    for (size_t i = 0; i < LEGACY_HEADERS_COUNT; i++) {
+        evbuffer_add(output, headers[i].text, headers[i].len);
+    }
+    evbuffer_add(output, "\r\n", 2);
+}
+
+static void current_respond(struct evbuffer* output, enum http_version_t version, int64_t content_len, const struct mime_type_t* mime_type) {
+    struct http_response_t resp = HTTP_RESPONSE_INITIALIZER;
+    resp.code = OK;
+    resp.http_version = version;
+    resp.keep_alive = 1;
+    resp.content_length = content_len;
+    resp.has_content_type = 1;
+    resp.file_to_send.mime_type = mime_type;
+
+    char head[HTTP_RESPONSE_HEAD_MAX_SIZE];
+    size_t head_len = serialize_http_response_head(&resp, head);
+    evbuffer_add(output, head, head_len);
+}
+
+typedef void (*respond_func_t)(struct evbuffer*, enum http_version_t, int64_t, const struct mime_type_t*);
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void bench(const char* name, respond_func_t respond_func, long iterations) {
+    static const int64_t lengths[] = {0, 954, 34782, 2567380};
+    const struct mime_type_t* mime_types[] = {mime_type_by_path("index.html"), mime_type_by_path("style.css"),
+                                              mime_type_by_path("logo.png"), mime_type_by_path("app.js")};
+    struct evbuffer* output = evbuffer_new();
+    size_t bytes = 0;
+    allocations = 0;
+    double start = now_ns();
+    for (long it = 0; it < iterations; it++) {
+        respond_func(output, HTTPv1_1, lengths[it & 3], mime_types[it & 3]);
+        bytes += evbuffer_get_length(output);
+        evbuffer_drain(output, evbuffer_get_length(output)); //as if written to the socket
+    }
+    double ns = (now_ns() - start) / (double)iterations;
+    printf("%-10s %8.1f ns/op %6.2f allocs/op %6.1f bytes/op\n",
+            name, ns, (double)allocations / (double)iterations, (double)bytes / (double)iterations);
+    evbuffer_free(output);
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    event_set_mem_functions(counting_malloc, counting_realloc, free);
+    mime_types_load(NULL);
+
+    bench("legacy", legacy_respond, iterations);
+    bench("template", current_respond, iterations);
+    return 0;
+}
@@ -0,0 +1,503 @@
+#define _GNU_SOURCE //mkdtemp
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <event2/buffer.h>
+
+#include "../include/config.h"
+#include "../include/http.h"
+#include "../include/http_header.h"
+#include "../include/file_system.h"
+#include "../include/file_cache.h"
+#include "../include/server.h"
+#include "../include/mime.h"
+#include "../include/slab.h"
+
+//Times the request path function by function: parse_http_request(), url_decode(), inspect_file(),
+//build_http_response() and respond() into an in-memory evbuffer, over request headers captured
+//from real clients and a document root generated in /tmp. Every function is reported in ns/op
+//of thread CPU time and allocs/op, the median of BENCH_ROUNDS rounds after a warm-up round.
+//Every round is also divided by a fixed reference workload timed right before it, the baseline
+//keeps these relative costs, so frequency scaling and other processes move both sides alike.
+//With -c the results are compared against a baseline written by -s on the same machine: the run
+//fails when a function got relatively slower than the baseline by more than the threshold or
+//allocates more per op, on BENCH_ATTEMPTS measurements in a row. It exits with BENCH_SKIPPED when there is no baseline to compare with.
+//Usage: bench_suite [-n iterations] [-s baseline] [-c baseline] [-t threshold percent]
+
+#define BENCH_ROUNDS 11
+#define BENCH_ATTEMPTS 3 //a function counts as regressed only when every attempt exceeds the threshold
+#define DEFAULT_ITERATIONS 50000
+#define DEFAULT_THRESHOLD 20.0 //percent of the median relative cost
+#define REFERENCE_ITERATIONS 2000
+#define BENCH_NAME_MAX_LEN 31
+#define BASELINE_MAX_SIZE 64 //functions read from a baseline
+#define BENCH_SKIPPED 77 //SKIP_RETURN_CODE of the ctest
+#define BASELINE_HEADER "#name relative-cost allocs/op, written by bench_suite -s\n"
+
+//Every allocation of the process goes through these, libevent and strdup() included
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long allocations = 0;
+
+void* malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+static const char* const corpus[] = {
+        //Chrome, revalidation of a cached page
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Connection: keep-alive\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+        "Sec-Fetch-Site: none\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-User: ?1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Accept-Language: ru-RU,ru;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+        "If-None-Match: \"1a2b3c-4d5e-6f70\"\r\n"
+        "If-Modified-Since: Tue, 03 Mar 2020 12:40:15 GMT\r\n"
+        "\r\n",
+        //Firefox
+        "GET /css/splash.css HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/119.0\r\n"
+        "Accept: text/css,*/*;q=0.1\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Connection: keep-alive\r\n"
+        "Referer: http://localhost/index.html\r\n"
+        "Sec-Fetch-Dest: style\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "\r\n",
+        //Chrome, image
+        "GET /img/logo.png HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+        "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+        "Referer: http://localhost/index.html\r\n"
+        "Sec-Fetch-Dest: image\r\n"
+        "\r\n",
+        //curl, encoded path and a query
+        "GET /docs/space%20in%20name.txt?arg=value HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "User-Agent: curl/7.68.0\r\n"
+        "Accept: */*\r\n"
+        "\r\n",
+        //Video player, range of a large file
+        "GET /media/video.mp4 HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "User-Agent: VLC/3.0.16 LibVLC/3.0.16\r\n"
+        "Range: bytes=1048576-1114111\r\n"
+        "Icy-MetaData: 1\r\n"
+        "\r\n",
+        //ab, directory index
+        "GET /docs/ HTTP/1.0\r\n"
+        "Host: localhost\r\n"
+        "User-Agent: ApacheBench/2.3\r\n"
+        "Accept: */*\r\n"
+        "\r\n",
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+static const char* const encoded_paths[] = {
+        "/index.html",
+        "/docs/space%20in%20name.txt",
+        "/%D0%B2%D0%B8%D0%BA%D0%B8%D0%BF%D0%B5%D0%B4%D0%B8%D1%8F/%D0%A0%D0%BE%D1%81%D1%81%D0%B8%D1%8F.html",
+        "/static/js/app.min.js",
+};
+#define ENCODED_PATHS_SIZE (sizeof(encoded_paths) / sizeof(encoded_paths[0]))
+
+//The generated document root, the paths the corpus asks for
+static const struct {
+    const char* path;
+    size_t size; //0 for a directory
+} document_root_files[] = {
+        {"css", 0},
+        {"img", 0},
+        {"docs", 0},
+        {"media", 0},
+        {"index.html", 18 * 1024},
+        {"css/splash.css", 6 * 1024},
+        {"img/logo.png", 40 * 1024},
+        {"docs/space in name.txt", 700},
+        {"docs/index.html", 2 * 1024},
+        {"media/video.mp4", 4 * 1024 * 1024},
+};
+#define DOCUMENT_ROOT_FILES_SIZE (sizeof(document_root_files) / sizeof(document_root_files[0]))
+
+struct bench_t {
+    const char* name;
+    void (*run)(void);
+    size_t ops_per_run;
+    long iterations;
+};
+
+struct bench_result_t {
+    char name[BENCH_NAME_MAX_LEN + 1];
+    double ns_per_op;
+    double relative_cost; //ns/op divided by the ns/op of the reference workload
+    double allocs_per_op;
+};
+
+static char scratch[CORPUS_SIZE][4096];
+static size_t lengths[CORPUS_SIZE];
+static struct http_request_t requests[CORPUS_SIZE];
+static struct http_field_t request_headers[CORPUS_SIZE][HTTP_MAX_HEADERS_COUNT];
+static char decoded_paths[CORPUS_SIZE][4096];
+static struct evbuffer* output;
+
+//CPU time of the thread, other processes running meanwhile do not count
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void fail(const char* what, size_t i) {
+    fprintf(stderr, "%s failed on request %zu\n", what, i);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_request(size_t i) {
+    memcpy(scratch[i], corpus[i], lengths[i]);
+    requests[i] = (struct http_request_t)HTTP_REQUEST_INITIALIZER;
+    requests[i].headers = request_headers[i];
+    requests[i].headers_capacity = HTTP_MAX_HEADERS_COUNT;
+    if (parse_http_request(scratch[i], lengths[i], &requests[i]) != OK) {
+        fail("parse_http_request()", i);
+    }
+}
+
+static void run_parse(void) {
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        parse_request(i);
+    }
+}
+
+static void run_url_decode(void) {
+    static char path[256];
+    for (size_t i = 0; i < ENCODED_PATHS_SIZE; i++) {
+        size_t len = strlen(encoded_paths[i]);
+        memcpy(path, encoded_paths[i], len + 1);
+        __asm__ volatile("" : : "r"(url_decode(path, len)) : "memory");
+    }
+}
+
+static void run_inspect_file(void) {
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        struct file_t file = FILE_INITIALIZER;
+        if (inspect_file(decoded_paths[i], &file, true) != FILE_STATE_OK) {
+            fail("inspect_file()", i);
+        }
+        close(file.fd);
+        free(file.path);
+    }
+}
+
+static void run_build_http_response(void) {
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        struct http_response_t resp = HTTP_RESPONSE_INITIALIZER;
+        enum http_state_t state = build_http_response(&requests[i], &resp);
+        if (state != OK && state != PARTIAL_CONTENT) {
+            fail("build_http_response()", i);
+        }
+        file_cache_release(resp.file_entry);
+    }
+}
+
+static void run_respond(void) {
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        struct http_response_t resp = HTTP_RESPONSE_INITIALIZER;
+        enum http_state_t state = build_http_response(&requests[i], &resp);
+        if (state != OK && state != PARTIAL_CONTENT) {
+            fail("build_http_response()", i);
+        }
+        respond(output, &resp);
+        file_cache_release(resp.file_entry);
+        evbuffer_drain(output, evbuffer_get_length(output)); //as if written to the socket
+    }
+}
+
+//The reference workload: copies every request and splits it into lower-cased header names and
+//values, the loads, stores and data-dependent branches the request path is made of, without syscalls.
+//Aligned and never inlined: its loop runs alike wherever a change of the server code moves it
+__attribute__((noinline, aligned(64))) static void run_reference(void) {
+    static char copy[4096];
+    size_t fields = 0;
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        memcpy(copy, corpus[i], lengths[i] + 1);
+        bool in_name = false;
+        for (char* c = copy; *c != '\0'; c++) {
+            if (*c == '\n') {
+                in_name = true;
+            } else if (*c == ':' && in_name) {
+                in_name = false;
+                fields++;
+            } else if (in_name && *c >= 'A' && *c <= 'Z') {
+                *c = (char)(*c - 'A' + 'a');
+            }
+        }
+    }
+    __asm__ volatile("" : : "r"(fields), "r"(copy) : "memory");
+}
+
+static double time_runs(void (*run)(void), long iterations, size_t ops_per_run) {
+    double start = now_ns();
+    for (long it = 0; it < iterations; it++) {
+        run();
+    }
+    return (now_ns() - start) / ((double)iterations * (double)ops_per_run);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static struct bench_result_t bench(const struct bench_t* b) {
+    struct bench_result_t result = {"", 0, 0, 0};
+    snprintf(result.name, sizeof(result.name), "%s", b->name);
+    b->run(); //warms the file cache and the evbuffer chains
+    double round_ns[BENCH_ROUNDS];
+    double round_relative[BENCH_ROUNDS];
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        double reference_ns = time_runs(run_reference, REFERENCE_ITERATIONS, CORPUS_SIZE);
+        allocations = 0;
+        round_ns[round] = time_runs(b->run, b->iterations, b->ops_per_run);
+        result.allocs_per_op = (double)allocations / ((double)b->iterations * (double)b->ops_per_run);
+        round_relative[round] = round_ns[round] / reference_ns;
+    }
+    qsort(round_ns, BENCH_ROUNDS, sizeof(round_ns[0]), compare_doubles);
+    qsort(round_relative, BENCH_ROUNDS, sizeof(round_relative[0]), compare_doubles);
+    result.ns_per_op = round_ns[BENCH_ROUNDS / 2];
+    result.relative_cost = round_relative[BENCH_ROUNDS / 2];
+    printf("%-20s %10.1f ns/op %10.3f x reference %8.2f allocs/op\n",
+            result.name, result.ns_per_op, result.relative_cost, result.allocs_per_op);
+    return result;
+}
+
+static void write_file(const char* path, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)size) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+static void generate_document_root(char* root) {
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    char path[4096 + 64];
+    for (size_t i = 0; i < DOCUMENT_ROOT_FILES_SIZE; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, document_root_files[i].path);
+        if (document_root_files[i].size == 0) {
+            mkdir(path, 0755);
+        } else {
+            write_file(path, document_root_files[i].size);
+        }
+    }
+}
+
+static void remove_document_root(const char* root) {
+    char path[4096 + 64];
+    for (size_t i = DOCUMENT_ROOT_FILES_SIZE; i > 0; i--) {
+        snprintf(path, sizeof(path), "%s/%s", root, document_root_files[i - 1].path);
+        remove(path);
+    }
+    remove(root);
+}
+
+static void save_baseline(const char* path, const struct bench_result_t* results, size_t count) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, BASELINE_HEADER);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(file, "%s %.4f %.2f\n", results[i].name, results[i].relative_cost, results[i].allocs_per_op);
+    }
+    fclose(file);
+}
+
+//Returns the number of functions read into baseline, -1 if there is no baseline of the current format
+static int load_baseline(const char* path, struct bench_result_t* baseline, size_t capacity) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    if (fgets(line, sizeof(line), file) == NULL || strcmp(line, BASELINE_HEADER) != 0) {
+        fprintf(stderr, "%s was written by an older bench_suite, record it again with -s\n", path);
+        fclose(file);
+        return -1;
+    }
+    size_t count = 0;
+    while (count < capacity && fgets(line, sizeof(line), file) != NULL) {
+        struct bench_result_t* base = &baseline[count];
+        if (line[0] != '#' && sscanf(line, "%31s %lf %lf", base->name, &base->relative_cost, &base->allocs_per_op) == 3) {
+            count++;
+        }
+    }
+    fclose(file);
+    return (int)count;
+}
+
+//Functions missing from the baseline are not checked
+static bool regressed(const struct bench_result_t* result, const struct bench_result_t* baseline, size_t count,
+        double threshold, bool report) {
+    for (size_t i = 0; i < count; i++) {
+        const struct bench_result_t* base = &baseline[i];
+        if (strcmp(result->name, base->name) != 0) {
+            continue;
+        }
+        double limit = base->relative_cost * (1.0 + threshold / 100.0);
+        bool slower = result->relative_cost > limit;
+        bool allocates_more = result->allocs_per_op > base->allocs_per_op + 0.01;
+        if (report && slower) {
+            fprintf(stderr, "%s regressed: %.3f x reference, baseline %.3f, limit %.3f\n",
+                    base->name, result->relative_cost, base->relative_cost, limit);
+        }
+        if (report && allocates_more) {
+            fprintf(stderr, "%s regressed: %.2f allocs/op, baseline %.2f allocs/op\n",
+                    base->name, result->allocs_per_op, base->allocs_per_op);
+        }
+        return slower || allocates_more;
+    }
+    return false;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: bench_suite [-n iterations] [-s baseline] [-c baseline] [-t threshold percent]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    long iterations = DEFAULT_ITERATIONS;
+    const char* save_path = NULL;
+    const char* check_path = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:c:t:")) != -1) {
+        switch (opt) {
+            case 'n': {
+                iterations = atol(optarg);
+                break;
+            }
+            case 's': {
+                save_path = optarg;
+                break;
+            }
+            case 'c': {
+                check_path = optarg;
+                break;
+            }
+            case 't': {
+                threshold = atof(optarg);
+                break;
+            }
+            default: {
+                usage();
+            }
+        }
+    }
+    if (iterations < 1 || threshold < 0) {
+        usage();
+    }
+
+    slab_use_for_libevent(); //as in the workers
+    struct config_t config = CONFIG_INITIALIZER;
+    snprintf(config.document_root, sizeof(config.document_root), "/tmp/bench_suite.XXXXXX");
+    generate_document_root(config.document_root);
+    init_config(&config);
+    mime_types_load(NULL);
+    if (open_document_root() < 0) {
+        remove_document_root(config.document_root);
+        return EXIT_FAILURE;
+    }
+    http_date_refresh();
+    output = evbuffer_new();
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        lengths[i] = strlen(corpus[i]);
+        parse_request(i);
+        snprintf(decoded_paths[i], sizeof(decoded_paths[i]), "%s", requests[i].URI);
+    }
+
+    const struct bench_t benches[] = {
+            {"parse_http_request", run_parse, CORPUS_SIZE, iterations},
+            {"url_decode", run_url_decode, ENCODED_PATHS_SIZE, iterations},
+            {"inspect_file", run_inspect_file, CORPUS_SIZE, iterations / 10 + 1},
+            {"build_http_response", run_build_http_response, CORPUS_SIZE, iterations},
+            {"respond", run_respond, CORPUS_SIZE, iterations},
+    };
+    size_t count = sizeof(benches) / sizeof(benches[0]);
+    struct bench_result_t results[sizeof(benches) / sizeof(benches[0])];
+    for (size_t i = 0; i < count; i++) {
+        results[i] = bench(&benches[i]);
+    }
+
+    int exit_code = EXIT_SUCCESS;
+    if (save_path != NULL) {
+        save_baseline(save_path, results, count);
+    }
+    if (check_path != NULL) {
+        struct bench_result_t baseline[BASELINE_MAX_SIZE];
+        int baseline_count = load_baseline(check_path, baseline, BASELINE_MAX_SIZE);
+        if (baseline_count < 0) {
+            printf("Nothing to compare with, skipped\n");
+            exit_code = BENCH_SKIPPED;
+        }
+        //A function over the limit is measured again, a single slow median is mostly noise of the machine
+        for (size_t i = 0; i < count && baseline_count >= 0; i++) {
+            for (int attempt = 1; attempt <= BENCH_ATTEMPTS; attempt++) {
+                bool last = attempt == BENCH_ATTEMPTS;
+                if (!regressed(&results[i], baseline, (size_t)baseline_count, threshold, last)) {
+                    break;
+                }
+                if (last) {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                printf("%s over the limit, measuring again\n", results[i].name);
+                results[i] = bench(&benches[i]);
+            }
+        }
+    }
+
+    evbuffer_free(output);
+    remove_document_root(config.document_root);
+    return exit_code;
+}
@@ -0,0 +1,52 @@
+#ifndef HIGHLOADSERVER_ACCESS_LOG_H
+#define HIGHLOADSERVER_ACCESS_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "http.h"
+
+//Binary access log. Every worker appends fixed-size records to its own
+//in-memory block; full blocks (or the current one, once per
+//ACCESS_LOG_FLUSH_INTERVAL) are handed to a writer thread, which does the
+//write() and the size-based rotation off the event loop. After a reload the
+//draining worker and the new worker with the same id share the file.
+//File layout: ACCESS_LOG_MAGIC, then records, each followed by uri_len URI bytes.
+//Convert to text with the access_log_dump tool.
+
+#define ACCESS_LOG_MAGIC "HLSALOG1"
+#define ACCESS_LOG_MAGIC_LEN 8
+
+struct access_log_record_t {
+    uint64_t timestamp_us; //wall clock time the response was queued, microseconds since the epoch
+    uint64_t bytes_sent; //response head and body queued for the client
+    uint32_t latency_us; //from the complete request to the queued response
+    uint16_t status;
+    uint16_t worker_id;
+    uint8_t method; //enum request_method_t
+    uint8_t reserved;
+    uint16_t uri_len;
+    uint32_t padding;
+};
+
+struct access_log_entry_t {
+    enum request_method_t method;
+    enum http_state_t status;
+    const char* uri; //NULL when the request line could not be parsed
+    size_t uri_len;
+    uint64_t bytes_sent;
+    uint64_t latency_us;
+};
+#define ACCESS_LOG_ENTRY_INITIALIZER {METHOD_UNDEFINED, STATE_UNDEFINED, NULL, 0, 0, 0}
+
+struct access_log_t;
+
+//Opens "<ACCESS_LOG_PATH>.<worker_id>", returns NULL if the access log is disabled or on error
+struct access_log_t* access_log_open(int worker_id);
+void access_log_write(struct access_log_t* access_log, const struct access_log_entry_t* entry);
+//Hands the current block to the writer thread, called from a timer
+void access_log_flush(struct access_log_t* access_log);
+//Flushes, waits for the writer and closes the file
+void access_log_close(struct access_log_t* access_log);
+
+#endif //HIGHLOADSERVER_ACCESS_LOG_H
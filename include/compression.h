@@ -0,0 +1,26 @@
+#ifndef HIGHLOADSERVER_COMPRESSION_H
+#define HIGHLOADSERVER_COMPRESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum content_encoding_t {
+    CONTENT_ENCODING_IDENTITY,
+    CONTENT_ENCODING_GZIP,
+    CONTENT_ENCODING_BR
+};
+#define STR_CONTENT_ENCODING_GZIP "gzip\0"
+#define STR_CONTENT_ENCODING_BR "br\0"
+#define CONTENT_ENCODING_MASK(encoding) (1u << (encoding))
+
+//br needs the server to be built with libbrotlienc (HAVE_BROTLI)
+bool is_content_encoding_supported(enum content_encoding_t encoding);
+//".gz" or ".br": precompressed siblings are looked up as <uri><suffix>
+const char* content_encoding_t_to_file_suffix(enum content_encoding_t encoding);
+const char* content_encoding_t_to_string(enum content_encoding_t encoding);
+
+//Compresses src into a heap buffer owned by the caller, returns -1 on error
+int compress_buffer(enum content_encoding_t encoding, const char* src, size_t src_len,
+                    char** dest, size_t* dest_len);
+
+#endif //HIGHLOADSERVER_COMPRESSION_H
@@ -1,7 +1,47 @@
 #ifndef HIGHLOADSERVER_CONFIG_H
 #define HIGHLOADSERVER_CONFIG_H
 
-void init_config(int cpu_limit_arg, const char* document_root_arg);
+#include <stddef.h>
+
+enum worker_mode_t {
+    WORKER_MODE_FORK, //one process per worker, every process warms its own caches
+    WORKER_MODE_THREAD //one thread per worker, caches are shared
+};
+#define STR_WORKER_MODE_FORK "fork\0"
+#define STR_WORKER_MODE_THREAD "thread\0"
+
+#define CPU_AFFINITY_MAX_LEN 256
+
+struct config_t {
+    int cpu_limit;
+    char document_root[4096];
+    size_t response_cache_size;
+    size_t response_cache_max_file_size;
+    enum worker_mode_t worker_mode;
+    int cpu_affinity[CPU_AFFINITY_MAX_LEN];
+    int cpu_affinity_len;
+    char access_log[4096];
+    size_t access_log_max_size;
+    size_t file_body_copy_max_size;
+    size_t file_body_mmap_max_size;
+    _Bool io_uring;
+    int io_threads;
+    char mime_types[4096];
+    int keepalive_timeout;
+    int header_timeout;
+    int write_timeout;
+    int max_connections;
+    int metrics_port;
+};
+#define CONFIG_INITIALIZER {1, "\0", DEFAULT_RESPONSE_CACHE_SIZE, DEFAULT_RESPONSE_CACHE_MAX_FILE_SIZE, \
+                            WORKER_MODE_FORK, {0}, 0, "\0", DEFAULT_ACCESS_LOG_MAX_SIZE, \
+                            DEFAULT_FILE_BODY_COPY_MAX_SIZE, DEFAULT_FILE_BODY_MMAP_MAX_SIZE, 0, DEFAULT_IO_THREADS, \
+                            DEFAULT_MIME_TYPES_PATH, DEFAULT_KEEPALIVE_TIMEOUT, DEFAULT_HEADER_TIMEOUT, \
+                            DEFAULT_WRITE_TIMEOUT, DEFAULT_MAX_CONNECTIONS, DEFAULT_METRICS_PORT}
+
+void init_config(const struct config_t* config_arg);
+//Replaces the configuration on reload, only in the master while no worker runs in its process
+void update_config(const struct config_t* config_arg);
 //Ручки, заданные через булевы переменные проверяются через #ifdef
 //Для отключения просто закомментировать
 
@@ -9,18 +49,123 @@ void init_config(int cpu_limit_arg, const char* document_root_arg);
 #define VERSION "1.1"
 #define APP_NAME "FastHttpServer"
 //#define DEBUG_MODE
+//#define STAGE_PROFILING //per-stage request timing histograms of every worker, logged on SIGUSR1
 #define DEFAULT_USER "httpd"
 #define DEFAULT_PORT 80
 int _get_cpu_limit(void);
-#define CPU_LIMIT _get_cpu_limit()
+#define CPU_LIMIT _get_cpu_limit() //number of workers
+#define ACCEPT_STATS_INTERVAL 10 //seconds between per-worker accept counter reports
+#define WORKER_DRAIN_TIMEOUT 30 //seconds a replaced worker waits for its connections before it exits
+enum worker_mode_t _get_worker_mode(void);
+#define WORKER_MODE _get_worker_mode()
+//Worker i is pinned to CPU_AFFINITY[i % CPU_AFFINITY_LEN], no pinning if the list is empty
+int* _get_cpu_affinity(void);
+#define CPU_AFFINITY _get_cpu_affinity()
+int _get_cpu_affinity_len(void);
+#define CPU_AFFINITY_LEN _get_cpu_affinity_len()
+
+//Connection settings, timeouts are in seconds and 0 disables them
+#define DEFAULT_KEEPALIVE_TIMEOUT 15 //idle keep-alive connection between requests
+#define DEFAULT_HEADER_TIMEOUT 10 //from the first byte of a request (or the accept) to its complete headers
+#define DEFAULT_WRITE_TIMEOUT 60 //without any progress while a response is being written
+#define DEFAULT_MAX_CONNECTIONS 4096 //per worker, accepting is paused at the limit; 0 is unlimited
+int _get_keepalive_timeout(void);
+#define KEEPALIVE_TIMEOUT _get_keepalive_timeout()
+int _get_header_timeout(void);
+#define HEADER_TIMEOUT _get_header_timeout()
+int _get_write_timeout(void);
+#define WRITE_TIMEOUT _get_write_timeout()
+int _get_max_connections(void);
+#define MAX_CONNECTIONS _get_max_connections() //lowered by the workers when RLIMIT_NOFILE is too small
+#define WORKER_RESERVED_FDS 32 //for listen sockets, event bases, rings, pools and logs, not for connections
+//Pipelined requests are not read while more than the high watermark of responses waits
+//in the output, reading resumes once the client drained it below the low watermark
+#define CONN_OUTPUT_HIGH_WATERMARK (1024 * 1024)
+#define CONN_OUTPUT_LOW_WATERMARK (256 * 1024)
+
+//Metrics settings
+//Every worker counts into its own slot of a segment shared across fork(), worker 0 serves
+//the sum of all slots in the Prometheus text format on 127.0.0.1:METRICS_PORT/metrics
+#define DEFAULT_METRICS_PORT 0 //0 disables the metrics
+int _get_metrics_port(void);
+#define METRICS_PORT _get_metrics_port()
+#define METRICS_LOOP_LAG_INTERVAL_MS 100 //event loop lag is sampled by a timer this often
+#define METRICS_REQUEST_TIMEOUT 5 //seconds a scrape connection may take to send its request
+
+//Slab allocator settings
+#define SLAB_MIN_BLOCK_SIZE 64 //power of two
+#define SLAB_MAX_BLOCK_SIZE (32 * 1024) //power of two, larger blocks always come from malloc()
+#define SLAB_CACHE_BYTES_PER_CLASS (1024 * 1024) //freed blocks every thread keeps per size class
 
 //Logger settings
 #define LOG_LEVEL 1 //0 = DEBUG ... 5 = FATAL
 #define DO_COLOR_LOG
 //#define LOG_FULL_FILE_PATH
+#define LOG_RING_SLOTS 512 //records buffered per thread before messages are dropped, power of two
+#define LOG_RECORD_SIZE 512 //longer messages are truncated
+#define LOG_MAX_RINGS 256 //threads that may log
+#define LOG_FLUSH_TIMEOUT_MS 100 //flusher wait while every ring is empty, a new record wakes it earlier
+
+//Access log settings
+char* _get_access_log(void);
+#define ACCESS_LOG_PATH _get_access_log() //empty disables the access log
+#define DEFAULT_ACCESS_LOG_MAX_SIZE (64 * 1024 * 1024) //bytes per file before rotation
+size_t _get_access_log_max_size(void);
+#define ACCESS_LOG_MAX_SIZE _get_access_log_max_size()
+#define ACCESS_LOG_ROTATED_FILES 4 //<path>.<worker>.1 is the newest rotated file
+#define ACCESS_LOG_BLOCK_SIZE (64 * 1024)
+#define ACCESS_LOG_MAX_PENDING_BLOCKS 64 //records are dropped while the writer is this far behind
+#define ACCESS_LOG_FLUSH_INTERVAL 1 //seconds before a partially filled block is written
+#define ACCESS_LOG_MAX_URI_LEN 2048 //longer URIs are truncated
+
+//Compression settings
+//Compressed bodies are produced once and kept in the response cache, so files
+//above RESPONSE_CACHE_MAX_FILE_SIZE are only compressed via .gz/.br siblings
+#define GZIP_COMPRESSION_LEVEL 6 //1..9
+#define BROTLI_COMPRESSION_QUALITY 6 //0..11
 
 //FileSystem settings
 char* _get_document_root(void);
 #define DOCUMENT_ROOT _get_document_root()
+//Extension to Content-Type map in the mime.types format, loaded once at startup
+#define DEFAULT_MIME_TYPES_PATH "/etc/mime.types"
+char* _get_mime_types(void);
+#define MIME_TYPES_PATH _get_mime_types() //empty keeps the built-in html, css, js and image types
+
+//io_uring settings
+_Bool _get_io_uring(void);
+#define IO_URING_ENABLED _get_io_uring() //file cache misses are looked up with io_uring when the kernel has it
+#define URING_ENTRIES 256 //submission queue size of every worker ring
+
+//I/O thread pool settings
+//Without io_uring, file cache misses are looked up (and small files read) on a pool
+//of IO_THREADS threads per process instead of the event loop, 0 keeps them blocking.
+//Bodies compressed on the fly are compressed there with or without io_uring.
+#define DEFAULT_IO_THREADS 0
+int _get_io_threads(void);
+#define IO_THREADS _get_io_threads()
+
+//File cache settings
+#define FILE_CACHE_TTL 2 //seconds before a cached lookup is revalidated with stat()
+#define FILE_CACHE_MAX_ENTRIES 4096 //lowered at startup when RLIMIT_NOFILE is too small for it
+#define FILE_CACHE_MAX_NEGATIVE_ENTRIES 1024
+#define FILE_CACHE_BUCKETS 1024 //must be a power of two
+//File bodies up to FILE_BODY_COPY_MAX_SIZE are kept in memory and copied into the output,
+//up to FILE_BODY_MMAP_MAX_SIZE they are mapped once, larger ones are sent with sendfile()
+#define DEFAULT_FILE_BODY_COPY_MAX_SIZE (16 * 1024)
+#define DEFAULT_FILE_BODY_MMAP_MAX_SIZE (1024 * 1024)
+size_t _get_file_body_copy_max_size(void);
+#define FILE_BODY_COPY_MAX_SIZE _get_file_body_copy_max_size()
+size_t _get_file_body_mmap_max_size(void);
+#define FILE_BODY_MMAP_MAX_SIZE _get_file_body_mmap_max_size()
+
+//Response cache settings
+#define DEFAULT_RESPONSE_CACHE_SIZE (64 * 1024 * 1024) //memory budget in bytes, 0 disables the cache
+#define DEFAULT_RESPONSE_CACHE_MAX_FILE_SIZE (256 * 1024)
+#define RESPONSE_CACHE_BUCKETS 1024 //must be a power of two
+size_t _get_response_cache_size(void);
+#define RESPONSE_CACHE_SIZE _get_response_cache_size()
+size_t _get_response_cache_max_file_size(void);
+#define RESPONSE_CACHE_MAX_FILE_SIZE _get_response_cache_max_file_size()
 
 #endif //HIGHLOADSERVER_CONFIG_H
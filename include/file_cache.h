@@ -0,0 +1,75 @@
+#ifndef HIGHLOADSERVER_FILE_CACHE_H
+#define HIGHLOADSERVER_FILE_CACHE_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "file_system.h"
+
+struct evbuffer_file_segment;
+struct event;
+struct uring_t;
+struct io_pool_t;
+
+//A connection parked on a FILE_STATE_PENDING entry, wake_event is activated once the lookup has finished
+struct file_cache_waiter_t {
+    struct event* wake_event;
+    struct file_cache_waiter_t* next;
+};
+
+//How the body of a cached file is queued, chosen by size when it is first sent
+enum file_body_tier_t {
+    FILE_BODY_UNDEFINED, //not prepared yet
+    FILE_BODY_COPY, //the file is read into memory once and copied into every response
+    FILE_BODY_MMAP, //one mapping of the file is referenced by every response
+    FILE_BODY_SENDFILE, //one segment is shared and the kernel copies the file with sendfile()
+    FILE_BODY_TIERS_COUNT
+};
+#define STR_FILE_BODY_UNDEFINED "undefined\0"
+#define STR_FILE_BODY_COPY "copy\0"
+#define STR_FILE_BODY_MMAP "mmap\0"
+#define STR_FILE_BODY_SENDFILE "sendfile\0"
+
+const char* file_body_tier_t_to_string(enum file_body_tier_t tier);
+
+//Per-worker cache of inspect_file() results keyed by request URI.
+//Positive entries keep the file open, so responses share one fd.
+//Negative entries (404/403) are cached too, in an LRU list of their own.
+//Every entry is revalidated after FILE_CACHE_TTL seconds.
+struct file_cache_entry_t {
+    char* uri;
+    uint64_t hash;
+    enum file_state_t state;
+    struct file_t file;
+    time_t validated_at;
+    enum file_body_tier_t body_tier;
+    char* body; //FILE_BODY_COPY only
+    struct evbuffer_file_segment* body_segment; //FILE_BODY_MMAP and FILE_BODY_SENDFILE, owns a dup() of file.fd
+    struct file_cache_waiter_t* waiters; //while FILE_STATE_PENDING
+    unsigned int refcount; //references held by in-flight responses
+    bool detached; //removed from the table, freed on last release
+    struct file_cache_entry_t* bucket_next;
+    struct file_cache_entry_t* lru_prev;
+    struct file_cache_entry_t* lru_next;
+};
+
+//On FILE_STATE_OK and FILE_STATE_PENDING *entry holds a reference which must be given back with file_cache_release()
+enum file_state_t file_cache_acquire(const char* uri, struct file_cache_entry_t** entry);
+void file_cache_retain(struct file_cache_entry_t* entry);
+void file_cache_release(struct file_cache_entry_t* entry);
+//Loads the body of a referenced entry on first use, returns its tier or FILE_BODY_UNDEFINED on error.
+//The body and the segment stay valid and unchanged while the reference is held.
+enum file_body_tier_t file_cache_prepare_body(struct file_cache_entry_t* entry);
+
+//Caps the positive entries, each of which may hold two fds, to fit the process fd limit
+void file_cache_set_max_entries(size_t count);
+//Misses of the calling thread are looked up through ring from now on: file_cache_acquire() then
+//returns FILE_STATE_PENDING right away and the request is retried once the entry is complete
+void file_cache_use_uring(struct uring_t* ring);
+//Same without io_uring: misses are looked up on the I/O thread pool, small files are read there too
+void file_cache_use_io_pool(struct io_pool_t* pool);
+//Parks waiter on a pending entry, false if the lookup has already finished
+bool file_cache_wait(struct file_cache_entry_t* entry, struct file_cache_waiter_t* waiter);
+void file_cache_cancel_wait(struct file_cache_entry_t* entry, struct file_cache_waiter_t* waiter);
+
+#endif //HIGHLOADSERVER_FILE_CACHE_H
@@ -2,37 +2,41 @@
 #define HIGHLOADSERVER_FILE_SYSTEM_H
 
 #include <stdint-gcc.h>
+#include <sys/types.h>
+#include <time.h>
 
-enum mime_t {
-    MIME_TYPE_APPLICATION_OCTET_STREAM,
-    MIME_TYPE_TEXT_HTML,
-    MIME_TYPE_TEXT_CSS,
-    MIME_TYPE_APPLICATION_JAVASCRIPT,
-    MIME_TYPE_IMAGE_JPEG,
-    MIME_TYPE_IMAGE_PNG,
-    MIME_TYPE_IMAGE_GIF,
-    MIME_TYPE_APPLICATION_X_SHOCKWAVE_FLASH
-};
-
-char* mime_type_to_str(enum mime_t mime_type);
+#include "mime.h"
 
 struct file_t {
-    char* path;
+    char* path; //heap allocated by inspect_file(), owned by the caller
     int64_t len;
     int fd;
-    enum mime_t mime_type;
+    const struct mime_type_t* mime_type;
+    time_t mtime;
+    ino_t ino;
 };
-#define FILE_INITIALIZER {NULL, -1, -1, MIME_TYPE_APPLICATION_OCTET_STREAM}
+#define FILE_INITIALIZER {NULL, -1, -1, &MIME_TYPE_OCTET_STREAM, 0, 0}
 
 enum file_state_t {
     FILE_STATE_INTERNAL_ERROR,
     FILE_STATE_FORBIDDEN,
     FILE_STATE_NOT_FOUND,
-    FILE_STATE_OK
+    FILE_STATE_OK,
+    FILE_STATE_PENDING //looked up asynchronously, only seen in the file cache
 };
 
 #define INDEX_FILE_NAME "/index.html\0"
 
+//Opens DOCUMENT_ROOT once, every lookup is then resolved beneath it with openat2(RESOLVE_BENEATH),
+//or with openat() and '..' segments rejected on kernels without openat2(). -1 on error
+int open_document_root(void);
+//path is the decoded request path, paths escaping the document root give FILE_STATE_FORBIDDEN
 enum file_state_t inspect_file(char* path, struct file_t* file, _Bool should_get_fd);
 
+struct uring_t;
+//inspect_file(path, file, true) with openat2() going through ring and fstat() of the opened fd. done is called from
+//the worker's event loop, or right away when the lookup needs no I/O or the ring refuses it.
+void inspect_file_async(struct uring_t* ring, const char* path, struct file_t* file,
+                        void (*done)(enum file_state_t state, void* arg), void* arg);
+
 #endif //HIGHLOADSERVER_FILE_SYSTEM_H
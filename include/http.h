@@ -3,6 +3,8 @@
 
 #include "config.h"
 #include "file_system.h"
+#include "file_cache.h"
+#include "compression.h"
 
 enum request_method_t {
     METHOD_UNDEFINED,
@@ -22,63 +24,96 @@ enum http_version_t {
 
 enum http_state_t {
     STATE_UNDEFINED = 0,
+    STATE_PENDING = 1, //not a response: resp->file_entry is still being looked up
     OK = 200,
+    PARTIAL_CONTENT = 206,
+    NOT_MODIFIED = 304,
     BAD_REQUEST = 400,
     FORBIDDEN = 403,
     NOT_FOUND = 404,
     METHOD_NOT_ALLOWED = 405,
+    RANGE_NOT_SATISFIABLE = 416,
+    REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
     INTERNAL_SERVER_ERROR = 500
 };
 #define STR_200_OK "200 OK\0"
+#define STR_206_PARTIAL_CONTENT "206 Partial Content\0"
+#define STR_304_NOT_MODIFIED "304 Not Modified\0"
 #define STR_400_BAD_REQUEST "400 Bad Request\0"
 #define STR_403_FORBIDDEN "403 Forbidden\0"
 #define STR_404_NOT_FOUND "404 Not Found\0"
 #define STR_405_METHOD_NOT_ALLOWED "405 Method Not Allowed\0"
+#define STR_416_RANGE_NOT_SATISFIABLE "416 Range Not Satisfiable\0"
+#define STR_431_REQUEST_HEADER_FIELDS_TOO_LARGE "431 Request Header Fields Too Large\0"
 #define STR_500_INTERNAL_SERVER_ERROR "500 Internal Server Error\0"
 
 #define STR_CONNECTION_KEEP_ALIVE_HEADER "Connection: keep-alive\r\n\0"
 #define STR_CONNECTION_CLOSE_HEADER "Connection: close\r\n\0"
-#define STR_DEFAULT_DATE_HEADER "Date: Thu, 1 Jan 1970 00:00:00 GMT\r\n\0"
 #define STR_SERVER_HEADER "Server: "APP_NAME"/"VERSION"\r\n\0"
 #define STR_CONTENT_TYPE_HEADER "Content-Type: \0"
 #define STR_CONTENT_LENGTH_HEADER "Content-Length: \0"
 #define STR_CONTENT_LENGTH_ZERO_HEADER "Content-Length: 0\r\n\0"
 
-struct http_header_t {
+struct http_body_t {
     char* text;
     size_t len;
 };
-#define HTTP_HEADER_DEFAULT_BUFFER_SIZE 64
-#define HTTP_HEADER_INITIALIZER {NULL, 0}
+#define HTTP_BODY_INITIALIZER {NULL, 0}
 
-int build_date_header(struct http_header_t* header);
+#define HTTP_MAX_HEADERS_COUNT 64 //capacity used by the server, the parser honours headers_capacity
 
-struct http_body_t {
-    char* text;
-    size_t len;
+//Request header field, value has optional whitespace trimmed
+struct http_field_t {
+    const char* name;
+    size_t name_len;
+    const char* value;
+    size_t value_len;
 };
-#define HTTP_BODY_INITIALIZER {NULL, 0}
+#define HTTP_FIELD_INITIALIZER {NULL, 0, NULL, 0}
 
+//Every pointer refers to the request bytes inside the connection input buffer,
+//so a request is only valid until these bytes are drained.
 struct http_request_t {
     enum request_method_t method;
-    char* URI;
+    char* URI; //decoded in place and NUL-terminated, query string stripped
+    size_t URI_len;
     enum http_version_t http_version;
-    struct http_header_t* headers;
+    _Bool keep_alive; //from the Connection header, defaults to the HTTP version behaviour
+    struct http_field_t* headers; //caller provided array of headers_capacity fields
+    size_t headers_capacity;
     size_t headers_count;
-}; 
-#define HTTP_REQUEST_INITIALIZER {METHOD_UNDEFINED, NULL, VERSION_UNDEFINED, NULL, 0}
+};
+#define HTTP_REQUEST_INITIALIZER {METHOD_UNDEFINED, NULL, 0, VERSION_UNDEFINED, 0, NULL, 0, 0}
+#define HTTP_MAX_REQUEST_HEADERS_SIZE (16 * 1024) //larger requests are answered with 431
 
-enum http_state_t parse_http_request(char* req_str, struct http_request_t* req);
+//req_str must end with the empty line CRLFCRLF and must be writable
+enum http_state_t parse_http_request(char* req_str, size_t req_len, struct http_request_t* req);
+//Decodes %XX sequences of the request path in place, returns the decoded length
+size_t url_decode(char* url, size_t url_len);
+//Case-insensitive lookup of the first header with the given name, NULL if absent
+const struct http_field_t* find_http_header(const struct http_request_t* req, const char* name);
 
 struct http_response_t {
     enum http_state_t code;
     enum http_version_t http_version;
-    struct http_header_t* headers;
-    size_t headers_count;
-    struct file_t file_to_send;
+    _Bool keep_alive;
+    int64_t content_length; //of the range for 206
+    int64_t range_start; //first byte of file_to_send that is sent
+    _Bool has_content_type; //Content-Type is taken from file_to_send
+    enum content_encoding_t content_encoding;
+    _Bool compress_body; //file_to_send has to be compressed with content_encoding, only done by the response cache
+    _Bool vary_accept_encoding;
+    _Bool has_validators; //ETag and Last-Modified of file_to_send
+    _Bool accept_ranges;
+    struct file_t file_to_send; //a precompressed sibling keeps the mime type of the requested file
+    struct file_cache_entry_t* file_entry; //owns file_to_send, released by the caller
 };
-#define HTTP_RESPONSE_INITIALIZER {STATE_UNDEFINED, VERSION_UNDEFINED, NULL, 0, FILE_INITIALIZER}
+#define HTTP_RESPONSE_INITIALIZER {STATE_UNDEFINED, VERSION_UNDEFINED, 0, 0, 0, 0, CONTENT_ENCODING_IDENTITY, 0, 0, 0, 0, \
+                                   FILE_INITIALIZER, NULL}
 
+//OK, PARTIAL_CONTENT, NOT_MODIFIED or RANGE_NOT_SATISFIABLE on success, resp->file_entry is then referenced.
+//STATE_PENDING when a file lookup went to io_uring: resp->file_entry is referenced and has to be
+//waited for with file_cache_wait(), then the request is built again.
 enum http_state_t build_http_response(struct http_request_t* req, struct http_response_t* resp);
 
 char* request_method_t_to_string(enum request_method_t method);
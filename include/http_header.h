@@ -0,0 +1,54 @@
+#ifndef HIGHLOADSERVER_HTTP_HEADER_H
+#define HIGHLOADSERVER_HTTP_HEADER_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "http.h"
+
+//Response head serialization: every write_*() helper copies a complete header
+//line (CRLF included) to dest and returns the position right after it.
+//Static lines are precomputed, numbers are formatted without printf.
+
+#define HTTP_RESPONSE_HEAD_MAX_SIZE 1024
+
+struct http_line_t {
+    const char* text;
+    size_t len;
+};
+#define HTTP_LINE(str) {str, sizeof(str) - 1}
+
+//Rebuilds the calling thread's cached Date line. Every worker refreshes it from a
+//one second timer, so formatting the date never happens on the request path.
+void http_date_refresh(void);
+
+char* write_status_line(char* dest, enum http_version_t version, enum http_state_t code);
+char* write_connection_header(char* dest, bool keep_alive);
+char* write_date_header(char* dest);
+char* write_content_length_header(char* dest, int64_t content_len);
+//The line pre-rendered when the mime.types table was loaded
+char* write_content_type_header(char* dest, const struct mime_type_t* mime_type);
+char* write_server_header(char* dest);
+char* write_content_encoding_header(char* dest, enum content_encoding_t encoding);
+char* write_vary_header(char* dest);
+char* write_accept_ranges_header(char* dest);
+//"bytes <first>-<last>/<total>" for 206, "bytes */<total>" for 416
+char* write_content_range_header(char* dest, const struct http_response_t* resp);
+char* write_etag_header(char* dest, const struct file_t* file, enum content_encoding_t encoding);
+char* write_last_modified_header(char* dest, time_t mtime);
+char* write_uint(char* dest, uint64_t value);
+
+#define HTTP_ETAG_MAX_LEN 64
+//Strong validator of the representation: "<inode>-<size>-<mtime>" in hex, plus the coding if any
+size_t format_etag(char* dest, const struct file_t* file, enum content_encoding_t encoding);
+
+#define HTTP_DATE_LEN (sizeof("Sun, 06 Nov 1994 08:49:37 GMT") - 1)
+//IMF-fixdate of RFC 7231, writes HTTP_DATE_LEN bytes
+char* write_http_date(char* dest, time_t time);
+//Only IMF-fixdate is accepted, the obsolete RFC 850 and asctime formats are rejected with -1
+int parse_http_date(const char* str, size_t len, time_t* result);
+
+//Writes the status line, every header and the empty line. dest must hold HTTP_RESPONSE_HEAD_MAX_SIZE bytes.
+size_t serialize_http_response_head(const struct http_response_t* resp, char* dest);
+
+#endif //HIGHLOADSERVER_HTTP_HEADER_H
@@ -0,0 +1,26 @@
+#ifndef HIGHLOADSERVER_HTTP_SCAN_H
+#define HIGHLOADSERVER_HTTP_SCAN_H
+
+//Delimiter search for the HTTP parser. Every function returns the first
+//delimiter in [cursor, end) or end. The implementation (AVX2, SSE4.2 or
+//scalar) is picked on first use by the CPU features.
+
+//Stops on SP, CTL and DEL: end of the method, URI and version tokens
+const char* http_scan_token_end(const char* cursor, const char* end);
+//Stops on ':', SP, CTL and DEL: end of a header name
+const char* http_scan_header_name_end(const char* cursor, const char* end);
+//Stops on CTL except HTAB and on DEL: end of a header value
+const char* http_scan_header_value_end(const char* cursor, const char* end);
+
+enum http_scan_impl_t {
+    HTTP_SCAN_IMPL_SCALAR,
+    HTTP_SCAN_IMPL_SSE42,
+    HTTP_SCAN_IMPL_AVX2
+};
+
+enum http_scan_impl_t http_scan_get_impl(void);
+//Forces an implementation, falls back to a weaker one if the CPU lacks support. Used by benchmarks.
+enum http_scan_impl_t http_scan_set_impl(enum http_scan_impl_t impl);
+const char* http_scan_impl_t_to_string(enum http_scan_impl_t impl);
+
+#endif //HIGHLOADSERVER_HTTP_SCAN_H
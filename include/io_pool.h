@@ -0,0 +1,25 @@
+#ifndef HIGHLOADSERVER_IO_POOL_H
+#define HIGHLOADSERVER_IO_POOL_H
+
+//Blocking file system work runs on a small pool of threads shared by the workers
+//of a process. Every finished job is posted back to the event base of the worker
+//that submitted it (a list plus an eventfd), so its done callback runs on the
+//worker thread like any other libevent callback.
+
+struct event_base;
+struct io_pool_t; //the submitting side of one worker
+
+struct io_job_t {
+    void (*work)(struct io_job_t* job); //runs on a pool thread
+    void (*done)(struct io_job_t* job); //runs on the submitting worker's event loop
+    struct io_pool_t* pool;
+    struct io_job_t* next;
+};
+
+//Starts the IO_THREADS threads of this process on first use, NULL on error
+struct io_pool_t* io_pool_open(struct event_base* base);
+//Waits for the jobs of this worker still running and runs their done callbacks
+void io_pool_close(struct io_pool_t* pool);
+void io_pool_submit(struct io_pool_t* pool, struct io_job_t* job);
+
+#endif //HIGHLOADSERVER_IO_POOL_H
@@ -1,6 +1,10 @@
 #ifndef HIGHLOADSERVER_LOG_H
 #define HIGHLOADSERVER_LOG_H
 
+#include <stdint.h>
+
+#include "config.h"
+
 enum log_level_t {
     DEBUG,
     INFO,
@@ -10,8 +14,28 @@ enum log_level_t {
     FATAL
 };
 
-void _log(enum log_level_t log_level, const char* file, int line, const char* fmt, ...);
-#define log(log_level, fmt, ...) _log(log_level, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-//TODO develop timing profiling
+#ifdef DEBUG_MODE
+#define LOG_MIN_LEVEL DEBUG
+#else
+#define LOG_MIN_LEVEL LOG_LEVEL
+#endif
+
+//Messages are formatted into a per-thread lock-free ring and written out by a
+//background flusher thread. Levels below LOG_MIN_LEVEL are compiled out when
+//the level is a constant and never reach the formatting code otherwise.
+void _log(enum log_level_t log_level, const char* file, int line, const char* fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+#define log(log_level, fmt, ...) \
+    do { \
+        if ((log_level) >= LOG_MIN_LEVEL) { \
+            _log(log_level, __FILE__, __LINE__, fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+//Writes out everything logged so far, called before fork() and exit()
+void log_flush(void);
+//Messages lost because a thread's ring was full
+uint64_t log_dropped_count(void);
+//Per-stage request timing is in profile.h
 
 #endif //HIGHLOADSERVER_LOG_H
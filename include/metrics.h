@@ -0,0 +1,54 @@
+#ifndef HIGHLOADSERVER_METRICS_H
+#define HIGHLOADSERVER_METRICS_H
+
+#include <stdint.h>
+
+#include "http.h"
+
+//Live counters of every worker in one MAP_SHARED segment created before the workers are forked,
+//a new one for every generation of workers started by a reload. A scrape adds up the slots of the
+//current generation and of the previous one, which keeps counting while it drains; the generation
+//before that has exited by the next reload and its totals become the starting values of the new slots,
+//so counters never go back.
+//A worker only writes its own cache line aligned slot, with plain relaxed stores, so counting
+//takes no lock and no atomic read-modify-write; a scrape reads every slot with relaxed loads.
+
+#define METRICS_HISTOGRAM_BUCKETS 15 //the last one is +Inf
+#define METRICS_STATUS_CODES 11 //the last one counts codes without their own counter
+
+struct metrics_histogram_t {
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS]; //not cumulative, bounds are in metrics.c
+    uint64_t sum_us;
+};
+
+struct worker_metrics_t {
+    uint64_t requests[METRICS_STATUS_CODES];
+    uint64_t bytes_out; //response heads and bodies queued for clients
+    uint64_t accepted;
+    uint64_t connections; //open connections, a gauge
+    uint64_t response_cache_hits;
+    struct metrics_histogram_t request_duration; //from the complete request to the queued response
+    struct metrics_histogram_t loop_lag; //how late the lag timer fired
+} __attribute__((aligned(64)));
+
+struct metrics_t;
+
+//Maps the shared segment with a slot per worker, NULL on error. draining is the segment of the
+//generation being replaced, exited the one before it, both may be NULL
+struct metrics_t* metrics_create(int workers_count, const struct metrics_t* draining, const struct metrics_t* exited);
+//Unmaps the segment in the calling process only, forked workers keep their mapping
+void metrics_destroy(struct metrics_t* metrics);
+struct worker_metrics_t* metrics_worker(struct metrics_t* metrics, int worker_id);
+
+void metrics_count_request(struct worker_metrics_t* worker, enum http_state_t status, uint64_t bytes,
+                           uint64_t duration_us);
+void metrics_count_accept(struct worker_metrics_t* worker);
+void metrics_set_connections(struct worker_metrics_t* worker, unsigned int connections);
+void metrics_count_response_cache_hit(struct worker_metrics_t* worker);
+void metrics_count_loop_lag(struct worker_metrics_t* worker, uint64_t lag_us);
+
+struct evbuffer;
+//Appends a snapshot of every worker in the Prometheus text exposition format
+void metrics_write_prometheus(const struct metrics_t* metrics, struct evbuffer* output);
+
+#endif //HIGHLOADSERVER_METRICS_H
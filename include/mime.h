@@ -0,0 +1,33 @@
+#ifndef HIGHLOADSERVER_MIME_H
+#define HIGHLOADSERVER_MIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//MIME types by file extension, loaded once at startup from a mime.types file
+//("type ext1 ext2 ..." per line, '#' comments) and compiled into a perfect hash:
+//every known extension has its own slot, so a lookup is one hash and one compare.
+//The table is never modified after loading, workers share it without locking.
+
+struct mime_type_t {
+    const char* name; //"text/html"
+    const char* content_type_line; //"Content-Type: text/html\r\n"
+    size_t content_type_line_len;
+    bool compressible; //text, scripts, json and xml, worth a Content-Encoding
+};
+
+//Served for unknown extensions and files without one
+extern const struct mime_type_t MIME_TYPE_OCTET_STREAM;
+
+#define MIME_EXTENSION_MAX_LEN 15 //longer extensions are not indexed
+#define MIME_TYPE_MAX_LEN 127 //keeps the Content-Type line within the response head buffer
+
+//Builds the table from path, or from the built-in list (html, css, js, jpeg, png, gif, swf)
+//when path is NULL. Falls back to the built-in list and returns -1 when path can't be read.
+int mime_types_load(const char* path);
+//Case-insensitive, ext is the extension without the dot
+const struct mime_type_t* mime_type_by_extension(const char* ext, size_t len);
+//Extension of the last path segment, MIME_TYPE_OCTET_STREAM if there is none
+const struct mime_type_t* mime_type_by_path(const char* path);
+
+#endif //HIGHLOADSERVER_MIME_H
@@ -0,0 +1,48 @@
+#ifndef HIGHLOADSERVER_PROFILE_H
+#define HIGHLOADSERVER_PROFILE_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+//Per-stage request timing, compiled in with STAGE_PROFILING. Every worker thread keeps
+//a log-linear histogram of each stage in nanoseconds of CLOCK_MONOTONIC_RAW, a stage
+//lasts from the previous mark (or the read callback entry) to its own mark.
+//Without STAGE_PROFILING the macros expand to nothing.
+
+enum profile_stage_t {
+    PROFILE_HEADER_SEARCH, //read callback entry or the previous request to complete headers
+    PROFILE_PARSE,
+    PROFILE_FILE_LOOKUP, //build_http_response(): file cache and inspect_file()
+    PROFILE_LOOKUP_WAIT, //a parked request waiting for io_uring or the I/O threads
+    PROFILE_HEAD_BUILD,
+    PROFILE_OUTPUT_QUEUE, //body added to the output
+    PROFILE_REQUEST, //the whole request, up to the queued response
+    PROFILE_STAGES_COUNT
+};
+
+#ifdef STAGE_PROFILING
+
+uint64_t profile_now_ns(void);
+//Registers the calling thread's histograms under worker_id, to be dumped by profile_dump()
+void profile_register_worker(int worker_id);
+void profile_start(void);
+void profile_mark(enum profile_stage_t stage);
+void profile_since(enum profile_stage_t stage, uint64_t start_ns);
+void profile_end(void);
+//Logs count, percentiles and max of every stage of every registered worker of this process
+void profile_dump(void);
+
+#define PROFILE_START() profile_start()
+#define PROFILE_MARK(stage) profile_mark(stage)
+#define PROFILE_END() profile_end()
+
+#else
+
+#define PROFILE_START() ((void)0)
+#define PROFILE_MARK(stage) ((void)0)
+#define PROFILE_END() ((void)0)
+
+#endif //STAGE_PROFILING
+
+#endif //HIGHLOADSERVER_PROFILE_H
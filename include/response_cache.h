@@ -0,0 +1,48 @@
+#ifndef HIGHLOADSERVER_RESPONSE_CACHE_H
+#define HIGHLOADSERVER_RESPONSE_CACHE_H
+
+#include <stdbool.h>
+
+#include "file_cache.h"
+#include "http.h"
+
+struct io_pool_t;
+
+//Per-worker LRU of fully built 200 OK responses for small files, keyed by path and content encoding.
+//data holds the static headers followed by the empty line, and the body when it was compressed on the fly:
+//  Content-Length, Content-Type, Content-Encoding, Accept-Ranges, ETag, Last-Modified, Vary and Server headers | \r\n | compressed body
+//The status line, Connection and Date headers are added per request. Other bodies are the file as is,
+//they are taken from the file cache, which owns the bytes of small files.
+//It is also the compression cache: bodies compressed on the fly are only ever stored here.
+struct response_cache_entry_t {
+    char* path;
+    uint64_t hash;
+    enum content_encoding_t encoding;
+    ino_t ino;
+    time_t mtime;
+    int64_t len;
+    char* data;
+    size_t headers_len;
+    size_t data_len;
+    bool has_body; //compressed on the fly, otherwise the body is queued from the file cache entry
+    bool pending; //being compressed on the I/O pool, data is not set yet
+    unsigned int refcount;
+    bool detached;
+    struct response_cache_entry_t* bucket_next;
+    struct response_cache_entry_t* lru_prev;
+    struct response_cache_entry_t* lru_next;
+};
+
+bool is_response_cacheable(const struct file_t* file);
+
+//Returns a referenced entry for the body and headers resp describes, built on miss. NULL if the file
+//is not cacheable or could not be read, and while the body is compressed on the I/O pool: with one,
+//a compression miss starts a job and the requests until it has finished get the file as is.
+//*hit is set only when the entry was already cached.
+struct response_cache_entry_t* response_cache_acquire(const struct http_response_t* resp, bool* hit);
+//Bodies missing the cache are compressed on pool from now on, on the calling thread while it is NULL
+void response_cache_use_io_pool(struct io_pool_t* pool);
+void response_cache_retain(struct response_cache_entry_t* entry);
+void response_cache_release(struct response_cache_entry_t* entry);
+
+#endif //HIGHLOADSERVER_RESPONSE_CACHE_H
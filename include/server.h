@@ -1,6 +1,61 @@
 #ifndef HIGHLOADSERVER_SERVER_H
 #define HIGHLOADSERVER_SERVER_H
 
-int listen_and_serve(u_int16_t port);
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "config.h"
+
+struct worker_t {
+    int id;
+    pthread_t thread; //only in WORKER_MODE_THREAD
+    int listen_fd; //SO_REUSEPORT socket of this worker, kept open by the master across generations
+    struct event_base* base;
+    struct evconnlistener* listener;
+    struct event* stats_event;
+    struct event* date_event; //refreshes the cached Date header line every second
+    struct access_log_t* access_log; //NULL when the access log is disabled
+    struct event* access_log_event;
+    struct uring_t* ring; //file lookups go through io_uring, NULL when disabled or unsupported
+    struct io_pool_t* io_pool; //file lookups run on the I/O threads, only without ring
+    uint64_t accepted_count;
+    uint64_t reported_accepted_count;
+    uint64_t request_count;
+    uint64_t reported_request_count;
+    int metrics_fd; //127.0.0.1:METRICS_PORT, only worker 0 serves the metrics of all workers, -1 otherwise
+    struct evconnlistener* metrics_listener;
+    struct event* loop_lag_event;
+    struct event* quit_event; //SIGQUIT, in the first worker of a process
+#ifdef STAGE_PROFILING
+    struct event* profile_dump_event; //SIGUSR1, in the first worker of a process
+#endif
+    _Bool draining; //no longer accepting nor keeping connections alive, the event loop ends with the last one
+    unsigned int conn_count; //open connections
+    _Bool accept_paused; //the listener is disabled while conn_count is at MAX_CONNECTIONS
+};
+
+struct conn_t {
+    struct worker_t* worker;
+    struct bufferevent* bev;
+    size_t searched_len; //bytes of a partial request already searched for the headers end
+    _Bool close_after_write; //no more requests are read, freed once the output is flushed
+    struct request_ctx_t* parked; //the first unanswered request while its file is looked up, reading is paused meanwhile
+    struct request_ctx_t* parked_storage; //allocated on the first wait and reused by later ones
+    struct event* resume_event; //created on the first wait
+    uint64_t request_started_us; //first byte (or accept) of the request being read, 0 if none
+    _Bool idle; //the read timeout is KEEPALIVE_TIMEOUT, otherwise the header deadline of a request
+    _Bool output_throttled; //reading is paused until the output drains below CONN_OUTPUT_LOW_WATERMARK
+};
+
+//Runs the master process: binds the sockets, forks the workers and supervises them until SIGQUIT
+//(graceful) or SIGTERM/SIGINT. SIGHUP calls reload_config() and replaces the workers with a new
+//generation, SIGUSR2 executes the binary again with the sockets inherited.
+int listen_and_serve(u_int16_t port, char** argv, int (*reload_config)(void));
+
+struct evbuffer;
+struct http_response_t;
+//Queues the serialized head and the file body of resp, the way every worker answers
+void respond(struct evbuffer* output, struct http_response_t* resp);
 
 #endif //HIGHLOADSERVER_SERVER_H
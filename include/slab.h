@@ -0,0 +1,32 @@
+#ifndef HIGHLOADSERVER_SLAB_H
+#define HIGHLOADSERVER_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+//Per-thread caches of freed blocks in power of two size classes. Connection objects,
+//parked requests and every libevent allocation (bufferevents, evbuffer chains, events)
+//go through them, so a worker that has warmed up serves requests without touching
+//the heap. A block may be freed on another thread, it then joins that thread's cache.
+
+void* slab_malloc(size_t size);
+void* slab_calloc(size_t count, size_t size);
+void* slab_realloc(void* ptr, size_t size);
+void slab_free(void* ptr);
+
+//Routes libevent allocations through the slab caches, must run before any other libevent call
+void slab_use_for_libevent(void);
+
+#ifdef DEBUG_MODE
+struct slab_stats_t {
+    uint64_t heap_allocs; //blocks that came from malloc()
+    uint64_t heap_frees; //blocks given back with free()
+    uint64_t cached_allocs; //blocks reused from the calling thread's cache
+};
+//Counters of the calling thread
+struct slab_stats_t slab_get_stats(void);
+#endif
+
+#endif //HIGHLOADSERVER_SLAB_H
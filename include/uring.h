@@ -0,0 +1,31 @@
+#ifndef HIGHLOADSERVER_URING_H
+#define HIGHLOADSERVER_URING_H
+
+#include <stdbool.h>
+
+//Minimal io_uring engine over the raw syscalls: one ring per worker, polled by
+//the worker's event base. Completions are dispatched from the event loop, so
+//callbacks run on the worker thread like any other libevent callback.
+
+struct event_base;
+struct open_how;
+struct uring_t;
+
+struct uring_op_t {
+    void (*done)(struct uring_op_t* op, int result); //result is the syscall result or -errno
+    void* arg;
+};
+
+//NULL when the kernel has no io_uring (or it is forbidden), the caller then keeps to blocking calls
+struct uring_t* uring_open(struct event_base* base);
+void uring_close(struct uring_t* ring);
+
+//Queue one operation, -1 if the submission queue is full. op and every buffer must stay
+//valid until op->done is called. Queued operations are started by uring_submit(), those
+//the kernel refuses are finished right there with -ECANCELED.
+int uring_prep_openat(struct uring_t* ring, struct uring_op_t* op, int dirfd, const char* path, int flags);
+int uring_prep_openat2(struct uring_t* ring, struct uring_op_t* op, int dirfd, const char* path,
+                       const struct open_how* how);
+int uring_submit(struct uring_t* ring);
+
+#endif //HIGHLOADSERVER_URING_H
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <zconf.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "../include/access_log.h"
+#include "../include/config.h"
+#include "../include/log.h"
+
+struct access_log_block_t {
+    struct access_log_t* access_log;
+    size_t len;
+    struct access_log_block_t* next;
+    char data[ACCESS_LOG_BLOCK_SIZE];
+};
+
+struct access_log_t {
+    int worker_id;
+    struct access_log_block_t* block; //filled by the worker, NULL while the writer is behind
+    //Owned by the writer thread once the log is opened
+    int fd;
+    uint64_t file_size;
+    char path[4096 + 16];
+};
+
+//Blocks travel from the workers to the writer and back through these lists
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER; //a block was queued
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER; //the queue was drained
+static struct access_log_block_t* queue_head = NULL;
+static struct access_log_block_t* queue_tail = NULL;
+static size_t queue_len = 0;
+static bool writer_busy = false;
+static struct access_log_block_t* free_blocks = NULL;
+static bool writer_started = false; //the writer is started after fork(), in the process that logs
+
+static _Atomic uint64_t dropped_records = 0;
+static uint64_t reported_dropped_records = 0; //writer thread only
+
+static int open_log_file(struct access_log_t* access_log) {
+    access_log->fd = open(access_log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (access_log->fd < 0) {
+        log(ERROR, "Unable to open access log %s: %s", access_log->path, strerror(errno));
+        return -1;
+    }
+    flock(access_log->fd, LOCK_EX); //a file just created by another process gets one header
+    off_t size = lseek(access_log->fd, 0, SEEK_END);
+    access_log->file_size = size > 0 ? (uint64_t)size : 0;
+    if (access_log->file_size == 0) {
+        if (write(access_log->fd, ACCESS_LOG_MAGIC, ACCESS_LOG_MAGIC_LEN) != ACCESS_LOG_MAGIC_LEN) {
+            log(ERROR, "Unable to write access log header %s: %s", access_log->path, strerror(errno));
+        }
+        access_log->file_size = ACCESS_LOG_MAGIC_LEN;
+    }
+    flock(access_log->fd, LOCK_UN);
+    return 0;
+}
+
+//<path>.N-1 becomes <path>.N, the current file becomes <path>.1 and a new one is started.
+//While a generation drains, its worker and the new worker with the same id append to the same file:
+//the first one to take the lock renames it, the other one finds a new file under the path and reopens it
+static void rotate_log_file(struct access_log_t* access_log) {
+    int fd = access_log->fd;
+    flock(fd, LOCK_EX);
+    struct stat opened;
+    struct stat current;
+    bool renamed = fstat(fd, &opened) < 0 || stat(access_log->path, &current) < 0
+                   || opened.st_ino != current.st_ino || opened.st_dev != current.st_dev;
+    if (!renamed) {
+        char from[sizeof(access_log->path) + 16];
+        char to[sizeof(access_log->path) + 16];
+        for (int i = ACCESS_LOG_ROTATED_FILES - 1; i > 0; i--) {
+            snprintf(from, sizeof(from), "%s.%d", access_log->path, i);
+            snprintf(to, sizeof(to), "%s.%d", access_log->path, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", access_log->path);
+        if (rename(access_log->path, to) < 0) {
+            log(ERROR, "Unable to rotate access log %s: %s", access_log->path, strerror(errno));
+        }
+    }
+    open_log_file(access_log); //the new file has its header before the lock is released
+    close(fd);
+    if (!renamed) {
+        log(INFO, "Access log %s rotated", access_log->path);
+    }
+}
+
+static void write_block(struct access_log_block_t* block) {
+    struct access_log_t* access_log = block->access_log;
+    if (access_log->fd < 0) {
+        return;
+    }
+    size_t written_len = 0;
+    while (written_len < block->len) {
+        ssize_t written = write(access_log->fd, block->data + written_len, block->len - written_len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log(ERROR, "Unable to write access log %s: %s", access_log->path, strerror(errno));
+            break;
+        }
+        written_len += (size_t)written;
+    }
+    //Counts what another process appended as well
+    off_t end = lseek(access_log->fd, 0, SEEK_CUR);
+    access_log->file_size = end > 0 ? (uint64_t)end : access_log->file_size + written_len;
+    if (access_log->file_size >= ACCESS_LOG_MAX_SIZE) {
+        rotate_log_file(access_log);
+    }
+}
+
+static void* writer_routine(void* arg) {
+    pthread_mutex_lock(&queue_mutex);
+    while (1) {
+        while (queue_head == NULL) {
+            writer_busy = false;
+            pthread_cond_broadcast(&idle_cond);
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        }
+        writer_busy = true;
+        struct access_log_block_t* block = queue_head;
+        queue_head = block->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        queue_len--;
+        pthread_mutex_unlock(&queue_mutex);
+
+        write_block(block);
+        uint64_t dropped = atomic_load_explicit(&dropped_records, memory_order_relaxed);
+        if (dropped != reported_dropped_records) {
+            log(WARNING, "%lu access log records dropped: the writer is behind",
+                    (unsigned long)(dropped - reported_dropped_records));
+            reported_dropped_records = dropped;
+        }
+
+        pthread_mutex_lock(&queue_mutex);
+        block->len = 0;
+        block->next = free_blocks;
+        free_blocks = block;
+    }
+    return NULL;
+}
+
+//queue_mutex must be held
+static struct access_log_block_t* take_free_block(struct access_log_t* access_log) {
+    struct access_log_block_t* block = free_blocks;
+    if (block != NULL) {
+        free_blocks = block->next;
+    } else {
+        block = malloc(sizeof(struct access_log_block_t));
+        if (block == NULL) {
+            log(ERROR, "Unable to allocate memory");
+            return NULL;
+        }
+    }
+    block->access_log = access_log;
+    block->len = 0;
+    block->next = NULL;
+    return block;
+}
+
+//Queues the current block and takes an empty one, the worker keeps its block while the writer is behind
+static void hand_off_block(struct access_log_t* access_log) {
+    pthread_mutex_lock(&queue_mutex);
+    struct access_log_block_t* block = access_log->block;
+    if (block != NULL && block->len > 0 && queue_len < ACCESS_LOG_MAX_PENDING_BLOCKS) {
+        if (queue_tail != NULL) {
+            queue_tail->next = block;
+        } else {
+            queue_head = block;
+        }
+        queue_tail = block;
+        queue_len++;
+        pthread_cond_signal(&queue_cond);
+        block = NULL;
+    }
+    if (block == NULL) {
+        access_log->block = take_free_block(access_log);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+struct access_log_t* access_log_open(int worker_id) {
+    if (ACCESS_LOG_PATH[0] == '\0') {
+        return NULL;
+    }
+    struct access_log_t* access_log = calloc(1, sizeof(struct access_log_t));
+    if (access_log == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        return NULL;
+    }
+    access_log->worker_id = worker_id;
+    snprintf(access_log->path, sizeof(access_log->path), "%s.%d", ACCESS_LOG_PATH, worker_id);
+    if (open_log_file(access_log) < 0) {
+        free(access_log);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&queue_mutex);
+    access_log->block = take_free_block(access_log);
+    if (!writer_started) {
+        pthread_t writer;
+        if (pthread_create(&writer, NULL, writer_routine, NULL) != 0) {
+            log(ERROR, "Unable to start access log writer");
+        } else {
+            pthread_detach(writer);
+            writer_started = true;
+        }
+    }
+    bool ready = writer_started && access_log->block != NULL;
+    pthread_mutex_unlock(&queue_mutex);
+    if (!ready) {
+        access_log_close(access_log);
+        return NULL;
+    }
+    log(INFO, "Worker %d access log: %s", worker_id, access_log->path);
+    return access_log;
+}
+
+void access_log_write(struct access_log_t* access_log, const struct access_log_entry_t* entry) {
+    size_t uri_len = entry->uri != NULL ? entry->uri_len : 0;
+    if (uri_len > ACCESS_LOG_MAX_URI_LEN) {
+        uri_len = ACCESS_LOG_MAX_URI_LEN;
+    }
+    size_t record_len = sizeof(struct access_log_record_t) + uri_len;
+    struct access_log_block_t* block = access_log->block;
+    if (block == NULL || block->len + record_len > sizeof(block->data)) {
+        hand_off_block(access_log);
+        block = access_log->block;
+        if (block == NULL || block->len + record_len > sizeof(block->data)) {
+            atomic_fetch_add_explicit(&dropped_records, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    struct access_log_record_t record = {
+            .timestamp_us = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000,
+            .bytes_sent = entry->bytes_sent,
+            .latency_us = entry->latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)entry->latency_us,
+            .status = (uint16_t)entry->status,
+            .worker_id = (uint16_t)access_log->worker_id,
+            .method = (uint8_t)entry->method,
+            .uri_len = (uint16_t)uri_len,
+    };
+    memcpy(block->data + block->len, &record, sizeof(record));
+    if (uri_len > 0) {
+        memcpy(block->data + block->len + sizeof(record), entry->uri, uri_len);
+    }
+    block->len += record_len;
+}
+
+void access_log_flush(struct access_log_t* access_log) {
+    if (access_log->block != NULL && access_log->block->len == 0) {
+        return;
+    }
+    hand_off_block(access_log);
+}
+
+void access_log_close(struct access_log_t* access_log) {
+    if (access_log == NULL) {
+        return;
+    }
+    access_log_flush(access_log);
+    pthread_mutex_lock(&queue_mutex);
+    while (writer_started && (queue_head != NULL || writer_busy)) {
+        pthread_cond_wait(&idle_cond, &queue_mutex);
+    }
+    if (access_log->block != NULL) {
+        access_log->block->next = free_blocks;
+        free_blocks = access_log->block;
+        access_log->block = NULL;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    if (access_log->fd >= 0) {
+        close(access_log->fd);
+    }
+    free(access_log);
+}
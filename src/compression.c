@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "../include/compression.h"
+#include "../include/config.h"
+#include "../include/log.h"
+
+bool is_content_encoding_supported(enum content_encoding_t encoding) {
+    switch (encoding) {
+        case CONTENT_ENCODING_IDENTITY: {
+            return true;
+        }
+        case CONTENT_ENCODING_GZIP: {
+            return true;
+        }
+        case CONTENT_ENCODING_BR: {
+#ifdef HAVE_BROTLI
+            return true;
+#else
+            return false;
+#endif
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+const char* content_encoding_t_to_file_suffix(enum content_encoding_t encoding) {
+    switch (encoding) {
+        case CONTENT_ENCODING_GZIP: {
+            return ".gz\0";
+        }
+        case CONTENT_ENCODING_BR: {
+            return ".br\0";
+        }
+        default: {
+            return "\0";
+        }
+    }
+}
+
+const char* content_encoding_t_to_string(enum content_encoding_t encoding) {
+    switch (encoding) {
+        case CONTENT_ENCODING_GZIP: {
+            return STR_CONTENT_ENCODING_GZIP;
+        }
+        case CONTENT_ENCODING_BR: {
+            return STR_CONTENT_ENCODING_BR;
+        }
+        default: {
+            return "identity\0";
+        }
+    }
+}
+
+static int compress_gzip(const char* src, size_t src_len, char** dest, size_t* dest_len) {
+    z_stream stream = {0};
+    //15 window bits + 16 selects the gzip wrapper instead of zlib
+    if (deflateInit2(&stream, GZIP_COMPRESSION_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        log(ERROR, "Unable to init gzip stream: %s", stream.msg != NULL ? stream.msg : "unknown error");
+        return -1;
+    }
+    size_t capacity = deflateBound(&stream, (uLong)src_len);
+    char* buffer = malloc(capacity);
+    if (buffer == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        deflateEnd(&stream);
+        return -1;
+    }
+    stream.next_in = (Bytef*)src;
+    stream.avail_in = (uInt)src_len;
+    stream.next_out = (Bytef*)buffer;
+    stream.avail_out = (uInt)capacity;
+    int result = deflate(&stream, Z_FINISH);
+    size_t total_out = stream.total_out;
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+        log(ERROR, "Unable to gzip %zu bytes: %d", src_len, result);
+        free(buffer);
+        return -1;
+    }
+    *dest = buffer;
+    *dest_len = total_out;
+    return 0;
+}
+
+#ifdef HAVE_BROTLI
+static int compress_brotli(const char* src, size_t src_len, char** dest, size_t* dest_len) {
+    size_t capacity = BrotliEncoderMaxCompressedSize(src_len);
+    if (capacity == 0) {
+        log(ERROR, "Input is too large for brotli: %zu bytes", src_len);
+        return -1;
+    }
+    char* buffer = malloc(capacity);
+    if (buffer == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        return -1;
+    }
+    size_t encoded_len = capacity;
+    if (!BrotliEncoderCompress(BROTLI_COMPRESSION_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               src_len, (const uint8_t*)src, &encoded_len, (uint8_t*)buffer)) {
+        log(ERROR, "Unable to brotli-compress %zu bytes", src_len);
+        free(buffer);
+        return -1;
+    }
+    *dest = buffer;
+    *dest_len = encoded_len;
+    return 0;
+}
+#endif
+
+int compress_buffer(enum content_encoding_t encoding, const char* src, size_t src_len,
+                    char** dest, size_t* dest_len) {
+    if (src == NULL || dest == NULL || dest_len == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return -1;
+    }
+    switch (encoding) {
+        case CONTENT_ENCODING_GZIP: {
+            return compress_gzip(src, src_len, dest, dest_len);
+        }
+#ifdef HAVE_BROTLI
+        case CONTENT_ENCODING_BR: {
+            return compress_brotli(src, src_len, dest, dest_len);
+        }
+#endif
+        default: {
+            log(ERROR, "Unsupported content encoding: %d", encoding);
+            return -1;
+        }
+    }
+}
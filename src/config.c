@@ -3,26 +3,100 @@
 #include <memory.h>
 #include "../include/config.h"
 
-int cpu_limit = 1;
+struct config_t config = CONFIG_INITIALIZER;
+
 int _get_cpu_limit(void) {
-    return cpu_limit;
+    return config.cpu_limit;
 }
 
-char document_root[4096] = "\0";
 char* _get_document_root(void) {
-    return document_root;
+    return config.document_root;
+}
+
+size_t _get_response_cache_size(void) {
+    return config.response_cache_size;
+}
+
+size_t _get_response_cache_max_file_size(void) {
+    return config.response_cache_max_file_size;
+}
+
+enum worker_mode_t _get_worker_mode(void) {
+    return config.worker_mode;
+}
+
+int* _get_cpu_affinity(void) {
+    return config.cpu_affinity;
+}
+
+int _get_cpu_affinity_len(void) {
+    return config.cpu_affinity_len;
+}
+
+char* _get_access_log(void) {
+    return config.access_log;
+}
+
+size_t _get_access_log_max_size(void) {
+    return config.access_log_max_size;
+}
+
+size_t _get_file_body_copy_max_size(void) {
+    return config.file_body_copy_max_size;
+}
+
+size_t _get_file_body_mmap_max_size(void) {
+    return config.file_body_mmap_max_size;
+}
+
+_Bool _get_io_uring(void) {
+    return config.io_uring;
+}
+
+int _get_io_threads(void) {
+    return config.io_threads;
+}
+
+char* _get_mime_types(void) {
+    return config.mime_types;
+}
+
+int _get_keepalive_timeout(void) {
+    return config.keepalive_timeout;
+}
+
+int _get_header_timeout(void) {
+    return config.header_timeout;
+}
+
+int _get_write_timeout(void) {
+    return config.write_timeout;
+}
+
+int _get_max_connections(void) {
+    return config.max_connections;
+}
+
+int _get_metrics_port(void) {
+    return config.metrics_port;
 }
 
 bool init_func_called = false;
 pthread_mutex_t init_func_mutex = PTHREAD_MUTEX_INITIALIZER;
-void init_config(int cpu_limit_arg, const char* document_root_arg) {
+void init_config(const struct config_t* config_arg) {
     pthread_mutex_lock(&init_func_mutex);
     if (init_func_called) {
         pthread_mutex_unlock(&init_func_mutex);
         return;
     }
     init_func_called = true;
-    cpu_limit = cpu_limit_arg;
-    strcpy(document_root, document_root_arg);
+    memcpy(&config, config_arg, sizeof(struct config_t));
+    pthread_mutex_unlock(&init_func_mutex);
+}
+
+void update_config(const struct config_t* config_arg) {
+    pthread_mutex_lock(&init_func_mutex);
+    init_func_called = true;
+    memcpy(&config, config_arg, sizeof(struct config_t));
     pthread_mutex_unlock(&init_func_mutex);
 }
@@ -0,0 +1,522 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <zconf.h>
+#include <sys/stat.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+
+#include "../include/file_cache.h"
+#include "../include/uring.h"
+#include "../include/io_pool.h"
+#include "../include/config.h"
+#include "../include/log.h"
+
+struct lru_list_t {
+    struct file_cache_entry_t* head; //most recently used
+    struct file_cache_entry_t* tail;
+    size_t count;
+};
+
+static struct file_cache_entry_t* buckets[FILE_CACHE_BUCKETS];
+//Positive and pending entries hold fds, negative ones are evicted among themselves,
+//so a scan of missing URIs does not close the fds of hot files
+static struct lru_list_t positive_lru = {NULL, NULL, 0};
+static struct lru_list_t negative_lru = {NULL, NULL, 0};
+static size_t max_entries = FILE_CACHE_MAX_ENTRIES;
+//Guards the table, the LRU lists and refcounts. Workers share the cache in WORKER_MODE_THREAD,
+//so disk I/O on a miss or a revalidation is done without holding it.
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+//Misses of the calling worker are looked up through one of these, blocking calls without both
+static __thread struct uring_t* thread_ring = NULL;
+static __thread struct io_pool_t* thread_io_pool = NULL;
+
+static uint64_t hash_uri(const char* uri) {
+    uint64_t hash = 14695981039346656037ULL; //FNV-1a
+    for (const char* c = uri; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct lru_list_t* entry_lru(const struct file_cache_entry_t* entry) {
+    return entry->state == FILE_STATE_OK || entry->state == FILE_STATE_PENDING ? &positive_lru : &negative_lru;
+}
+
+static void lru_unlink(struct lru_list_t* lru, struct file_cache_entry_t* entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru->head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru->tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+    lru->count--;
+}
+
+static void lru_push_front(struct lru_list_t* lru, struct file_cache_entry_t* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru->head;
+    if (lru->head != NULL) {
+        lru->head->lru_prev = entry;
+    }
+    lru->head = entry;
+    if (lru->tail == NULL) {
+        lru->tail = entry;
+    }
+    lru->count++;
+}
+
+const char* file_body_tier_t_to_string(enum file_body_tier_t tier) {
+    switch (tier) {
+        case FILE_BODY_COPY: {
+            return STR_FILE_BODY_COPY;
+        }
+        case FILE_BODY_MMAP: {
+            return STR_FILE_BODY_MMAP;
+        }
+        case FILE_BODY_SENDFILE: {
+            return STR_FILE_BODY_SENDFILE;
+        }
+        default: {
+            return STR_FILE_BODY_UNDEFINED;
+        }
+    }
+}
+
+static void free_entry(struct file_cache_entry_t* entry) {
+    log(DEBUG, "Freeing file cache entry: %s", entry->uri);
+    if (entry->body_segment != NULL) {
+        //Responses still in flight keep their own references to the segment
+        evbuffer_file_segment_free(entry->body_segment);
+    }
+    free(entry->body);
+    if (entry->file.fd >= 0 && close(entry->file.fd) < 0) {
+        log(ERROR, "Unable to close cached fd: %s", strerror(errno));
+    }
+    free(entry->file.path);
+    free(entry->uri);
+    free(entry);
+}
+
+static void detach_entry(struct file_cache_entry_t* entry) {
+    struct file_cache_entry_t** link = &buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+    while (*link != NULL && *link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    if (*link != NULL) {
+        *link = entry->bucket_next;
+    }
+    lru_unlink(entry_lru(entry), entry);
+    entry->detached = true;
+    if (entry->refcount == 0) {
+        free_entry(entry);
+    }
+}
+
+static struct file_cache_entry_t* find_entry(const char* uri, uint64_t hash) {
+    struct file_cache_entry_t* entry = buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+    while (entry != NULL) {
+        if (entry->hash == hash && strcmp(entry->uri, uri) == 0) {
+            return entry;
+        }
+        entry = entry->bucket_next;
+    }
+    return NULL;
+}
+
+static bool is_entry_fresh(const struct file_cache_entry_t* entry, time_t now) {
+    return entry->state == FILE_STATE_PENDING || now - entry->validated_at < FILE_CACHE_TTL;
+}
+
+//Called without cache_mutex, the file of an entry never changes once it is looked up
+static bool is_file_unchanged(const struct file_t* file) {
+    struct stat file_stat;
+    if (stat(file->path, &file_stat) < 0) {
+        log(DEBUG, "Cached file is gone: %s", file->path);
+        return false;
+    }
+    if (file_stat.st_ino != file->ino ||
+        file_stat.st_mtime != file->mtime ||
+        file_stat.st_size != file->len) {
+        log(DEBUG, "Cached file was changed: %s", file->path);
+        return false;
+    }
+    return true;
+}
+
+//cache_mutex must be held, it is released during the stat() and held again on return.
+//Returns the entry of the URI afterwards, which may have been replaced meanwhile.
+static struct file_cache_entry_t* revalidate_entry(struct file_cache_entry_t* entry, const char* uri, uint64_t hash,
+                                                   time_t now) {
+    entry->refcount++; //keeps the path valid while unlocked
+    pthread_mutex_unlock(&cache_mutex);
+    bool unchanged = is_file_unchanged(&entry->file);
+    pthread_mutex_lock(&cache_mutex);
+    if (!entry->detached) {
+        if (unchanged) {
+            entry->validated_at = now;
+        } else {
+            detach_entry(entry);
+        }
+    }
+    entry->refcount--;
+    if (entry->refcount == 0 && entry->detached) {
+        free_entry(entry);
+    }
+    return find_entry(uri, hash);
+}
+
+static struct file_cache_entry_t* create_entry(const char* uri, uint64_t hash, time_t now) {
+    struct file_cache_entry_t* entry = calloc(1, sizeof(struct file_cache_entry_t));
+    if (entry == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        return NULL;
+    }
+    entry->uri = strdup(uri);
+    if (entry->uri == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->file = (struct file_t)FILE_INITIALIZER;
+    entry->state = inspect_file((char*)uri, &entry->file, true);
+    entry->validated_at = now;
+    return entry;
+}
+
+static void evict_entries(struct lru_list_t* lru, size_t limit) {
+    while (lru->count > limit && lru->tail != NULL) {
+        detach_entry(lru->tail);
+    }
+}
+
+static void insert_entry(struct file_cache_entry_t* entry) {
+    struct lru_list_t* lru = entry_lru(entry);
+    evict_entries(lru, (lru == &positive_lru ? max_entries : FILE_CACHE_MAX_NEGATIVE_ENTRIES) - 1);
+    size_t bucket = entry->hash & (FILE_CACHE_BUCKETS - 1);
+    entry->bucket_next = buckets[bucket];
+    buckets[bucket] = entry;
+    lru_push_front(lru, entry);
+}
+
+static enum file_body_tier_t choose_body_tier(int64_t len) {
+    if ((size_t)len <= FILE_BODY_COPY_MAX_SIZE) {
+        return FILE_BODY_COPY;
+    }
+    if ((size_t)len <= FILE_BODY_MMAP_MAX_SIZE) {
+        return FILE_BODY_MMAP;
+    }
+    return FILE_BODY_SENDFILE;
+}
+
+static char* read_body(const struct file_t* file) {
+    size_t len = (size_t)file->len;
+    char* body = malloc(len > 0 ? len : 1);
+    if (body == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        return NULL;
+    }
+    size_t read_len = 0;
+    while (read_len < len) {
+        ssize_t chunk_len = pread(file->fd, body + read_len, len - read_len, (off_t)read_len);
+        if (chunk_len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (chunk_len <= 0) {
+            log(ERROR, "Unable to read %s: %s", file->path, chunk_len < 0 ? strerror(errno) : "file was truncated");
+            free(body);
+            return NULL;
+        }
+        read_len += (size_t)chunk_len;
+    }
+    return body;
+}
+
+static void lookup_done_cb(enum file_state_t state, void* arg) {
+    struct file_cache_entry_t* entry = (struct file_cache_entry_t*)arg;
+    log(DEBUG, "File lookup finished: %s", entry->uri);
+    pthread_mutex_lock(&cache_mutex);
+    //Failed lookups are kept as negative entries until FILE_CACHE_TTL, parked requests would retry them forever
+    if (state != FILE_STATE_OK && !entry->detached) {
+        lru_unlink(&positive_lru, entry);
+        entry->state = state;
+        lru_push_front(&negative_lru, entry);
+        evict_entries(&negative_lru, FILE_CACHE_MAX_NEGATIVE_ENTRIES);
+    }
+    entry->state = state;
+    entry->validated_at = time(NULL);
+    //The waiters may belong to other workers' event bases, event_active() is thread safe for them
+    for (struct file_cache_waiter_t* waiter = entry->waiters; waiter != NULL; waiter = waiter->next) {
+        event_active(waiter->wake_event, EV_TIMEOUT, 1);
+    }
+    entry->waiters = NULL;
+    entry->refcount--; //held by the lookup
+    bool should_free = entry->refcount == 0 && entry->detached;
+    pthread_mutex_unlock(&cache_mutex);
+    if (should_free) {
+        free_entry(entry);
+    }
+}
+
+struct lookup_job_t {
+    struct io_job_t job; //first member, the job is the lookup
+    struct file_cache_entry_t* entry;
+    enum file_state_t state;
+};
+
+//Pool thread: the pending entry is not touched by anybody else until lookup_done_cb() publishes it
+static void lookup_job_work(struct io_job_t* job) {
+    struct lookup_job_t* lookup = (struct lookup_job_t*)job;
+    struct file_cache_entry_t* entry = lookup->entry;
+    lookup->state = inspect_file(entry->uri, &entry->file, true);
+    if (lookup->state == FILE_STATE_OK && choose_body_tier(entry->file.len) == FILE_BODY_COPY) {
+        //Small files are read right away: their responses, the response cache included, queue this copy,
+        //and bodies compressed on the fly are compressed from it on the pool too
+        entry->body = read_body(&entry->file);
+        if (entry->body != NULL) {
+            entry->body_tier = FILE_BODY_COPY;
+        }
+    }
+}
+
+static void lookup_job_done(struct io_job_t* job) {
+    struct lookup_job_t* lookup = (struct lookup_job_t*)job;
+    lookup_done_cb(lookup->state, lookup->entry);
+    free(lookup);
+}
+
+//cache_mutex must be held, it is released here. A pending entry is published so that
+//concurrent misses of the same URI wait for this lookup instead of starting their own.
+static enum file_state_t start_lookup(const char* uri, uint64_t hash, time_t now, struct file_cache_entry_t** entry) {
+    struct file_cache_entry_t* pending = calloc(1, sizeof(struct file_cache_entry_t));
+    if (pending == NULL || (pending->uri = strdup(uri)) == NULL) {
+        pthread_mutex_unlock(&cache_mutex);
+        log(ERROR, "Unable to allocate memory");
+        free(pending);
+        return FILE_STATE_INTERNAL_ERROR;
+    }
+    log(DEBUG, "File cache miss, looking up off the event loop: %s", uri);
+    pending->hash = hash;
+    pending->file = (struct file_t)FILE_INITIALIZER;
+    pending->state = FILE_STATE_PENDING;
+    pending->validated_at = now;
+    pending->refcount = 2; //the caller and the lookup
+    insert_entry(pending);
+    pthread_mutex_unlock(&cache_mutex);
+
+    *entry = pending;
+    if (thread_ring != NULL) {
+        inspect_file_async(thread_ring, uri, &pending->file, lookup_done_cb, pending);
+        return FILE_STATE_PENDING;
+    }
+    struct lookup_job_t* lookup = calloc(1, sizeof(struct lookup_job_t));
+    if (lookup == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        lookup_done_cb(inspect_file(pending->uri, &pending->file, true), pending);
+        return FILE_STATE_PENDING;
+    }
+    lookup->job.work = lookup_job_work;
+    lookup->job.done = lookup_job_done;
+    lookup->entry = pending;
+    io_pool_submit(thread_io_pool, &lookup->job);
+    return FILE_STATE_PENDING;
+}
+
+enum file_state_t file_cache_acquire(const char* uri, struct file_cache_entry_t** entry) {
+    if (uri == NULL || entry == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return FILE_STATE_INTERNAL_ERROR;
+    }
+
+    time_t now = time(NULL);
+    uint64_t hash = hash_uri(uri);
+    pthread_mutex_lock(&cache_mutex);
+    struct file_cache_entry_t* cached = find_entry(uri, hash);
+    if (cached != NULL && cached->state == FILE_STATE_OK && !is_entry_fresh(cached, now)) {
+        cached = revalidate_entry(cached, uri, hash, now);
+    }
+    if (cached != NULL && !is_entry_fresh(cached, now)) {
+        //negative entries are simply looked up again
+        detach_entry(cached);
+        cached = NULL;
+    }
+
+    if (cached == NULL && (thread_ring != NULL || thread_io_pool != NULL)) {
+        return start_lookup(uri, hash, now, entry);
+    }
+    if (cached == NULL) {
+        pthread_mutex_unlock(&cache_mutex);
+        log(DEBUG, "File cache miss: %s", uri);
+        struct file_cache_entry_t* created = create_entry(uri, hash, now);
+        if (created == NULL) {
+            return FILE_STATE_INTERNAL_ERROR;
+        }
+        if (created->state == FILE_STATE_INTERNAL_ERROR) {
+            free_entry(created);
+            return FILE_STATE_INTERNAL_ERROR;
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+        cached = find_entry(uri, hash);
+        if (cached != NULL) {
+            //Another worker thread has inspected the same file meanwhile
+            free_entry(created);
+        } else {
+            cached = created;
+            insert_entry(cached);
+        }
+    } else if (cached != entry_lru(cached)->head) {
+        lru_unlink(entry_lru(cached), cached);
+        lru_push_front(entry_lru(cached), cached);
+    }
+
+    enum file_state_t state = cached->state;
+    if (state == FILE_STATE_OK || state == FILE_STATE_PENDING) {
+        cached->refcount++;
+        *entry = cached;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return state;
+}
+
+void file_cache_retain(struct file_cache_entry_t* entry) {
+    if (entry == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    entry->refcount++;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void file_cache_release(struct file_cache_entry_t* entry) {
+    if (entry == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    entry->refcount--;
+    bool should_free = entry->refcount == 0 && entry->detached;
+    pthread_mutex_unlock(&cache_mutex);
+    if (should_free) {
+        free_entry(entry);
+    }
+}
+
+static struct evbuffer_file_segment* create_body_segment(const struct file_t* file, enum file_body_tier_t tier) {
+    //The segment closes its own copy of the fd, so it may outlive the entry
+    int fd = dup(file->fd);
+    if (fd < 0) {
+        log(ERROR, "Unable to duplicate fd of %s: %s", file->path, strerror(errno));
+        return NULL;
+    }
+    unsigned flags = EVBUF_FS_CLOSE_ON_FREE;
+    if (tier == FILE_BODY_MMAP) {
+        flags |= EVBUF_FS_DISABLE_SENDFILE; //the file is mapped right away
+    }
+    struct evbuffer_file_segment* segment = evbuffer_file_segment_new(fd, 0, file->len, flags);
+    if (segment == NULL) {
+        log(ERROR, "Unable to create file segment for %s", file->path);
+        close(fd);
+    }
+    return segment;
+}
+
+enum file_body_tier_t file_cache_prepare_body(struct file_cache_entry_t* entry) {
+    if (entry == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return FILE_BODY_UNDEFINED;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    enum file_body_tier_t tier = entry->body_tier;
+    pthread_mutex_unlock(&cache_mutex);
+    if (tier != FILE_BODY_UNDEFINED) {
+        return tier;
+    }
+
+    //The file is read or mapped without holding the lock, like on a cache miss
+    tier = choose_body_tier(entry->file.len);
+    char* body = NULL;
+    struct evbuffer_file_segment* segment = NULL;
+    if (tier == FILE_BODY_COPY) {
+        body = read_body(&entry->file);
+    } else {
+        segment = create_body_segment(&entry->file, tier);
+    }
+    if (body == NULL && segment == NULL) {
+        return FILE_BODY_UNDEFINED;
+    }
+    log(DEBUG, "File body of %s prepared: %s", entry->file.path, file_body_tier_t_to_string(tier));
+
+    pthread_mutex_lock(&cache_mutex);
+    if (entry->body_tier == FILE_BODY_UNDEFINED) {
+        entry->body_tier = tier;
+        entry->body = body;
+        entry->body_segment = segment;
+        body = NULL;
+        segment = NULL;
+    } //otherwise another worker thread has prepared the same body meanwhile
+    tier = entry->body_tier;
+    pthread_mutex_unlock(&cache_mutex);
+    free(body);
+    if (segment != NULL) {
+        evbuffer_file_segment_free(segment);
+    }
+    return tier;
+}
+
+void file_cache_set_max_entries(size_t count) {
+    pthread_mutex_lock(&cache_mutex);
+    max_entries = count > 0 ? count : 1;
+    evict_entries(&positive_lru, max_entries);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void file_cache_use_uring(struct uring_t* ring) {
+    thread_ring = ring;
+}
+
+void file_cache_use_io_pool(struct io_pool_t* pool) {
+    thread_io_pool = pool;
+}
+
+bool file_cache_wait(struct file_cache_entry_t* entry, struct file_cache_waiter_t* waiter) {
+    if (entry == NULL || waiter == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return false;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    bool is_pending = entry->state == FILE_STATE_PENDING;
+    if (is_pending) {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return is_pending;
+}
+
+void file_cache_cancel_wait(struct file_cache_entry_t* entry, struct file_cache_waiter_t* waiter) {
+    if (entry == NULL || waiter == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    struct file_cache_waiter_t** link = &entry->waiters;
+    while (*link != NULL && *link != waiter) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = waiter->next;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
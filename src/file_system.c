@@ -5,61 +5,14 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
 #include "../include/file_system.h"
+#include "../include/uring.h"
 #include "../include/log.h"
 #include "../include/config.h"
 
-char* const STR_MIME_APPLICATION_OCTET_STREAM = "application/octet-stream\0";
-char* const STR_MIME_TEXT_HTML = "text/html\0";
-char* const STR_MIME_TEXT_CSS = "text/css\0";
-char* const STR_MIME_APPLICATION_JAVASCRIPT = "application/javascript\0";
-char* const STR_MIME_IMAGE_JPEG = "image/jpeg\0";
-char* const STR_MIME_IMAGE_PNG = "image/png\0";
-char* const STR_MIME_IMAGE_GIF = "image/gif\0";
-char* const STR_MIME_APPLICATION_X_SHOCKWAVE_FLASH = "application/x-shockwave-flash\0";
-
-const char* const EXT_HTML = ".html\0";
-const char* const EXT_CSS = ".css\0";
-const char* const EXT_JS = ".js\0";
-const char* const EXT_JPG = ".jpg\0";
-const char* const EXT_JPEG = ".jpeg\0";
-const char* const EXT_PNG = ".png\0";
-const char* const EXT_GIF = ".gif\0";
-const char* const EXT_SWF = ".swf\0";
-
-char* mime_type_to_str(enum mime_t mime_type) {
-    switch(mime_type) {
-        case MIME_TYPE_APPLICATION_OCTET_STREAM: {
-            return STR_MIME_APPLICATION_OCTET_STREAM;
-        }
-        case MIME_TYPE_TEXT_HTML: {
-            return STR_MIME_TEXT_HTML;
-        }
-        case MIME_TYPE_TEXT_CSS: {
-            return STR_MIME_TEXT_CSS;
-        }
-        case MIME_TYPE_APPLICATION_JAVASCRIPT: {
-            return STR_MIME_APPLICATION_JAVASCRIPT;
-        }
-        case MIME_TYPE_IMAGE_JPEG: {
-            return STR_MIME_IMAGE_JPEG;
-        }
-        case MIME_TYPE_IMAGE_PNG: {
-            return STR_MIME_IMAGE_PNG;
-        }
-        case MIME_TYPE_IMAGE_GIF: {
-            return STR_MIME_IMAGE_GIF;
-        }
-        case MIME_TYPE_APPLICATION_X_SHOCKWAVE_FLASH: {
-            return STR_MIME_APPLICATION_X_SHOCKWAVE_FLASH;
-        }
-        default: {
-            log(WARNING, "Unknown mime type: %d", mime_type);
-            return STR_MIME_APPLICATION_OCTET_STREAM;
-        }
-    }
-}
-
 static enum file_state_t errno_to_file_state(int err_no) {
     switch (err_no) {
         case EFAULT:
@@ -69,7 +22,8 @@ static enum file_state_t errno_to_file_state(int err_no) {
         case ENOTDIR: {
             return FILE_STATE_NOT_FOUND;
         }
-        case EACCES: {
+        case EACCES:
+        case EXDEV: { //outside of the document root
             return FILE_STATE_FORBIDDEN;
         }
         default: {
@@ -78,99 +32,277 @@ static enum file_state_t errno_to_file_state(int err_no) {
     }
 }
 
-static enum mime_t parse_mime_type(const char* file_extension) {
-    if (file_extension == NULL) {
-        log(ERROR, "Invalid function arguments");
-        return MIME_TYPE_APPLICATION_OCTET_STREAM;
-    }
-    if (strcmp(file_extension, EXT_HTML) == 0) {
-        return MIME_TYPE_TEXT_HTML;
-    } else if (strcmp(file_extension, EXT_CSS) == 0) {
-        return MIME_TYPE_TEXT_CSS;
-    } else if (strcmp(file_extension, EXT_JS) == 0) {
-        return MIME_TYPE_APPLICATION_JAVASCRIPT;
-    } else if (strcmp(file_extension, EXT_JPG) == 0) {
-        return MIME_TYPE_IMAGE_JPEG;
-    } else if (strcmp(file_extension, EXT_JPEG) == 0) {
-        return MIME_TYPE_IMAGE_JPEG;
-    } else if (strcmp(file_extension, EXT_PNG) == 0) {
-        return MIME_TYPE_IMAGE_PNG;
-    } else if (strcmp(file_extension, EXT_GIF) == 0) {
-        return MIME_TYPE_IMAGE_GIF;
-    } else if (strcmp(file_extension, EXT_SWF) == 0) {
-        return MIME_TYPE_APPLICATION_X_SHOCKWAVE_FLASH;
+static int document_root_fd = -1;
+static bool has_openat2 = false; //decided once by open_document_root()
+
+int open_document_root(void) {
+    document_root_fd = open(DOCUMENT_ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (document_root_fd < 0) {
+        log(ERROR, "Unable to open document root %s: %s", DOCUMENT_ROOT, strerror(errno));
+        return -1;
+    }
+    struct open_how how = {.flags = O_RDONLY | O_CLOEXEC, .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+    int fd = (int)syscall(SYS_openat2, document_root_fd, ".", &how, sizeof(how));
+    has_openat2 = fd >= 0;
+    if (fd >= 0) {
+        close(fd);
+        log(INFO, "Files are resolved beneath the document root with openat2()");
     } else {
-        log(WARNING, "Unknown file extension: %s", file_extension);
-        return MIME_TYPE_APPLICATION_OCTET_STREAM;
+        log(WARNING, "openat2() is not available (%s), '..' path segments are rejected instead", strerror(errno));
     }
+    return 0;
 }
 
-enum file_state_t inspect_file(char* path, struct file_t* file, bool should_get_fd) {
-    if (path == NULL || file == NULL) {
-        log(ERROR, "Invalid function arguments");
+static bool has_dot_dot_segment(const char* path) {
+    for (const char* segment = path; segment != NULL; segment = strchr(segment, '/')) {
+        if (*segment == '/') {
+            segment++;
+        }
+        if (segment[0] == '.' && segment[1] == '.' && (segment[2] == '/' || segment[2] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int open_beneath(int dir_fd, const char* relative_path) {
+    if (has_openat2) {
+        //Absolute paths, '..' above dir_fd and symlinks leaving it fail with EXDEV
+        struct open_how how = {.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC,
+                               .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+        return (int)syscall(SYS_openat2, dir_fd, relative_path, &how, sizeof(how));
+    }
+    if (relative_path[0] == '/' || has_dot_dot_segment(relative_path)) {
+        errno = EXDEV;
         return -1;
     }
+    return openat(dir_fd, relative_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
 
-    char absolute_path[4096] = "\0";
-    strcpy(absolute_path, DOCUMENT_ROOT);
-    strcat(absolute_path, path);
-    if (absolute_path[strlen(absolute_path) - 1] == '/') {
-        absolute_path[strlen(absolute_path) - 1] = '\0';
+//The request path without its leading and trailing slashes, "." for the document root itself
+static enum file_state_t build_relative_path(const char* path, char* relative_path, size_t size) {
+    while (*path == '/') {
+        path++;
+    }
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    if (len >= size) {
+        return FILE_STATE_NOT_FOUND;
+    }
+    if (len == 0) {
+        strcpy(relative_path, ".");
+    } else {
+        memcpy(relative_path, path, len);
+        relative_path[len] = '\0';
     }
-    log(DEBUG,"Absolute path: %s", absolute_path);
+    log(DEBUG, "Relative path: %s", relative_path);
+    return FILE_STATE_OK;
+}
+
+//Kept in struct file_t for logs and revalidation with stat()
+static void build_absolute_path(const char* relative_path, bool is_index, char* absolute_path, size_t size) {
+    snprintf(absolute_path, size, "%s%s%s%s", DOCUMENT_ROOT,
+             strcmp(relative_path, ".") == 0 ? "" : "/",
+             strcmp(relative_path, ".") == 0 ? "" : relative_path,
+             is_index ? INDEX_FILE_NAME : "");
+}
 
-    if(strstr(absolute_path, "/..") != NULL) {
-        return FILE_STATE_FORBIDDEN;
+//Takes ownership of fd
+static enum file_state_t fill_file(struct file_t* file, const char* absolute_path, int fd,
+                                   int64_t len, time_t mtime, ino_t ino, bool should_get_fd) {
+    log(DEBUG, "File length: %ld", (long)len);
+    file->path = strdup(absolute_path);
+    if (file->path == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        close(fd);
+        return FILE_STATE_INTERNAL_ERROR;
     }
+    file->len = len;
+    file->mtime = mtime;
+    file->ino = ino;
 
-    int fd = open(absolute_path, O_RDONLY | O_NONBLOCK | O_DIRECTORY);
-    if (errno == ENOTDIR) {
-        log(DEBUG, "Absolute path is a regular file");
-        fd = open(absolute_path, O_RDONLY | O_NONBLOCK);
-        if (fd < 0) {
-            log(ERROR, "Unable to open file: %s", strerror(errno));
-            return errno_to_file_state(errno);
-        }
-    } else if (fd < 0) {
-        log(ERROR, "Unable to open file by absolute path: %s", strerror(errno));
-        return errno_to_file_state(errno);
-    } else {
-        log(DEBUG, "Absolute path points to directory");
-        if (close(fd) < 0) {
-            log(ERROR, "Unable to close directory fd: %s", strerror(errno));
-            return errno_to_file_state(errno);
-        }
+    file->mime_type = mime_type_by_path(file->path);
 
-        strcat(absolute_path, INDEX_FILE_NAME);
-        log(DEBUG, "Absolute path: %s", absolute_path);
+    if (should_get_fd) {
+        file->fd = fd;
+    } else if (close(fd) < 0) {
+        log(ERROR, "Unable to close file fd: %s", strerror(errno));
+    }
+    return FILE_STATE_OK;
+}
+
+enum file_state_t inspect_file(char* path, struct file_t* file, bool should_get_fd) {
+    if (path == NULL || file == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return FILE_STATE_INTERNAL_ERROR;
+    }
+
+    char relative_path[4096];
+    enum file_state_t path_state = build_relative_path(path, relative_path, sizeof(relative_path));
+    if (path_state != FILE_STATE_OK) {
+        return path_state;
+    }
 
-        fd = open(absolute_path, O_RDONLY | O_NONBLOCK);
-        if (fd < 0) {
-            log(ERROR, "Unable to open file: %s", strerror(errno));
+    int fd = open_beneath(document_root_fd, relative_path);
+    if (fd < 0) {
+        //A missing file is the client's 404, and precompressed siblings are looked up for every page
+        log(errno == ENOENT ? DEBUG : ERROR, "Unable to open %s: %s", relative_path, strerror(errno));
+        return errno_to_file_state(errno);
+    }
+    //One fstat() tells a directory from a file
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        log(ERROR, "Unable to stat file: %s", strerror(errno));
+        enum file_state_t state = errno_to_file_state(errno);
+        close(fd);
+        return state;
+    }
+    bool is_index = S_ISDIR(file_stat.st_mode);
+    if (is_index) {
+        log(DEBUG, "Path points to directory");
+        int index_fd = open_beneath(fd, INDEX_FILE_NAME + 1);
+        int err = errno;
+        close(fd);
+        if (index_fd < 0) {
+            log(ERROR, "Unable to open index file of %s: %s", relative_path, strerror(err));
+            return FILE_STATE_FORBIDDEN;
+        }
+        fd = index_fd;
+        if (fstat(fd, &file_stat) < 0 || S_ISDIR(file_stat.st_mode)) {
+            close(fd);
             return FILE_STATE_FORBIDDEN;
         }
     }
 
-    ssize_t file_len = lseek(fd, 0, SEEK_END);
-    if (file_len < 0) {
-        log(ERROR, "Unable to get file size via lseek: %s", strerror(errno));
-        return errno_to_file_state(errno);
+    char absolute_path[4096 + sizeof(INDEX_FILE_NAME)];
+    build_absolute_path(relative_path, is_index, absolute_path, sizeof(absolute_path));
+    return fill_file(file, absolute_path, fd, (int64_t)file_stat.st_size, file_stat.st_mtime, file_stat.st_ino,
+                     should_get_fd);
+}
+
+//openat2() goes through the ring, the metadata is taken from the opened fd so it always describes
+//the file whose body is sent. A directory is answered with its index file in a second round
+//relative to the directory fd.
+struct file_lookup_t {
+    struct uring_op_t open_op;
+    int dir_fd; //document root, or the directory in the second round
+    bool is_index; //the second round
+    struct open_how how;
+    struct uring_t* ring;
+    struct file_t* file;
+    void (*done)(enum file_state_t state, void* arg);
+    void* arg;
+    char* path; //the request path, kept for the blocking fallback
+    char relative_path[4096];
+};
+
+static void finish_lookup(struct file_lookup_t* lookup, enum file_state_t state) {
+    if (lookup->is_index) {
+        close(lookup->dir_fd);
     }
-    log(DEBUG, "File length: %d", file_len);
+    lookup->done(state, lookup->arg);
+    free(lookup->path);
+    free(lookup);
+}
 
-    file->path = absolute_path;
-    file->len = (size_t)file_len;
+static void submit_lookup(struct file_lookup_t* lookup);
 
-    char* file_extension = strrchr(absolute_path, '.');
-    if (file_extension == NULL) {
-        file->mime_type = MIME_TYPE_APPLICATION_OCTET_STREAM;
-    } else {
-        file->mime_type = parse_mime_type(file_extension);
+static void lookup_op_done(struct uring_op_t* op, int result) {
+    struct file_lookup_t* lookup = (struct file_lookup_t*)op->arg;
+    if (result == -ECANCELED) {
+        //The ring refused the submission
+        finish_lookup(lookup, inspect_file(lookup->path, lookup->file, true));
+        return;
+    }
+    if (result < 0) {
+        int err = -result;
+        if (lookup->is_index) {
+            log(ERROR, "Unable to open index file of %s: %s", lookup->relative_path, strerror(err));
+            finish_lookup(lookup, FILE_STATE_FORBIDDEN);
+            return;
+        }
+        log(err == ENOENT ? DEBUG : ERROR, "Unable to open %s: %s", lookup->relative_path, strerror(err));
+        finish_lookup(lookup, errno_to_file_state(err));
+        return;
     }
 
-    if (should_get_fd) {
-        file->fd = fd;
+    int fd = result;
+    //The inode is in memory once it is open, fstat() does not wait for the disk
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        int err = errno;
+        log(ERROR, "Unable to stat file: %s", strerror(err));
+        close(fd);
+        finish_lookup(lookup, errno_to_file_state(err));
+        return;
+    }
+    if (S_ISDIR(file_stat.st_mode)) {
+        if (lookup->is_index) {
+            close(fd);
+            finish_lookup(lookup, FILE_STATE_FORBIDDEN);
+            return;
+        }
+        log(DEBUG, "Path points to directory");
+        lookup->dir_fd = fd; //closed by finish_lookup()
+        lookup->is_index = true;
+        submit_lookup(lookup);
+        return;
     }
+    char absolute_path[4096 + sizeof(INDEX_FILE_NAME)];
+    build_absolute_path(lookup->relative_path, lookup->is_index, absolute_path, sizeof(absolute_path));
+    finish_lookup(lookup, fill_file(lookup->file, absolute_path, fd, (int64_t)file_stat.st_size, file_stat.st_mtime,
+                                    file_stat.st_ino, true));
+}
 
-    return FILE_STATE_OK;
+static void submit_lookup(struct file_lookup_t* lookup) {
+    const char* path = lookup->is_index ? INDEX_FILE_NAME + 1 : lookup->relative_path;
+    lookup->open_op = (struct uring_op_t){lookup_op_done, lookup};
+    lookup->how = (struct open_how){.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC,
+                                    .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+    if (!has_openat2 && has_dot_dot_segment(path)) {
+        finish_lookup(lookup, FILE_STATE_FORBIDDEN);
+        return;
+    }
+    int queued = has_openat2
+            ? uring_prep_openat2(lookup->ring, &lookup->open_op, lookup->dir_fd, path, &lookup->how)
+            : uring_prep_openat(lookup->ring, &lookup->open_op, lookup->dir_fd, path, (int)lookup->how.flags);
+    if (queued < 0) {
+        finish_lookup(lookup, inspect_file(lookup->path, lookup->file, true));
+        return;
+    }
+    uring_submit(lookup->ring);
+}
+
+void inspect_file_async(struct uring_t* ring, const char* path, struct file_t* file,
+                        void (*done)(enum file_state_t state, void* arg), void* arg) {
+    if (ring == NULL || path == NULL || file == NULL || done == NULL) {
+        log(ERROR, "Invalid function arguments");
+        if (done != NULL) {
+            done(FILE_STATE_INTERNAL_ERROR, arg);
+        }
+        return;
+    }
+    struct file_lookup_t* lookup = calloc(1, sizeof(struct file_lookup_t));
+    char* path_copy = strdup(path);
+    if (lookup == NULL || path_copy == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        free(lookup);
+        free(path_copy);
+        done(FILE_STATE_INTERNAL_ERROR, arg);
+        return;
+    }
+    lookup->ring = ring;
+    lookup->file = file;
+    lookup->done = done;
+    lookup->arg = arg;
+    lookup->path = path_copy;
+    lookup->dir_fd = document_root_fd;
+    enum file_state_t path_state = build_relative_path(path, lookup->relative_path, sizeof(lookup->relative_path));
+    if (path_state != FILE_STATE_OK) {
+        finish_lookup(lookup, path_state);
+        return;
+    }
+    submit_lookup(lookup);
 }
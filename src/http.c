@@ -1,131 +1,92 @@
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <stdbool.h>
 
 #include "../include/http.h"
+#include "../include/http_header.h"
+#include "../include/response_cache.h"
+#include "../include/http_scan.h"
 #include "../include/log.h"
 
-static void parse_http_req_method(char** req_str, struct http_request_t* req) {
-    if (req_str == NULL || *req_str == NULL || req == NULL) {
-        log(ERROR, "Invalid function arguments");
-        return;
-    }
-
-    size_t get_len = strlen(STR_GET);
-    if (strncmp(*req_str, STR_GET, get_len) == 0) {
-        req->method = GET;
-        *req_str += get_len + 1; // len of GET + single space
-        return;
-    }
-    size_t head_len = strlen(STR_HEAD);
-    if (strncmp(*req_str, STR_HEAD, head_len) == 0) {
-        req->method = HEAD;
-        *req_str += head_len + 1; //len of HEAD + single space
-        return;
+static enum request_method_t parse_http_req_method(const char* method, size_t method_len) {
+    switch (method_len) {
+        case 3: {
+            return memcmp(method, STR_GET, 3) == 0 ? GET : METHOD_UNDEFINED;
+        }
+        case 4: {
+            return memcmp(method, STR_HEAD, 4) == 0 ? HEAD : METHOD_UNDEFINED;
+        }
+        default: {
+            return METHOD_UNDEFINED;
+        }
     }
-    req->method = METHOD_UNDEFINED;
 }
 
-static void url_decode(char* url) {
-    char url_repl_buf[4096 * 4];
-    char* url_repl = strcpy(url_repl_buf, url);
-    if (url_repl == NULL) {
-        log(ERROR, "Unable to copy URL to buffer");
-        return;
+static int hex_to_int(char chr) {
+    if (chr >= '0' && chr <= '9') {
+        return chr - '0';
     }
-    char* cursor = strchr(url_repl, '%');
-    while (cursor != NULL) {
-        int hex_chr = 0;
-        sscanf(cursor + 1, "%x", &hex_chr);
-        char chr = (char)hex_chr;
-        *cursor = chr;
-        strcpy(cursor + 1, cursor + 3);
-        cursor = strchr(cursor, '%');
+    if (chr >= 'a' && chr <= 'f') {
+        return chr - 'a' + 10;
     }
-    strcpy(url, url_repl);
-}
-
-static void parse_http_req_uri(char** req_str, struct http_request_t* req) {
-    if (req_str == NULL || *req_str == NULL || req == NULL) {
-        log(ERROR, "Invalid function arguments");
-        return;
+    if (chr >= 'A' && chr <= 'F') {
+        return chr - 'A' + 10;
     }
+    return -1;
+}
 
-    req->URI = *req_str;
-    *req_str = strchr(*req_str, ' ');
-    if (*req_str == NULL) {
-        req->URI = NULL;
-        return;
+size_t url_decode(char* url, size_t url_len) {
+    char* dest = url;
+    for (size_t i = 0; i < url_len; i++) {
+        if (url[i] == '%' && i + 2 < url_len) {
+            int high = hex_to_int(url[i + 1]);
+            int low = high < 0 ? -1 : hex_to_int(url[i + 2]);
+            if (low >= 0) {
+                *dest++ = (char)(high * 16 + low);
+                i += 2;
+                continue;
+            }
+        }
+        *dest++ = url[i];
     }
-    **req_str = '\0';
-    *req_str += 1;
-    url_decode(req->URI);
+    *dest = '\0';
+    return dest - url;
+}
 
-    char* query_start = strrchr(req->URI, '?');
+static int parse_http_req_uri(char* uri, char* uri_end, struct http_request_t* req) {
+    *uri_end = '\0';
+    char* query_start = memchr(uri, '?', uri_end - uri);
     if (query_start != NULL) {
         *query_start = '\0';
+        uri_end = query_start;
     }
-}
-
-static void parse_http_req_proto_ver(char** req_str, struct http_request_t* req) {
-    if (req_str == NULL || *req_str == NULL || req == NULL) {
-        log(ERROR, "Invalid function arguments");
-        return;
-    }
-
-    size_t http_v1_0_len = strlen(STR_HTTPv1_0);
-    if (strncmp(*req_str, STR_HTTPv1_0, http_v1_0_len) == 0) {
-        req->http_version=HTTPv1_0;
-        *req_str += http_v1_0_len + 2; // len of HTTP/1.0 + \r\n
-        return;
-    }
-    size_t http_v1_1_len = strlen(STR_HTTPv1_0);
-    if (strncmp(*req_str, STR_HTTPv1_1, http_v1_1_len) == 0) {
-        req->http_version=HTTPv1_1;
-        *req_str += http_v1_1_len + 2; // len of HTTP/1.1 + \r\n
-        return;
+    req->URI = uri;
+    req->URI_len = url_decode(uri, uri_end - uri);
+    if (memchr(uri, '\0', req->URI_len) != NULL) {
+        log(DEBUG, "URI contains an encoded NUL byte");
+        return -1;
     }
-    req->http_version = VERSION_UNDEFINED;
+    return 0;
 }
 
-static void parse_http_req_headers(char** req_str, struct http_request_t* req) {
-    if (req_str == NULL || *req_str == NULL || req == NULL) {
-        log(ERROR, "Invalid function arguments");
-        return;
+static enum http_version_t parse_http_req_proto_ver(const char* version) {
+    //Both supported versions share the "HTTP/1." prefix
+    if (memcmp(version, STR_HTTPv1_1, 7) != 0) {
+        return VERSION_UNDEFINED;
     }
-
-    const char* delim = "\r\n";
-    const int delim_len = 2;
-    char** cursor = req_str;
-    size_t header_len = 0;
-    size_t headers_count = 0;
-
-    while(1) {
-	char* prev_cursor_val = *cursor;
-        *cursor = strstr(*cursor, delim);
-        header_len = *cursor - prev_cursor_val;
-        log(DEBUG, "header_len: %d", header_len);
-        if(header_len == 0) {
-            *cursor += delim_len;
-            req->headers_count = headers_count;
-            break;
+    switch (version[7]) {
+        case '0': {
+            return HTTPv1_0;
         }
-        if (*cursor == NULL) {
-            log(ERROR, "Can't parse headers: empty line does not reached");
-            req->headers_count = 0;
-            return;
+        case '1': {
+            return HTTPv1_1;
         }
-        if (headers_count > req->headers_count) {
-            log(ERROR, "Not enough memory allocated for headers");
-            req->headers_count = 0;
-            return;
+        default: {
+            return VERSION_UNDEFINED;
         }
-        req->headers[headers_count].text = prev_cursor_val;
-        req->headers[headers_count].len = header_len + delim_len; //CRLF is a part of a header too
-        *cursor += delim_len;
-        headers_count++;
     }
 }
 
@@ -170,6 +131,12 @@ char* http_state_t_to_string(enum http_state_t state) {
         case OK: {
             return STR_200_OK;
         }
+        case PARTIAL_CONTENT: {
+            return STR_206_PARTIAL_CONTENT;
+        }
+        case NOT_MODIFIED: {
+            return STR_304_NOT_MODIFIED;
+        }
         case BAD_REQUEST: {
             return STR_400_BAD_REQUEST;
         }
@@ -182,6 +149,12 @@ char* http_state_t_to_string(enum http_state_t state) {
         case METHOD_NOT_ALLOWED: {
             return STR_405_METHOD_NOT_ALLOWED;
         }
+        case RANGE_NOT_SATISFIABLE: {
+            return STR_416_RANGE_NOT_SATISFIABLE;
+        }
+        case REQUEST_HEADER_FIELDS_TOO_LARGE: {
+            return STR_431_REQUEST_HEADER_FIELDS_TOO_LARGE;
+        }
         case INTERNAL_SERVER_ERROR: {
             return STR_500_INTERNAL_SERVER_ERROR;
         }
@@ -191,148 +164,518 @@ char* http_state_t_to_string(enum http_state_t state) {
     }
 }
 
-enum http_state_t parse_http_request(char* req_str, struct http_request_t* req) {
+static bool has_connection_option(const struct http_field_t* connection, const char* option) {
+    size_t option_len = strlen(option);
+    const char* cursor = connection->value;
+    const char* end = connection->value + connection->value_len;
+    while (cursor < end) {
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == ',')) {
+            cursor++;
+        }
+        if (cursor >= end) {
+            break;
+        }
+        const char* token_end = memchr(cursor, ',', (size_t)(end - cursor));
+        if (token_end == NULL) {
+            token_end = end;
+        }
+        const char* token_last = token_end;
+        while (token_last > cursor && (token_last[-1] == ' ' || token_last[-1] == '\t')) {
+            token_last--;
+        }
+        if ((size_t)(token_last - cursor) == option_len && strncasecmp(cursor, option, option_len) == 0) {
+            return true;
+        }
+        cursor = token_end;
+    }
+    return false;
+}
+
+static bool parse_http_req_keep_alive(const struct http_request_t* req) {
+    const struct http_field_t* connection = find_http_header(req, "Connection");
+    if (connection != NULL) {
+        if (has_connection_option(connection, "close")) {
+            return false;
+        }
+        if (has_connection_option(connection, "keep-alive")) {
+            return true;
+        }
+    }
+    return req->http_version == HTTPv1_1;
+}
+
+static bool has_request_body(const struct http_request_t* req) {
+    if (find_http_header(req, "Transfer-Encoding") != NULL) {
+        return true;
+    }
+    const struct http_field_t* content_length = find_http_header(req, "Content-Length");
+    return content_length != NULL && !(content_length->value_len == 1 && content_length->value[0] == '0');
+}
+
+enum http_parse_state_t {
+    PARSE_STATE_METHOD,
+    PARSE_STATE_URI,
+    PARSE_STATE_VERSION,
+    PARSE_STATE_HEADER_NAME,
+    PARSE_STATE_HEADER_VALUE,
+    PARSE_STATE_DONE
+};
+
+enum http_state_t parse_http_request(char* req_str, size_t req_len, struct http_request_t* req) {
     if (req_str == NULL || req ==NULL) {
         log(ERROR, "Invalid function arguments");
         return INTERNAL_SERVER_ERROR;
     }
 
     char* cursor = req_str;
-    while (*cursor == '\r' || *cursor == '\n') {
+    const char* req_end = req_str + req_len;
+    while (cursor < req_end && (*cursor == '\r' || *cursor == '\n')) {
         cursor += 1;
     }
-    if (*cursor == '\0') {
-        log(INFO, "Skipped empty req_str while parsing request");
+    if (cursor == req_end) {
+        log(DEBUG, "Skipped empty req_str while parsing request");
         return BAD_REQUEST;
     }
 
-    parse_http_req_method(&cursor, req);
-    log(DEBUG, "HTTP request method parsed: %s", request_method_t_to_string(req->method));
+    //Single pass over the request, every delimiter is found with http_scan_*()
+    enum http_parse_state_t state = PARSE_STATE_METHOD;
+    struct http_field_t* field = NULL;
+    while (state != PARSE_STATE_DONE) {
+        switch (state) {
+            case PARSE_STATE_METHOD: {
+                const char* method_end = http_scan_token_end(cursor, req_end);
+                if (method_end == req_end || *method_end != ' ') {
+                    log(DEBUG, "parse_http_request returning BAD_REQUEST, method is not followed by SP");
+                    return BAD_REQUEST;
+                }
+                req->method = parse_http_req_method(cursor, method_end - cursor);
+                log(DEBUG, "HTTP request method parsed: %s", request_method_t_to_string(req->method));
+                //An unknown method is answered with 405 once the whole request is parsed,
+                //its version and Connection header decide whether the connection stays open
+                cursor += method_end - cursor + 1;
+                state = PARSE_STATE_URI;
+                break;
+            }
+            case PARSE_STATE_URI: {
+                char* uri_end = cursor + (http_scan_token_end(cursor, req_end) - cursor);
+                if (uri_end == req_end || *uri_end != ' ' || uri_end == cursor) {
+                    log(DEBUG, "parse_http_request returning BAD_REQUEST, invalid URI");
+                    return BAD_REQUEST;
+                }
+                if (parse_http_req_uri(cursor, uri_end, req) < 0) {
+                    return BAD_REQUEST;
+                }
+                log(DEBUG, "HTTP request URI parsed: %s", req->URI);
+                cursor = uri_end + 1;
+                state = PARSE_STATE_VERSION;
+                break;
+            }
+            case PARSE_STATE_VERSION: {
+                const size_t version_len = 8; //HTTP/1.x
+                if (cursor > req_end || (size_t)(req_end - cursor) < version_len + 2 ||
+                    cursor[version_len] != '\r' || cursor[version_len + 1] != '\n') {
+                    log(DEBUG, "parse_http_request returning BAD_REQUEST, request line is not terminated");
+                    return BAD_REQUEST;
+                }
+                req->http_version = parse_http_req_proto_ver(cursor);
+                log(DEBUG, "HTTP request protocol version parsed: %s", http_version_t_to_string(req->http_version));
+                if (req->http_version == VERSION_UNDEFINED) {
+                    log(DEBUG, "parse_http_request returning BAD_REQUEST, HTTP_VERSION==VERSION_UNDEFINED");
+                    return BAD_REQUEST;
+                }
+                cursor += version_len + 2;
+                state = PARSE_STATE_HEADER_NAME;
+                break;
+            }
+            case PARSE_STATE_HEADER_NAME: {
+                if (req_end - cursor >= 2 && cursor[0] == '\r' && cursor[1] == '\n') {
+                    state = PARSE_STATE_DONE;
+                    break;
+                }
+                const char* name_end = http_scan_header_name_end(cursor, req_end);
+                if (name_end == req_end || *name_end != ':' || name_end == cursor) {
+                    log(DEBUG, "parse_http_request returning BAD_REQUEST, invalid header name");
+                    return BAD_REQUEST;
+                }
+                if (req->headers_count == req->headers_capacity) {
+                    log(DEBUG, "parse_http_request returning BAD_REQUEST, too many headers");
+                    return BAD_REQUEST;
+                }
+                field = &req->headers[req->headers_count++];
+                field->name = cursor;
+                field->name_len = name_end - cursor;
+                cursor += field->name_len + 1;
+                state = PARSE_STATE_HEADER_VALUE;
+                break;
+            }
+            case PARSE_STATE_HEADER_VALUE: {
+                while (cursor < req_end && (*cursor == ' ' || *cursor == '\t')) {
+                    cursor++;
+                }
+                const char* value_end = http_scan_header_value_end(cursor, req_end);
+                if (req_end - value_end < 2 || value_end[0] != '\r' || value_end[1] != '\n') {
+                    log(DEBUG, "parse_http_request returning BAD_REQUEST, invalid header value");
+                    return BAD_REQUEST;
+                }
+                field->value = cursor;
+                field->value_len = value_end - cursor;
+                while (field->value_len > 0 &&
+                       (field->value[field->value_len - 1] == ' ' || field->value[field->value_len - 1] == '\t')) {
+                    field->value_len--;
+                }
+                cursor += value_end - cursor + 2;
+                state = PARSE_STATE_HEADER_NAME;
+                break;
+            }
+            default: {
+                log(ERROR, "Unknown parser state: %d", state);
+                return INTERNAL_SERVER_ERROR;
+            }
+        }
+    }
+
+    req->keep_alive = parse_http_req_keep_alive(req);
     if (req->method == METHOD_UNDEFINED) {
+        //A request body is never read, so the next request could only be found without one
+        if (has_request_body(req)) {
+            req->keep_alive = false;
+        }
+        log(DEBUG, "parse_http_request returning METHOD_NOT_ALLOWED");
         return METHOD_NOT_ALLOWED;
     }
 
-    parse_http_req_uri(&cursor, req);
-    log(DEBUG, "HTTP request URI parsed: %s", req->URI);
-    if (req->URI == NULL) {
-        log(DEBUG, "parse_http_request returning BAD_REQUEST, URI==NULL");
-        return BAD_REQUEST;
+    log(DEBUG, "HTTP headers parsed:");
+#ifdef DEBUG_MODE
+    for (size_t i = 0; i < req->headers_count; i++) {
+        log(DEBUG, "%.*s: %.*s", req->headers[i].name_len, req->headers[i].name,
+                req->headers[i].value_len, req->headers[i].value);
     }
+#endif
 
-    parse_http_req_proto_ver(&cursor, req);
-    log(DEBUG, "HTTP request protocol version parsed: %s", http_version_t_to_string(req->http_version));
-    if (req->http_version == VERSION_UNDEFINED) {
-        log(DEBUG, "parse_http_request returning BAD_REQUEST, HTTP_VERSION==VERSION_UNDEFINED");
-        return BAD_REQUEST;
-    }
+    return OK;
+}
 
-    if (req->headers_count > 0) {
-        parse_http_req_headers(&cursor, req);
-        log(DEBUG, "HTTP headers parsed:");
-#ifdef DEBUG_MODE
-        for (size_t i = 0; i < req->headers_count; i++) {
-            log(DEBUG, "%.*s", req->headers[i].len - 2, req->headers[i].text);
+const struct http_field_t* find_http_header(const struct http_request_t* req, const char* name) {
+    size_t name_len = strlen(name);
+    for (size_t i = 0; i < req->headers_count; i++) {
+        if (req->headers[i].name_len == name_len && strncasecmp(req->headers[i].name, name, name_len) == 0) {
+            return &req->headers[i];
         }
-#endif
-        if (req->headers_count == 0) {
-            log(DEBUG, "parse_http_request returning INTERNAL_SERVER_ERROR, unable to parse headers");
-            return INTERNAL_SERVER_ERROR;
-        }
-    } else {
-        log(DEBUG, "There are no headers to parse in request");
     }
+    return NULL;
+}
 
-    return OK;
+static inline bool is_ows(char chr) {
+    return chr == ' ' || chr == '\t';
 }
 
-int build_date_header(struct http_header_t* header) {
-    if (header == NULL) {
-        log(ERROR, "Invalid function arguments");
-        return -1;
+//A q parameter of 0, 0.0, 0.00 or 0.000 rejects the coding
+static bool is_zero_qvalue(const char* cursor, const char* end) {
+    if (cursor >= end || *cursor != '0') {
+        return false;
+    }
+    cursor++;
+    if (cursor < end && *cursor == '.') {
+        cursor++;
+        while (cursor < end && *cursor == '0') {
+            cursor++;
+        }
     }
+    return cursor >= end || *cursor == ',' || *cursor == ';' || is_ows(*cursor);
+}
 
-    time_t raw_time; //timestamp
-    if (time(&raw_time) < 0) {
-        log(ERROR, "Unable to get calendar time");
-        return -1;
+//Mask of CONTENT_ENCODING_MASK() bits for the codings Accept-Encoding allows
+static unsigned int parse_accept_encoding(const struct http_request_t* req) {
+    const struct http_field_t* field = find_http_header(req, "Accept-Encoding");
+    if (field == NULL) {
+        return 0;
+    }
+    unsigned int mask = 0;
+    const char* cursor = field->value;
+    const char* end = field->value + field->value_len;
+    while (cursor < end) {
+        while (cursor < end && (is_ows(*cursor) || *cursor == ',')) {
+            cursor++;
+        }
+        const char* coding = cursor;
+        while (cursor < end && *cursor != ',' && *cursor != ';' && !is_ows(*cursor)) {
+            cursor++;
+        }
+        size_t coding_len = (size_t)(cursor - coding);
+
+        bool rejected = false;
+        while (cursor < end && *cursor != ',') {
+            if (*cursor == ';') {
+                cursor++;
+                while (cursor < end && is_ows(*cursor)) {
+                    cursor++;
+                }
+                if (end - cursor >= 2 && (*cursor == 'q' || *cursor == 'Q') && cursor[1] == '=') {
+                    rejected = is_zero_qvalue(cursor + 2, end);
+                }
+                continue;
+            }
+            cursor++;
+        }
+        if (rejected || coding_len == 0) {
+            continue;
+        }
+
+        if ((coding_len == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+            (coding_len == 6 && strncasecmp(coding, "x-gzip", 6) == 0)) {
+            mask |= CONTENT_ENCODING_MASK(CONTENT_ENCODING_GZIP);
+        } else if (coding_len == 2 && strncasecmp(coding, "br", 2) == 0) {
+            mask |= CONTENT_ENCODING_MASK(CONTENT_ENCODING_BR);
+        } else if (coding_len == 1 && *coding == '*') {
+            mask |= CONTENT_ENCODING_MASK(CONTENT_ENCODING_GZIP) | CONTENT_ENCODING_MASK(CONTENT_ENCODING_BR);
+        }
     }
+    return mask;
+}
 
-    struct tm* time_info = localtime(&raw_time); //datetime
-    if (time_info == NULL) {
-        log(ERROR, "Unable to parse raw_time into time_info");
-        return -1;
+//Switches resp to a precompressed <uri>.br/.gz sibling when one exists, otherwise
+//asks for on-the-fly compression. br is preferred over gzip.
+//Returns true when a sibling lookup is pending, resp->file_entry is then the pending sibling.
+static bool negotiate_content_encoding(const struct http_request_t* req, struct http_response_t* resp) {
+    unsigned int accepted = parse_accept_encoding(req);
+    if (accepted == 0) {
+        return false;
+    }
+    const enum content_encoding_t preferred[] = {CONTENT_ENCODING_BR, CONTENT_ENCODING_GZIP};
+    const size_t preferred_count = sizeof(preferred) / sizeof(preferred[0]);
+
+    char sibling_uri[4096];
+    bool is_directory_uri = req->URI_len > 0 && req->URI[req->URI_len - 1] == '/';
+    if (!is_directory_uri && req->URI_len + 4 <= sizeof(sibling_uri)) {
+        for (size_t i = 0; i < preferred_count; i++) {
+            if (!(accepted & CONTENT_ENCODING_MASK(preferred[i]))) {
+                continue;
+            }
+            const char* suffix = content_encoding_t_to_file_suffix(preferred[i]);
+            memcpy(sibling_uri, req->URI, req->URI_len);
+            strcpy(sibling_uri + req->URI_len, suffix);
+            struct file_cache_entry_t* sibling = NULL;
+            enum file_state_t sibling_state = file_cache_acquire(sibling_uri, &sibling);
+            if (sibling_state == FILE_STATE_PENDING) {
+                file_cache_release(resp->file_entry);
+                resp->file_entry = sibling;
+                return true;
+            }
+            if (sibling_state != FILE_STATE_OK) {
+                continue;
+            }
+            log(DEBUG, "Serving precompressed sibling %s", sibling_uri);
+            const struct mime_type_t* mime_type = resp->file_to_send.mime_type;
+            file_cache_release(resp->file_entry);
+            resp->file_entry = sibling;
+            resp->file_to_send = sibling->file;
+            resp->file_to_send.mime_type = mime_type;
+            resp->content_encoding = preferred[i];
+            return false;
+        }
     }
 
-    size_t header_len = strftime(header->text, HTTP_HEADER_DEFAULT_BUFFER_SIZE, "Date: %a, %d %b %Y %X %Z\r\n", time_info);
-    if (header_len == 0) {
-        log(ERROR, "Can not build Date header: buffer is too small");
-        return -1;
+    //Bodies are only compressed into the response cache, a file too large for it goes out as is
+    if (!is_response_cacheable(&resp->file_to_send)) {
+        return false;
+    }
+    for (size_t i = 0; i < preferred_count; i++) {
+        if ((accepted & CONTENT_ENCODING_MASK(preferred[i])) && is_content_encoding_supported(preferred[i])) {
+            resp->content_encoding = preferred[i];
+            resp->compress_body = true;
+            return false;
+        }
     }
+    return false;
+}
 
-    header->len = strlen(header->text);
-    return 0;
+//Weak comparison of every entity-tag in If-None-Match with etag (RFC 7232 3.2)
+static bool if_none_match_matches(const struct http_field_t* field, const char* etag, size_t etag_len) {
+    const char* cursor = field->value;
+    const char* end = field->value + field->value_len;
+    while (cursor < end) {
+        while (cursor < end && (is_ows(*cursor) || *cursor == ',')) {
+            cursor++;
+        }
+        if (cursor >= end) {
+            break;
+        }
+        if (*cursor == '*') {
+            return true;
+        }
+        if (end - cursor >= 2 && cursor[0] == 'W' && cursor[1] == '/') {
+            cursor += 2;
+        }
+        if (*cursor != '"') {
+            return false; //malformed list
+        }
+        const char* tag_end = memchr(cursor + 1, '"', (size_t)(end - cursor - 1));
+        if (tag_end == NULL) {
+            return false;
+        }
+        //The stored validator is strong, only the opaque-tag is compared
+        size_t tag_len = (size_t)(tag_end - cursor) + 1;
+        if (tag_len == etag_len && memcmp(cursor, etag, etag_len) == 0) {
+            return true;
+        }
+        cursor = tag_end + 1;
+    }
+    return false;
 }
 
-static int build_content_length_header(struct http_header_t* header, int64_t content_len) {
-    if (header == NULL || header->text == NULL) {
-        log(ERROR, "Invalid function arguments");
-        return -1;
+//If-None-Match takes precedence, If-Modified-Since is only evaluated without it
+static bool is_not_modified(const struct http_request_t* req, const struct http_response_t* resp) {
+    const struct http_field_t* if_none_match = find_http_header(req, "If-None-Match");
+    if (if_none_match != NULL) {
+        char etag[HTTP_ETAG_MAX_LEN];
+        size_t etag_len = format_etag(etag, &resp->file_to_send, resp->content_encoding);
+        return if_none_match_matches(if_none_match, etag, etag_len);
+    }
+    const struct http_field_t* if_modified_since = find_http_header(req, "If-Modified-Since");
+    if (if_modified_since != NULL) {
+        time_t since = 0;
+        if (parse_http_date(if_modified_since->value, if_modified_since->value_len, &since) < 0) {
+            return false; //an invalid date is ignored
+        }
+        return resp->file_to_send.mtime <= since;
     }
-    strcpy(header->text, STR_CONTENT_LENGTH_HEADER);
-    sprintf(header->text + strlen(header->text), "%lu\r\n", content_len);
-    header->len = strlen(header->text);
-    return 0;
+    return false;
 }
 
-static int build_content_type_header(struct http_header_t* header, enum mime_t mime_type) {
-    if (header == NULL || header->text == NULL) {
-        log(ERROR, "Invalid function arguments");
-        return -1;
+//If-Range holds either a strong ETag or the exact Last-Modified date (RFC 7233 3.2)
+static bool if_range_matches(const struct http_field_t* field, const struct http_response_t* resp) {
+    if (field->value_len > 0 && field->value[0] == '"') {
+        char etag[HTTP_ETAG_MAX_LEN];
+        size_t etag_len = format_etag(etag, &resp->file_to_send, resp->content_encoding);
+        return field->value_len == etag_len && memcmp(field->value, etag, etag_len) == 0;
     }
-    strcpy(header->text, STR_CONTENT_TYPE_HEADER);
-    strcat(header->text, mime_type_to_str(mime_type));
-    strcat(header->text, "\r\n\0");
-    header->len = strlen(header->text);
-    return 0;
+    time_t date = 0;
+    if (parse_http_date(field->value, field->value_len, &date) < 0) {
+        return false; //weak ETags and invalid dates never match
+    }
+    return date == resp->file_to_send.mtime;
 }
 
-enum http_state_t build_http_response(struct http_request_t* req, struct http_response_t* resp) {
-    const size_t headers_count = 5;
-    if (req == NULL || resp == NULL || resp->headers == NULL || resp->headers_count < headers_count) {
-        log(ERROR, "Invalid function arguments");
-        return INTERNAL_SERVER_ERROR;
+//Parses up to 18 digits, -1 if there are none
+static int64_t parse_range_pos(const char** cursor, const char* end) {
+    const char* start = *cursor;
+    int64_t value = 0;
+    while (*cursor < end && **cursor >= '0' && **cursor <= '9' && *cursor - start < 18) {
+        value = value * 10 + (**cursor - '0');
+        (*cursor)++;
     }
-    size_t header_idx = 0;
-    if (req->http_version == HTTPv1_1) {
-        resp->headers[header_idx] = (struct http_header_t) {
-                STR_CONNECTION_KEEP_ALIVE_HEADER,
-                strlen(STR_CONNECTION_KEEP_ALIVE_HEADER)
-        };
+    return *cursor == start ? -1 : value;
+}
+
+enum range_result_t {
+    RANGE_IGNORED, //the whole file is sent with 200
+    RANGE_SATISFIABLE,
+    RANGE_UNSATISFIABLE
+};
+
+//Only a single byte range is served, a Range with several of them is ignored
+static enum range_result_t parse_range(const struct http_field_t* field, int64_t file_len,
+                                       int64_t* range_start, int64_t* range_len) {
+    const char* cursor = field->value;
+    const char* end = field->value + field->value_len;
+    if (end - cursor < 6 || strncasecmp(cursor, "bytes=", 6) != 0) {
+        return RANGE_IGNORED;
+    }
+    cursor += 6;
+    while (cursor < end && is_ows(*cursor)) {
+        cursor++;
+    }
+
+    int64_t first = -1;
+    int64_t last = -1;
+    if (cursor < end && *cursor == '-') {
+        cursor++;
+        int64_t suffix_len = parse_range_pos(&cursor, end);
+        if (suffix_len < 0) {
+            return RANGE_IGNORED;
+        }
+        if (suffix_len == 0 || file_len == 0) {
+            return RANGE_UNSATISFIABLE;
+        }
+        first = suffix_len < file_len ? file_len - suffix_len : 0;
+        last = file_len - 1;
     } else {
-        resp->headers[header_idx] = (struct http_header_t) {
-            STR_CONNECTION_CLOSE_HEADER,
-            strlen(STR_CONNECTION_CLOSE_HEADER)
-        };
+        first = parse_range_pos(&cursor, end);
+        if (first < 0 || cursor >= end || *cursor != '-') {
+            return RANGE_IGNORED;
+        }
+        cursor++;
+        last = parse_range_pos(&cursor, end);
+        if (last >= 0 && last < first) {
+            return RANGE_IGNORED; //invalid byte-range-spec
+        }
+        if (first >= file_len) {
+            return RANGE_UNSATISFIABLE;
+        }
+        if (last < 0 || last >= file_len) {
+            last = file_len - 1;
+        }
     }
-    header_idx++;
 
-    int build_result = build_date_header(&resp->headers[header_idx]);
-    if (build_result < 0) {
-        log(ERROR, "Unable to build Date header");
-        resp->headers[header_idx] = (struct http_header_t){
-                STR_DEFAULT_DATE_HEADER,
-                strlen(STR_DEFAULT_DATE_HEADER)
-        };
+    while (cursor < end && is_ows(*cursor)) {
+        cursor++;
+    }
+    if (cursor != end) {
+        return RANGE_IGNORED; //multipart/byteranges is not supported, or garbage
     }
-    header_idx++;
+    *range_start = first;
+    *range_len = last - first + 1;
+    return RANGE_SATISFIABLE;
+}
 
-    bool should_get_fd = req->method==GET;
-    enum file_state_t inspect_result = inspect_file(req->URI, &resp->file_to_send, should_get_fd);
+static enum http_state_t apply_range(const struct http_request_t* req, struct http_response_t* resp) {
+    const struct http_field_t* range = find_http_header(req, "Range");
+    if (range == NULL || req->method != GET || !resp->accept_ranges) {
+        return OK;
+    }
+    const struct http_field_t* if_range = find_http_header(req, "If-Range");
+    if (if_range != NULL && !if_range_matches(if_range, resp)) {
+        return OK;
+    }
+
+    int64_t range_start = 0;
+    int64_t range_len = 0;
+    switch (parse_range(range, resp->file_to_send.len, &range_start, &range_len)) {
+        case RANGE_SATISFIABLE: {
+            log(DEBUG, "Serving range %ld+%ld of %s", (long)range_start, (long)range_len, req->URI);
+            resp->range_start = range_start;
+            resp->content_length = range_len;
+            return PARTIAL_CONTENT;
+        }
+        case RANGE_UNSATISFIABLE: {
+            resp->content_length = 0;
+            resp->has_content_type = 0;
+            return RANGE_NOT_SATISFIABLE;
+        }
+        default: {
+            return OK;
+        }
+    }
+}
+
+enum http_state_t build_http_response(struct http_request_t* req, struct http_response_t* resp) {
+    if (req == NULL || resp == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return INTERNAL_SERVER_ERROR;
+    }
+    resp->keep_alive = req->keep_alive;
+
+    enum file_state_t inspect_result = file_cache_acquire(req->URI, &resp->file_entry);
     switch (inspect_result) {
         case FILE_STATE_OK: {
             log(DEBUG, "File inspection successfully finished");
+            resp->file_to_send = resp->file_entry->file;
             break;
         }
+        case FILE_STATE_PENDING: {
+            log(DEBUG, "File inspection is in progress: %s", req->URI);
+            return STATE_PENDING;
+        }
         case FILE_STATE_NOT_FOUND: {
             log(DEBUG, "File inspection finished: file not found");
             return NOT_FOUND;
@@ -342,7 +685,7 @@ enum http_state_t build_http_response(struct http_request_t* req, struct http_re
             return FORBIDDEN;
         }
         case FILE_STATE_INTERNAL_ERROR: {
-            log(ERROR, "File inspection finished цшер штеуктфд уккщк");
+            log(ERROR, "File inspection finished with internal error");
             return INTERNAL_SERVER_ERROR;
         }
         default: {
@@ -350,33 +693,28 @@ enum http_state_t build_http_response(struct http_request_t* req, struct http_re
             return INTERNAL_SERVER_ERROR;
         }
     }
-    log(DEBUG, "File_to_send: fd: %d, len: %d, mime-type: %s",
-            resp->file_to_send.fd, resp->file_to_send.mime_type, mime_type_to_str(resp->file_to_send.mime_type));
-
-    build_result = build_content_length_header(&resp->headers[header_idx], resp->file_to_send.len);
-    if (build_result < 0) {
-        log(WARNING, "Unable to build Content-Length header");
-    } else {
-        header_idx++;
-    }
-    log(DEBUG, "Content-Length header built");
-
-    build_result = build_content_type_header(&resp->headers[header_idx], resp->file_to_send.mime_type);
-    if (build_result) {
-        log(WARNING, "Unable to build Content-Type header");
-    } else {
-        header_idx++;
+    if (resp->file_to_send.mime_type->compressible) {
+        resp->vary_accept_encoding = true;
+        if (negotiate_content_encoding(req, resp)) {
+            log(DEBUG, "Precompressed sibling lookup is in progress: %s", req->URI);
+            return STATE_PENDING;
+        }
     }
-    log(DEBUG, "Content-Type header built");
+    log(DEBUG, "File_to_send: fd: %d, len: %ld, mime-type: %s, encoding: %s",
+            resp->file_to_send.fd, resp->file_to_send.len, resp->file_to_send.mime_type->name,
+            content_encoding_t_to_string(resp->content_encoding));
 
-    resp->headers[header_idx] = (struct http_header_t){
-            STR_SERVER_HEADER,
-            strlen(STR_SERVER_HEADER)
-    };
-    header_idx++;
-
-    resp->code = OK;
+    resp->content_length = resp->file_to_send.len;
+    resp->has_content_type = 1;
+    resp->has_validators = 1;
     resp->http_version = req->http_version;
-    resp->headers_count = headers_count;
-    return OK;
+    //Byte ranges of a body compressed on the fly are not served
+    resp->accept_ranges = !resp->compress_body;
+    if (is_not_modified(req, resp)) {
+        log(DEBUG, "Resource is not modified: %s", req->URI);
+        resp->code = NOT_MODIFIED;
+        return NOT_MODIFIED;
+    }
+    resp->code = apply_range(req, resp);
+    return resp->code;
 }
@@ -0,0 +1,317 @@
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "../include/http_header.h"
+#include "../include/log.h"
+
+#define STATUS_LINE_CASE(state, reason) \
+    case state: { \
+        static const struct http_line_t line_v1_1 = HTTP_LINE("HTTP/1.1 " reason "\r\n"); \
+        static const struct http_line_t line_v1_0 = HTTP_LINE("HTTP/1.0 " reason "\r\n"); \
+        return version == HTTPv1_1 ? &line_v1_1 : &line_v1_0; \
+    }
+
+static const struct http_line_t* get_status_line(enum http_version_t version, enum http_state_t code) {
+    switch (code) {
+        STATUS_LINE_CASE(OK, "200 OK")
+        STATUS_LINE_CASE(PARTIAL_CONTENT, "206 Partial Content")
+        STATUS_LINE_CASE(NOT_MODIFIED, "304 Not Modified")
+        STATUS_LINE_CASE(BAD_REQUEST, "400 Bad Request")
+        STATUS_LINE_CASE(FORBIDDEN, "403 Forbidden")
+        STATUS_LINE_CASE(NOT_FOUND, "404 Not Found")
+        STATUS_LINE_CASE(METHOD_NOT_ALLOWED, "405 Method Not Allowed")
+        STATUS_LINE_CASE(RANGE_NOT_SATISFIABLE, "416 Range Not Satisfiable")
+        STATUS_LINE_CASE(REQUEST_HEADER_FIELDS_TOO_LARGE, "431 Request Header Fields Too Large")
+        STATUS_LINE_CASE(INTERNAL_SERVER_ERROR, "500 Internal Server Error")
+        default: {
+            log(ERROR, "Unknown response code: %d", code);
+            return get_status_line(version, INTERNAL_SERVER_ERROR);
+        }
+    }
+}
+
+static const struct http_line_t connection_keep_alive_line = HTTP_LINE("Connection: keep-alive\r\n");
+static const struct http_line_t connection_close_line = HTTP_LINE("Connection: close\r\n");
+static const struct http_line_t server_line = HTTP_LINE("Server: " APP_NAME "/" VERSION "\r\n");
+static const struct http_line_t vary_line = HTTP_LINE("Vary: Accept-Encoding\r\n");
+static const struct http_line_t accept_ranges_line = HTTP_LINE("Accept-Ranges: bytes\r\n");
+static const struct http_line_t content_encoding_gzip_line = HTTP_LINE("Content-Encoding: gzip\r\n");
+static const struct http_line_t content_encoding_br_line = HTTP_LINE("Content-Encoding: br\r\n");
+
+#define DATE_LINE_LEN (sizeof("Date: Thu, 01 Jan 1970 00:00:00 GMT\r\n") - 1)
+struct date_cache_t {
+    char text[DATE_LINE_LEN + 1];
+    time_t time; //0 until the first refresh
+};
+static __thread struct date_cache_t date_cache = {"Date: Thu, 01 Jan 1970 00:00:00 GMT\r\n", 0};
+
+static inline char* write_line(char* dest, const struct http_line_t* line) {
+    memcpy(dest, line->text, line->len);
+    return dest + line->len;
+}
+
+static inline char* write_two_digits(char* dest, int value) {
+    dest[0] = (char)('0' + value / 10);
+    dest[1] = (char)('0' + value % 10);
+    return dest + 2;
+}
+
+static const char day_names[7][3] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char month_names[12][3] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+char* write_http_date(char* dest, time_t time) {
+    struct tm time_info;
+    if (gmtime_r(&time, &time_info) == NULL) { //RFC 7231 IMF-fixdate is always GMT
+        log(ERROR, "Unable to convert time to GMT");
+        time = 0;
+        gmtime_r(&time, &time_info);
+    }
+
+    //Sun, 06 Nov 1994 08:49:37 GMT
+    char* cursor = dest;
+    memcpy(cursor, day_names[time_info.tm_wday], 3);
+    cursor += 3;
+    *cursor++ = ',';
+    *cursor++ = ' ';
+    cursor = write_two_digits(cursor, time_info.tm_mday);
+    *cursor++ = ' ';
+    memcpy(cursor, month_names[time_info.tm_mon], 3);
+    cursor += 3;
+    *cursor++ = ' ';
+    int year = time_info.tm_year + 1900;
+    cursor = write_two_digits(cursor, year / 100 % 100);
+    cursor = write_two_digits(cursor, year % 100);
+    *cursor++ = ' ';
+    cursor = write_two_digits(cursor, time_info.tm_hour);
+    *cursor++ = ':';
+    cursor = write_two_digits(cursor, time_info.tm_min);
+    *cursor++ = ':';
+    cursor = write_two_digits(cursor, time_info.tm_sec);
+    memcpy(cursor, " GMT", 4);
+    return cursor + 4;
+}
+
+static int parse_digits(const char* str, int count) {
+    int value = 0;
+    for (int i = 0; i < count; i++) {
+        if (str[i] < '0' || str[i] > '9') {
+            return -1;
+        }
+        value = value * 10 + (str[i] - '0');
+    }
+    return value;
+}
+
+int parse_http_date(const char* str, size_t len, time_t* result) {
+    //Sun, 06 Nov 1994 08:49:37 GMT
+    if (len != HTTP_DATE_LEN || str[3] != ',' || str[4] != ' ' || str[7] != ' ' || str[11] != ' ' ||
+        str[16] != ' ' || str[19] != ':' || str[22] != ':' || memcmp(str + 25, " GMT", 4) != 0) {
+        return -1;
+    }
+    struct tm time_info = {0};
+    time_info.tm_mon = -1;
+    for (int i = 0; i < 12; i++) {
+        if (strncasecmp(str + 8, month_names[i], 3) == 0) {
+            time_info.tm_mon = i;
+            break;
+        }
+    }
+    time_info.tm_mday = parse_digits(str + 5, 2);
+    int year = parse_digits(str + 12, 4);
+    time_info.tm_hour = parse_digits(str + 17, 2);
+    time_info.tm_min = parse_digits(str + 20, 2);
+    time_info.tm_sec = parse_digits(str + 23, 2);
+    if (time_info.tm_mon < 0 || time_info.tm_mday < 1 || time_info.tm_mday > 31 || year < 1970 ||
+        time_info.tm_hour < 0 || time_info.tm_hour > 23 || time_info.tm_min < 0 || time_info.tm_min > 59 ||
+        time_info.tm_sec < 0 || time_info.tm_sec > 60) {
+        return -1;
+    }
+    time_info.tm_year = year - 1900;
+    *result = timegm(&time_info);
+    return 0;
+}
+
+void http_date_refresh(void) {
+    time_t now = time(NULL);
+    if (now == date_cache.time) {
+        return;
+    }
+    //Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n
+    char* cursor = write_http_date(date_cache.text + strlen("Date: "), now);
+    memcpy(cursor, "\r\n", 2);
+    date_cache.time = now;
+}
+
+char* write_status_line(char* dest, enum http_version_t version, enum http_state_t code) {
+    return write_line(dest, get_status_line(version, code));
+}
+
+char* write_connection_header(char* dest, bool keep_alive) {
+    return write_line(dest, keep_alive ? &connection_keep_alive_line : &connection_close_line);
+}
+
+char* write_date_header(char* dest) {
+    if (__builtin_expect(date_cache.time == 0, 0)) {
+        http_date_refresh(); //threads without a worker timer, e.g. benchmarks
+    }
+    memcpy(dest, date_cache.text, DATE_LINE_LEN);
+    return dest + DATE_LINE_LEN;
+}
+
+char* write_uint(char* dest, uint64_t value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+        *dest++ = digits[--count];
+    }
+    return dest;
+}
+
+static char* write_hex(char* dest, uint64_t value) {
+    static const char hex_digits[16] = "0123456789abcdef";
+    char digits[16];
+    int count = 0;
+    do {
+        digits[count++] = hex_digits[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    while (count > 0) {
+        *dest++ = digits[--count];
+    }
+    return dest;
+}
+
+size_t format_etag(char* dest, const struct file_t* file, enum content_encoding_t encoding) {
+    char* cursor = dest;
+    *cursor++ = '"';
+    cursor = write_hex(cursor, (uint64_t)file->ino);
+    *cursor++ = '-';
+    cursor = write_hex(cursor, (uint64_t)file->len);
+    *cursor++ = '-';
+    cursor = write_hex(cursor, (uint64_t)file->mtime);
+    if (encoding != CONTENT_ENCODING_IDENTITY) {
+        //Every coding is a separate representation, so it needs its own strong validator
+        const char* coding = content_encoding_t_to_string(encoding);
+        size_t coding_len = strlen(coding);
+        *cursor++ = '-';
+        memcpy(cursor, coding, coding_len);
+        cursor += coding_len;
+    }
+    *cursor++ = '"';
+    return cursor - dest;
+}
+
+char* write_etag_header(char* dest, const struct file_t* file, enum content_encoding_t encoding) {
+    static const struct http_line_t name = HTTP_LINE("ETag: ");
+    dest = write_line(dest, &name);
+    dest += format_etag(dest, file, encoding);
+    *dest++ = '\r';
+    *dest++ = '\n';
+    return dest;
+}
+
+char* write_last_modified_header(char* dest, time_t mtime) {
+    static const struct http_line_t name = HTTP_LINE("Last-Modified: ");
+    dest = write_line(dest, &name);
+    dest = write_http_date(dest, mtime);
+    *dest++ = '\r';
+    *dest++ = '\n';
+    return dest;
+}
+
+char* write_content_length_header(char* dest, int64_t content_len) {
+    static const struct http_line_t name = HTTP_LINE("Content-Length: ");
+    dest = write_line(dest, &name);
+    dest = write_uint(dest, content_len > 0 ? (uint64_t)content_len : 0);
+    *dest++ = '\r';
+    *dest++ = '\n';
+    return dest;
+}
+
+char* write_content_type_header(char* dest, const struct mime_type_t* mime_type) {
+    memcpy(dest, mime_type->content_type_line, mime_type->content_type_line_len);
+    return dest + mime_type->content_type_line_len;
+}
+
+char* write_server_header(char* dest) {
+    return write_line(dest, &server_line);
+}
+
+char* write_content_encoding_header(char* dest, enum content_encoding_t encoding) {
+    switch (encoding) {
+        case CONTENT_ENCODING_GZIP: {
+            return write_line(dest, &content_encoding_gzip_line);
+        }
+        case CONTENT_ENCODING_BR: {
+            return write_line(dest, &content_encoding_br_line);
+        }
+        default: {
+            return dest;
+        }
+    }
+}
+
+char* write_vary_header(char* dest) {
+    return write_line(dest, &vary_line);
+}
+
+char* write_accept_ranges_header(char* dest) {
+    return write_line(dest, &accept_ranges_line);
+}
+
+char* write_content_range_header(char* dest, const struct http_response_t* resp) {
+    static const struct http_line_t name = HTTP_LINE("Content-Range: bytes ");
+    dest = write_line(dest, &name);
+    if (resp->code == RANGE_NOT_SATISFIABLE) {
+        *dest++ = '*';
+    } else {
+        dest = write_uint(dest, (uint64_t)resp->range_start);
+        *dest++ = '-';
+        dest = write_uint(dest, (uint64_t)(resp->range_start + resp->content_length - 1));
+    }
+    *dest++ = '/';
+    dest = write_uint(dest, (uint64_t)resp->file_to_send.len);
+    *dest++ = '\r';
+    *dest++ = '\n';
+    return dest;
+}
+
+size_t serialize_http_response_head(const struct http_response_t* resp, char* dest) {
+    char* cursor = dest;
+    cursor = write_status_line(cursor, resp->http_version, resp->code);
+    cursor = write_connection_header(cursor, resp->keep_alive);
+    cursor = write_date_header(cursor);
+    //304 has no body, so it describes none with Content-* headers
+    if (resp->code != NOT_MODIFIED) {
+        cursor = write_content_length_header(cursor, resp->content_length);
+        if (resp->has_content_type) {
+            cursor = write_content_type_header(cursor, resp->file_to_send.mime_type);
+        }
+        if (resp->code == PARTIAL_CONTENT || resp->code == RANGE_NOT_SATISFIABLE) {
+            cursor = write_content_range_header(cursor, resp);
+        }
+        if (resp->code != RANGE_NOT_SATISFIABLE) {
+            cursor = write_content_encoding_header(cursor, resp->content_encoding);
+        }
+    }
+    if (resp->accept_ranges) {
+        cursor = write_accept_ranges_header(cursor);
+    }
+    if (resp->has_validators) {
+        cursor = write_etag_header(cursor, &resp->file_to_send, resp->content_encoding);
+        cursor = write_last_modified_header(cursor, resp->file_to_send.mtime);
+    }
+    if (resp->vary_accept_encoding) {
+        cursor = write_vary_header(cursor);
+    }
+    cursor = write_server_header(cursor);
+    *cursor++ = '\r';
+    *cursor++ = '\n';
+    return cursor - dest;
+}
@@ -0,0 +1,216 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "../include/http_scan.h"
+
+enum scan_class_t {
+    SCAN_TOKEN_END,
+    SCAN_HEADER_NAME_END,
+    SCAN_HEADER_VALUE_END,
+    SCAN_CLASSES_COUNT
+};
+
+static bool scan_tables[SCAN_CLASSES_COUNT][256];
+
+static void init_scan_tables(void) {
+    for (int chr = 0; chr < 256; chr++) {
+        bool is_ctl = chr < 0x20 || chr == 0x7f;
+        scan_tables[SCAN_TOKEN_END][chr] = is_ctl || chr == ' ';
+        scan_tables[SCAN_HEADER_NAME_END][chr] = is_ctl || chr == ' ' || chr == ':';
+        scan_tables[SCAN_HEADER_VALUE_END][chr] = is_ctl && chr != '\t';
+    }
+}
+
+static inline const char* scan_scalar(const char* cursor, const char* end, enum scan_class_t scan_class) {
+    const bool* table = scan_tables[scan_class];
+    while (cursor < end && !table[(unsigned char)*cursor]) {
+        cursor++;
+    }
+    return cursor;
+}
+
+static const char* token_end_scalar(const char* cursor, const char* end) {
+    return scan_scalar(cursor, end, SCAN_TOKEN_END);
+}
+
+static const char* header_name_end_scalar(const char* cursor, const char* end) {
+    return scan_scalar(cursor, end, SCAN_HEADER_NAME_END);
+}
+
+static const char* header_value_end_scalar(const char* cursor, const char* end) {
+    return scan_scalar(cursor, end, SCAN_HEADER_VALUE_END);
+}
+
+//SSE4.2: PCMPESTRI in ranges mode finds the first byte inside up to 8 [low, high] pairs
+#define SSE42_SCAN_FLAGS (_SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS)
+
+__attribute__((target("sse4.2")))
+static inline const char* scan_sse42(const char* cursor, const char* end, __m128i ranges, int ranges_len,
+                                     enum scan_class_t scan_class) {
+    while (end - cursor >= 16) {
+        __m128i data = _mm_loadu_si128((const __m128i*)cursor);
+        int idx = _mm_cmpestri(ranges, ranges_len, data, 16, SSE42_SCAN_FLAGS);
+        if (idx != 16) {
+            return cursor + idx;
+        }
+        cursor += 16;
+    }
+    return scan_scalar(cursor, end, scan_class);
+}
+
+__attribute__((target("sse4.2")))
+static const char* token_end_sse42(const char* cursor, const char* end) {
+    const __m128i ranges = _mm_setr_epi8(0x00, 0x20, 0x7f, 0x7f, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    return scan_sse42(cursor, end, ranges, 4, SCAN_TOKEN_END);
+}
+
+__attribute__((target("sse4.2")))
+static const char* header_name_end_sse42(const char* cursor, const char* end) {
+    const __m128i ranges = _mm_setr_epi8(0x00, 0x20, ':', ':', 0x7f, 0x7f, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    return scan_sse42(cursor, end, ranges, 6, SCAN_HEADER_NAME_END);
+}
+
+__attribute__((target("sse4.2")))
+static const char* header_value_end_sse42(const char* cursor, const char* end) {
+    const __m128i ranges = _mm_setr_epi8(0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    return scan_sse42(cursor, end, ranges, 6, SCAN_HEADER_VALUE_END);
+}
+
+//AVX2: 32 bytes per step, unsigned "chr <= limit" is computed as min(chr, limit) == chr
+__attribute__((target("avx2")))
+static inline __m256i avx2_le(__m256i data, char limit) {
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(data, _mm256_set1_epi8(limit)), data);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_eq(__m256i data, char chr) {
+    return _mm256_cmpeq_epi8(data, _mm256_set1_epi8(chr));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_match(__m256i data, enum scan_class_t scan_class) {
+    switch (scan_class) {
+        case SCAN_TOKEN_END: {
+            return _mm256_or_si256(avx2_le(data, 0x20), avx2_eq(data, 0x7f));
+        }
+        case SCAN_HEADER_NAME_END: {
+            return _mm256_or_si256(_mm256_or_si256(avx2_le(data, 0x20), avx2_eq(data, ':')), avx2_eq(data, 0x7f));
+        }
+        default: {
+            __m256i ctl = _mm256_andnot_si256(avx2_eq(data, '\t'), avx2_le(data, 0x1f));
+            return _mm256_or_si256(ctl, avx2_eq(data, 0x7f));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static inline const char* scan_avx2(const char* cursor, const char* end, enum scan_class_t scan_class) {
+    while (end - cursor >= 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i*)cursor);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(avx2_match(data, scan_class));
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+        cursor += 32;
+    }
+    return scan_scalar(cursor, end, scan_class);
+}
+
+__attribute__((target("avx2")))
+static const char* token_end_avx2(const char* cursor, const char* end) {
+    return scan_avx2(cursor, end, SCAN_TOKEN_END);
+}
+
+__attribute__((target("avx2")))
+static const char* header_name_end_avx2(const char* cursor, const char* end) {
+    return scan_avx2(cursor, end, SCAN_HEADER_NAME_END);
+}
+
+__attribute__((target("avx2")))
+static const char* header_value_end_avx2(const char* cursor, const char* end) {
+    return scan_avx2(cursor, end, SCAN_HEADER_VALUE_END);
+}
+
+typedef const char* (*scan_func_t)(const char*, const char*);
+
+struct scan_funcs_t {
+    scan_func_t token_end;
+    scan_func_t header_name_end;
+    scan_func_t header_value_end;
+};
+
+static const struct scan_funcs_t scalar_funcs = {token_end_scalar, header_name_end_scalar, header_value_end_scalar};
+static const struct scan_funcs_t sse42_funcs = {token_end_sse42, header_name_end_sse42, header_value_end_sse42};
+static const struct scan_funcs_t avx2_funcs = {token_end_avx2, header_name_end_avx2, header_value_end_avx2};
+
+static const struct scan_funcs_t* scan_funcs = NULL;
+static enum http_scan_impl_t scan_impl = HTTP_SCAN_IMPL_SCALAR;
+
+enum http_scan_impl_t http_scan_set_impl(enum http_scan_impl_t impl) {
+    init_scan_tables();
+    __builtin_cpu_init();
+    if (impl == HTTP_SCAN_IMPL_AVX2 && !__builtin_cpu_supports("avx2")) {
+        impl = HTTP_SCAN_IMPL_SSE42;
+    }
+    if (impl == HTTP_SCAN_IMPL_SSE42 && !__builtin_cpu_supports("sse4.2")) {
+        impl = HTTP_SCAN_IMPL_SCALAR;
+    }
+
+    switch (impl) {
+        case HTTP_SCAN_IMPL_AVX2: {
+            scan_funcs = &avx2_funcs;
+            break;
+        }
+        case HTTP_SCAN_IMPL_SSE42: {
+            scan_funcs = &sse42_funcs;
+            break;
+        }
+        default: {
+            impl = HTTP_SCAN_IMPL_SCALAR;
+            scan_funcs = &scalar_funcs;
+            break;
+        }
+    }
+    scan_impl = impl;
+    return impl;
+}
+
+//Every thread that races here stores the same pointer
+static inline const struct scan_funcs_t* get_scan_funcs(void) {
+    if (__builtin_expect(scan_funcs == NULL, 0)) {
+        http_scan_set_impl(HTTP_SCAN_IMPL_AVX2);
+    }
+    return scan_funcs;
+}
+
+const char* http_scan_token_end(const char* cursor, const char* end) {
+    return get_scan_funcs()->token_end(cursor, end);
+}
+
+const char* http_scan_header_name_end(const char* cursor, const char* end) {
+    return get_scan_funcs()->header_name_end(cursor, end);
+}
+
+const char* http_scan_header_value_end(const char* cursor, const char* end) {
+    return get_scan_funcs()->header_value_end(cursor, end);
+}
+
+enum http_scan_impl_t http_scan_get_impl(void) {
+    get_scan_funcs();
+    return scan_impl;
+}
+
+const char* http_scan_impl_t_to_string(enum http_scan_impl_t impl) {
+    switch (impl) {
+        case HTTP_SCAN_IMPL_AVX2: {
+            return "avx2\0";
+        }
+        case HTTP_SCAN_IMPL_SSE42: {
+            return "sse4.2\0";
+        }
+        default: {
+            return "scalar\0";
+        }
+    }
+}
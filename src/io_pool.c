@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zconf.h>
+#include <sys/eventfd.h>
+
+#include <event2/event.h>
+
+#include "../include/io_pool.h"
+#include "../include/config.h"
+#include "../include/log.h"
+
+struct io_pool_t {
+    int notify_fd; //eventfd, readable while finished jobs are waiting
+    struct event* notify_event;
+    pthread_mutex_t mutex;
+    pthread_cond_t idle_cond; //signalled when in_flight drops to zero
+    struct io_job_t* finished; //newest first
+    unsigned int in_flight; //submitted and not yet posted back
+};
+
+//Jobs of every worker of the process wait here for a pool thread
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct io_job_t* queue_head = NULL;
+static struct io_job_t* queue_tail = NULL;
+static bool threads_started = false; //started after fork(), in the process that submits
+
+static void post_back(struct io_job_t* job) {
+    struct io_pool_t* pool = job->pool;
+    pthread_mutex_lock(&pool->mutex);
+    bool was_empty = pool->finished == NULL;
+    job->next = pool->finished;
+    pool->finished = job;
+
+    //One wakeup per batch, the worker takes every finished job at once. The eventfd is written
+    //under the mutex: once in_flight drops to zero io_pool_close() may close it and free the pool.
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(pool->notify_fd, &one, sizeof(one)) < 0) {
+            log(ERROR, "Unable to notify worker of finished I/O: %s", strerror(errno));
+        }
+    }
+    pool->in_flight--;
+    if (pool->in_flight == 0) {
+        pthread_cond_broadcast(&pool->idle_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void* pool_thread_routine(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        }
+        struct io_job_t* job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+
+        job->work(job);
+        post_back(job);
+    }
+    return NULL;
+}
+
+//Runs the done callbacks of finished jobs in submission order
+static void run_finished(struct io_pool_t* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    struct io_job_t* finished = pool->finished;
+    pool->finished = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    struct io_job_t* ordered = NULL;
+    while (finished != NULL) {
+        struct io_job_t* next = finished->next;
+        finished->next = ordered;
+        ordered = finished;
+        finished = next;
+    }
+    while (ordered != NULL) {
+        struct io_job_t* next = ordered->next;
+        ordered->done(ordered);
+        ordered = next;
+    }
+}
+
+static void notify_cb(evutil_socket_t fd, short events, void* ctx) {
+    uint64_t count = 0;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log(ERROR, "Unable to read I/O notification: %s", strerror(errno));
+    }
+    run_finished((struct io_pool_t*)ctx);
+}
+
+static int start_threads(void) {
+    pthread_mutex_lock(&queue_mutex);
+    int result = 0;
+    if (!threads_started) {
+        for (int i = 0; i < IO_THREADS; i++) {
+            pthread_t thread;
+            int err = pthread_create(&thread, NULL, pool_thread_routine, NULL);
+            if (err != 0) {
+                log(ERROR, "Unable to start I/O thread: %s", strerror(err));
+                result = i > 0 ? 0 : -1; //fewer threads still work
+                break;
+            }
+            pthread_detach(thread);
+        }
+        threads_started = result == 0;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return result;
+}
+
+struct io_pool_t* io_pool_open(struct event_base* base) {
+    if (start_threads() < 0) {
+        return NULL;
+    }
+    struct io_pool_t* pool = calloc(1, sizeof(struct io_pool_t));
+    if (pool == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        return NULL;
+    }
+    pool->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->notify_fd < 0) {
+        log(ERROR, "Unable to create eventfd: %s", strerror(errno));
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pool->notify_event = event_new(base, pool->notify_fd, EV_READ | EV_PERSIST, notify_cb, pool);
+    if (pool->notify_event == NULL || event_add(pool->notify_event, NULL) < 0) {
+        log(ERROR, "Unable to watch I/O notifications");
+        io_pool_close(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void io_pool_close(struct io_pool_t* pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->in_flight > 0) {
+        pthread_cond_wait(&pool->idle_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    run_finished(pool);
+
+    if (pool->notify_event != NULL) {
+        event_free(pool->notify_event);
+    }
+    close(pool->notify_fd);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+void io_pool_submit(struct io_pool_t* pool, struct io_job_t* job) {
+    job->pool = pool;
+    job->next = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    pool->in_flight++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_tail != NULL) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
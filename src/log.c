@@ -1,8 +1,12 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <memory.h>
+#include <time.h>
+#include <zconf.h>
 
 #include "../include/log.h"
 #include "../include/config.h"
@@ -20,72 +24,314 @@
 #define ERROR_TITLE   "[ERRO]"
 #define FATAL_TITLE   "[FATA]"
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#ifdef DO_COLOR_LOG
+#define LOG_COLOR_RESET ANSI_COLOR_RESET
+#else
+#define LOG_COLOR_RESET ""
+#endif
+
+struct log_record_t {
+    int fd; //STDOUT_FILENO or STDERR_FILENO
+    size_t len;
+    char text[LOG_RECORD_SIZE];
+};
+
+//Single producer (the owning thread), single consumer (whoever holds flush_mutex)
+struct log_ring_t {
+    _Atomic size_t head; //next slot to fill, written by the producer only
+    _Atomic size_t tail; //next slot to flush, written by the consumer only
+    _Atomic uint64_t dropped;
+    struct log_record_t records[LOG_RING_SLOTS];
+};
+
+//Rings are never freed: logging threads are the workers, which live as long as the process
+static struct log_ring_t* rings[LOG_MAX_RINGS];
+static _Atomic size_t rings_count = 0;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring_t* thread_ring = NULL;
+
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic uint64_t registration_dropped = 0; //threads beyond LOG_MAX_RINGS
+static uint64_t reported_dropped = 0; //guarded by flush_mutex
+static _Atomic bool flusher_started = false; //set under rings_mutex, reset in a forked child
+//The flusher waits on flush_cond while every ring is empty, the first record committed after
+//that wakes it. The timed wait only bounds a missed wakeup.
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static _Atomic bool flusher_waiting = false;
+
+static void write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written <= 0) {
+            return; //nowhere to report a failed log write
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+}
+
+struct log_batch_t {
+    int fd;
+    size_t len;
+    char data[64 * 1024];
+};
+
+static void batch_flush(struct log_batch_t* batch) {
+    write_all(batch->fd, batch->data, batch->len);
+    batch->len = 0;
+}
+
+static void batch_add(struct log_batch_t* batch, const char* text, size_t len) {
+    if (batch->len + len > sizeof(batch->data)) {
+        batch_flush(batch);
+    }
+    memcpy(batch->data + batch->len, text, len);
+    batch->len += len;
+}
+
+//Consumer side, flush_mutex must be held. Returns the number of flushed records.
+static size_t drain_rings(void) {
+    static struct log_batch_t out_batch = {STDOUT_FILENO, 0, {0}};
+    static struct log_batch_t err_batch = {STDERR_FILENO, 0, {0}};
+
+    size_t flushed = 0;
+    uint64_t dropped = atomic_load_explicit(&registration_dropped, memory_order_relaxed);
+    size_t count = atomic_load_explicit(&rings_count, memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        struct log_ring_t* ring = rings[i];
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            struct log_record_t* record = &ring->records[tail & (LOG_RING_SLOTS - 1)];
+            batch_add(record->fd == STDERR_FILENO ? &err_batch : &out_batch, record->text, record->len);
+            flushed++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+
+    if (dropped != reported_dropped) {
+        char text[128];
+        int len = snprintf(text, sizeof(text), "%s <log.c> %lu log messages dropped: ring buffer is full\n",
+                WARNING_TITLE, (unsigned long)(dropped - reported_dropped));
+        batch_add(&err_batch, text, (size_t)len);
+        reported_dropped = dropped;
+    }
+    batch_flush(&out_batch);
+    batch_flush(&err_batch);
+    return flushed;
+}
+
+static bool rings_empty(void) {
+    size_t count = atomic_load(&rings_count);
+    for (size_t i = 0; i < count; i++) {
+        if (atomic_load(&rings[i]->head) != atomic_load_explicit(&rings[i]->tail, memory_order_relaxed)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void wait_for_records(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += LOG_FLUSH_TIMEOUT_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&wake_mutex);
+    //Set before the rings are checked, a producer committing afterwards sees it and signals
+    atomic_store(&flusher_waiting, true);
+    if (rings_empty()) {
+        pthread_cond_timedwait(&flush_cond, &wake_mutex, &deadline);
+    }
+    atomic_store(&flusher_waiting, false);
+    pthread_mutex_unlock(&wake_mutex);
+}
+
+static void* flusher_routine(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&flush_mutex);
+        size_t flushed = drain_rings();
+        pthread_mutex_unlock(&flush_mutex);
+        if (flushed == 0) {
+            wait_for_records();
+        }
+    }
+    return NULL;
+}
+
+void log_flush(void) {
+    pthread_mutex_lock(&flush_mutex);
+    drain_rings();
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+uint64_t log_dropped_count(void) {
+    uint64_t dropped = atomic_load_explicit(&registration_dropped, memory_order_relaxed);
+    size_t count = atomic_load_explicit(&rings_count, memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        dropped += atomic_load_explicit(&rings[i]->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
+//Nothing may be left in the rings at fork(), otherwise the child would print it again
+static void atfork_prepare(void) {
+    pthread_mutex_lock(&rings_mutex);
+    pthread_mutex_lock(&flush_mutex);
+    drain_rings();
+    pthread_mutex_lock(&wake_mutex);
+}
+
+static void atfork_parent(void) {
+    pthread_mutex_unlock(&wake_mutex);
+    pthread_mutex_unlock(&flush_mutex);
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void atfork_child(void) {
+    flusher_started = false; //only the forking thread survives
+    flusher_waiting = false;
+    pthread_cond_init(&flush_cond, NULL); //may still count the parent's waiting flusher
+    pthread_mutex_unlock(&wake_mutex);
+    pthread_mutex_unlock(&flush_mutex);
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void init_logger(void) {
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+    atexit(log_flush);
+}
+
+//Called once per thread, registers its ring and starts the flusher of this process
+static struct log_ring_t* get_thread_ring(void) {
+    static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+    pthread_once(&init_once, init_logger);
+
+    pthread_mutex_lock(&rings_mutex);
+    if (thread_ring == NULL) {
+        size_t count = atomic_load_explicit(&rings_count, memory_order_relaxed);
+        if (count < LOG_MAX_RINGS) {
+            thread_ring = calloc(1, sizeof(struct log_ring_t));
+        }
+        if (thread_ring != NULL) {
+            rings[count] = thread_ring;
+            atomic_store_explicit(&rings_count, count + 1, memory_order_release);
+        }
+    }
+    if (!flusher_started) {
+        pthread_t flusher;
+        if (pthread_create(&flusher, NULL, flusher_routine, NULL) == 0) {
+            pthread_detach(flusher);
+            flusher_started = true;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    return thread_ring;
+}
+
+//Returns a free slot of the calling thread's ring or NULL if the message has to be dropped
+static struct log_record_t* reserve_record(void) {
+    struct log_ring_t* ring = thread_ring;
+    if (__builtin_expect(ring == NULL || !atomic_load_explicit(&flusher_started, memory_order_relaxed), 0)) {
+        ring = get_thread_ring();
+        if (ring == NULL) {
+            atomic_fetch_add_explicit(&registration_dropped, 1, memory_order_relaxed);
+            return NULL;
+        }
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+    return &ring->records[head & (LOG_RING_SLOTS - 1)];
+}
+
+static void commit_record(void) {
+    struct log_ring_t* ring = thread_ring;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    //Sequentially consistent with the flag, so either the flusher sees the record or it is woken
+    atomic_store(&ring->head, head + 1);
+    if (atomic_load(&flusher_waiting) && atomic_exchange(&flusher_waiting, false)) {
+        //Only while every ring was empty: the first record after that wakes the flusher
+        pthread_mutex_lock(&wake_mutex);
+        pthread_cond_signal(&flush_cond);
+        pthread_mutex_unlock(&wake_mutex);
+    }
+}
 
-void do_log(FILE* stream, const char* color, const char* log_title,
-            const char* file, int line, const char* fmt, va_list* argptr) {
-    pthread_mutex_lock(&mutex);
+static void do_log(int fd, const char* color, const char* log_title,
+                   const char* file, int line, const char* fmt, va_list* argptr) {
+    struct log_record_t* record = reserve_record();
+    if (record == NULL) {
+        return;
+    }
+
+    //Room for the color reset and the newline is kept at the end of the record
+    const size_t tail_len = strlen(LOG_COLOR_RESET) + 1;
+    const size_t capacity = sizeof(record->text) - tail_len;
+    size_t len = 0;
 #ifdef DO_COLOR_LOG
-    fprintf(stream, color);
+    len += (size_t)snprintf(record->text, capacity, "%s", color);
 #endif
+    if (log_title != NULL) {
 #ifdef LOG_FULL_FILE_PATH
-    fprintf(stream, "%s <%s:%d> ", log_title, file, line);
+        len += (size_t)snprintf(record->text + len, capacity - len, "%s <%s:%d> ", log_title, file, line);
 #else
-    fprintf(stream, "%s <%s:%d> ", log_title, strrchr(file, '/') + 1, line);
-#endif
-    vfprintf(stream, fmt, *argptr);
-    fprintf(stream, "\n");
-#ifdef DO_COLOR_LOG
-    fprintf(stream, ANSI_COLOR_RESET);
+        len += (size_t)snprintf(record->text + len, capacity - len, "%s <%s:%d> ", log_title, strrchr(file, '/') + 1, line);
 #endif
-    pthread_mutex_unlock(&mutex);
+    }
+    if (len < capacity) {
+        int msg_len = vsnprintf(record->text + len, capacity - len, fmt, *argptr);
+        if (msg_len > 0) {
+            len += (size_t)msg_len;
+        }
+    }
+    if (len >= capacity) {
+        len = capacity - 1; //truncated, vsnprintf() reserved a byte for NUL
+    }
+    memcpy(record->text + len, "\n" LOG_COLOR_RESET, tail_len);
+    record->len = len + tail_len;
+    record->fd = fd;
+    commit_record();
 }
 
 void _log(enum log_level_t log_level, const char* file, int line, const char* fmt, ...) {
-#ifndef DEBUG_MODE
-    if (log_level <LOG_LEVEL) {
+    if (log_level < LOG_MIN_LEVEL) {
         return;
     }
-#endif
     va_list argptr;
     va_start(argptr, fmt);
     switch (log_level) {
         case DEBUG: {
-#ifdef DEBUG_MODE
-            do_log(stdout, ANSI_COLOR_GREEN, DEBUG_TITLE, file, line, fmt, &argptr);
-#endif
+            do_log(STDOUT_FILENO, ANSI_COLOR_GREEN, DEBUG_TITLE, file, line, fmt, &argptr);
             break;
         }
         case INFO: {
-            do_log(stdout, ANSI_COLOR_RESET, INFO_TITLE, file, line, fmt, &argptr);
+            do_log(STDOUT_FILENO, ANSI_COLOR_RESET, INFO_TITLE, file, line, fmt, &argptr);
             break;
         }
         case WARNING: {
-            do_log(stdout, ANSI_COLOR_YELLOW, WARNING_TITLE, file, line, fmt, &argptr);
+            do_log(STDOUT_FILENO, ANSI_COLOR_YELLOW, WARNING_TITLE, file, line, fmt, &argptr);
             break;
         }
         case IMPORTANT: {
             //Log without title
-            pthread_mutex_lock(&mutex);
-#ifdef DO_COLOR_LOG
-            fprintf(stdout, ANSI_COLOR_MAGENTA ANSI_BOLD_TEXT);
-#endif
-            vfprintf(stdout, fmt, argptr);
-            fprintf(stdout, "\n");
-#ifdef DO_COLOR_LOG
-            fprintf(stdout, ANSI_COLOR_RESET);
-#endif
-            pthread_mutex_unlock(&mutex);
+            do_log(STDOUT_FILENO, ANSI_COLOR_MAGENTA ANSI_BOLD_TEXT, NULL, file, line, fmt, &argptr);
             break;
         }
         case ERROR: {
-            do_log(stderr, ANSI_COLOR_RED, ERROR_TITLE, file, line, fmt, &argptr);
+            do_log(STDERR_FILENO, ANSI_COLOR_RED, ERROR_TITLE, file, line, fmt, &argptr);
             break;
         }
         case FATAL: {
-            do_log(stderr, ANSI_COLOR_RED ANSI_BOLD_TEXT, FATAL_TITLE, file, line, fmt, &argptr);
+            do_log(STDERR_FILENO, ANSI_COLOR_RED ANSI_BOLD_TEXT, FATAL_TITLE, file, line, fmt, &argptr);
             va_end(argptr);
-            exit(EXIT_FAILURE);
+            exit(EXIT_FAILURE); //atexit() flushes the rings
         }
         default: {
             _log(ERROR, file, line, "Unknown log level");
@@ -2,12 +2,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/stat.h>
 
 #include "../include/config.h"
 #include "../include/server.h"
 #include "../include/log.h"
 
-int parse_config(const char *conf_path, int *cpu_limit, char **document_root) {
+int parse_config(const char *conf_path, struct config_t* config) {
     FILE* conf_file = fopen(conf_path, "r");
     if (conf_file == NULL) {
         return -1;
@@ -18,19 +19,32 @@ int parse_config(const char *conf_path, int *cpu_limit, char **document_root) {
 
     const char* const key_cpu_limit = "cpu_limit \0";
     const char* const key_document_root = "document_root \0";
+    const char* const key_response_cache_size = "response_cache_size \0";
+    const char* const key_response_cache_max_file_size = "response_cache_max_file_size \0";
+    const char* const key_worker_mode = "worker_mode \0";
+    const char* const key_cpu_affinity = "cpu_affinity \0";
+    const char* const key_access_log = "access_log \0";
+    const char* const key_access_log_max_size = "access_log_max_size \0";
+    const char* const key_file_body_copy_max_size = "file_body_copy_max_size \0";
+    const char* const key_file_body_mmap_max_size = "file_body_mmap_max_size \0";
+    const char* const key_io_uring = "io_uring \0";
+    const char* const key_io_threads = "io_threads \0";
+    const char* const key_mime_types = "mime_types \0";
+    const char* const key_keepalive_timeout = "keepalive_timeout \0";
+    const char* const key_header_timeout = "header_timeout \0";
+    const char* const key_write_timeout = "write_timeout \0";
+    const char* const key_max_connections = "max_connections \0";
+    const char* const key_metrics_port = "metrics_port \0";
 
-    char buffer[64];
+    char buffer[4096 + 64];
     char* cursor = NULL;
 
-    while (1) {
-        if (num_cpu_inited && document_root_inited) break;
-        if (!fgets(buffer, 64, conf_file)) return -1;
-
+    while (fgets(buffer, sizeof(buffer), conf_file)) {
         cursor = strstr(buffer, key_cpu_limit);
         if (cursor) {
             log(DEBUG, "Found cpu_limit");
             cursor += strlen(key_cpu_limit);
-            sscanf(cursor, "%d", cpu_limit);
+            sscanf(cursor, "%d", &config->cpu_limit);
             num_cpu_inited = true;
             continue;
         }
@@ -39,28 +53,217 @@ int parse_config(const char *conf_path, int *cpu_limit, char **document_root) {
         if (cursor) {
             log(DEBUG, "Found document_root");
             cursor += strlen(key_document_root);
-            strcpy(*document_root, cursor);
-            char* path_end = strpbrk(*document_root, "\n #");
+            strncpy(config->document_root, cursor, sizeof(config->document_root) - 1);
+            char* path_end = strpbrk(config->document_root, "\n #");
             if (path_end != NULL) {
                 *path_end = '\0';
             }
             document_root_inited = true;
             continue;
         }
+
+        cursor = strstr(buffer, key_response_cache_size);
+        if (cursor) {
+            log(DEBUG, "Found response_cache_size");
+            cursor += strlen(key_response_cache_size);
+            sscanf(cursor, "%zu", &config->response_cache_size);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_response_cache_max_file_size);
+        if (cursor) {
+            log(DEBUG, "Found response_cache_max_file_size");
+            cursor += strlen(key_response_cache_max_file_size);
+            sscanf(cursor, "%zu", &config->response_cache_max_file_size);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_worker_mode);
+        if (cursor) {
+            log(DEBUG, "Found worker_mode");
+            cursor += strlen(key_worker_mode);
+            if (strncmp(cursor, STR_WORKER_MODE_THREAD, strlen(STR_WORKER_MODE_THREAD)) == 0) {
+                config->worker_mode = WORKER_MODE_THREAD;
+            } else if (strncmp(cursor, STR_WORKER_MODE_FORK, strlen(STR_WORKER_MODE_FORK)) == 0) {
+                config->worker_mode = WORKER_MODE_FORK;
+            } else {
+                log(WARNING, "Unknown worker_mode, using fork");
+                config->worker_mode = WORKER_MODE_FORK;
+            }
+            continue;
+        }
+
+        cursor = strstr(buffer, key_cpu_affinity);
+        if (cursor) {
+            log(DEBUG, "Found cpu_affinity");
+            cursor += strlen(key_cpu_affinity);
+            config->cpu_affinity_len = 0;
+            char* num_end = NULL;
+            while (config->cpu_affinity_len < CPU_AFFINITY_MAX_LEN) {
+                long cpu = strtol(cursor, &num_end, 10);
+                if (num_end == cursor) {
+                    break;
+                }
+                config->cpu_affinity[config->cpu_affinity_len++] = (int)cpu;
+                cursor = num_end;
+                if (*cursor != ',') {
+                    break;
+                }
+                cursor++;
+            }
+            continue;
+        }
+
+        cursor = strstr(buffer, key_access_log);
+        if (cursor) {
+            log(DEBUG, "Found access_log");
+            cursor += strlen(key_access_log);
+            strncpy(config->access_log, cursor, sizeof(config->access_log) - 1);
+            char* path_end = strpbrk(config->access_log, "\n #");
+            if (path_end != NULL) {
+                *path_end = '\0';
+            }
+            continue;
+        }
+
+        cursor = strstr(buffer, key_access_log_max_size);
+        if (cursor) {
+            log(DEBUG, "Found access_log_max_size");
+            cursor += strlen(key_access_log_max_size);
+            sscanf(cursor, "%zu", &config->access_log_max_size);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_file_body_copy_max_size);
+        if (cursor) {
+            log(DEBUG, "Found file_body_copy_max_size");
+            cursor += strlen(key_file_body_copy_max_size);
+            sscanf(cursor, "%zu", &config->file_body_copy_max_size);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_file_body_mmap_max_size);
+        if (cursor) {
+            log(DEBUG, "Found file_body_mmap_max_size");
+            cursor += strlen(key_file_body_mmap_max_size);
+            sscanf(cursor, "%zu", &config->file_body_mmap_max_size);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_io_uring);
+        if (cursor) {
+            log(DEBUG, "Found io_uring");
+            cursor += strlen(key_io_uring);
+            config->io_uring = strncmp(cursor, "on", 2) == 0;
+            continue;
+        }
+
+        cursor = strstr(buffer, key_io_threads);
+        if (cursor) {
+            log(DEBUG, "Found io_threads");
+            cursor += strlen(key_io_threads);
+            sscanf(cursor, "%d", &config->io_threads);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_mime_types);
+        if (cursor) {
+            log(DEBUG, "Found mime_types");
+            cursor += strlen(key_mime_types);
+            strncpy(config->mime_types, cursor, sizeof(config->mime_types) - 1);
+            char* path_end = strpbrk(config->mime_types, "\n #");
+            if (path_end != NULL) {
+                *path_end = '\0';
+            }
+            continue;
+        }
+
+        cursor = strstr(buffer, key_keepalive_timeout);
+        if (cursor) {
+            log(DEBUG, "Found keepalive_timeout");
+            cursor += strlen(key_keepalive_timeout);
+            sscanf(cursor, "%d", &config->keepalive_timeout);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_header_timeout);
+        if (cursor) {
+            log(DEBUG, "Found header_timeout");
+            cursor += strlen(key_header_timeout);
+            sscanf(cursor, "%d", &config->header_timeout);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_write_timeout);
+        if (cursor) {
+            log(DEBUG, "Found write_timeout");
+            cursor += strlen(key_write_timeout);
+            sscanf(cursor, "%d", &config->write_timeout);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_max_connections);
+        if (cursor) {
+            log(DEBUG, "Found max_connections");
+            cursor += strlen(key_max_connections);
+            sscanf(cursor, "%d", &config->max_connections);
+            continue;
+        }
+
+        cursor = strstr(buffer, key_metrics_port);
+        if (cursor) {
+            log(DEBUG, "Found metrics_port");
+            cursor += strlen(key_metrics_port);
+            sscanf(cursor, "%d", &config->metrics_port);
+            continue;
+        }
+    }
+    fclose(conf_file);
+
+    if (!num_cpu_inited || !document_root_inited) {
+        return -1;
+    }
+    return 0;
+}
+
+static const char* conf_path = NULL;
+
+static void log_config(void) {
+    log(INFO, "httpd.conf parsed: document_root = %s, cpu_limit = %d, worker_mode = %s, response_cache_size = %zu",
+            DOCUMENT_ROOT, CPU_LIMIT, WORKER_MODE == WORKER_MODE_THREAD ? STR_WORKER_MODE_THREAD : STR_WORKER_MODE_FORK,
+            RESPONSE_CACHE_SIZE);
+}
+
+//Called by the master on SIGHUP, a broken file leaves the running configuration untouched
+static int reload_config(void) {
+    if (conf_path == NULL) {
+        log(WARNING, ".conf config file does not passed, nothing to reload");
+        return -1;
+    }
+    struct config_t config = CONFIG_INITIALIZER;
+    if (parse_config(conf_path, &config)) {
+        log(ERROR, "Unable to parse %s", conf_path);
+        return -1;
+    }
+    struct stat st;
+    if (stat(config.document_root, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        log(ERROR, "Document root %s is not a directory", config.document_root);
+        return -1;
     }
+    update_config(&config);
+    log_config();
     return 0;
 }
 
 int main(int argc, char **argv) {
     if (argc > 1) {
-        int cpu_limit = 0;
-        char* document_root = malloc(4096);
-        if(parse_config(argv[1], &cpu_limit, &document_root)) {
-            log(FATAL, "%s", document_root);
+        conf_path = argv[1];
+        struct config_t config = CONFIG_INITIALIZER;
+        if(parse_config(argv[1], &config)) {
             log(FATAL, "Unable to init config with .conf file");
         }
-        init_config(cpu_limit, document_root);
-        log(INFO, "httpd.conf parsed: document_root = %s, cpu_limit = %d", DOCUMENT_ROOT, CPU_LIMIT);
+        init_config(&config);
+        log_config();
     } else {
         log(WARNING, ".conf config file does not passed, using defaults");
     }
@@ -71,5 +274,5 @@ int main(int argc, char **argv) {
         return 1;
     }
     log(IMPORTANT, "%s v%s is listening on port %d", APP_NAME, VERSION, port);
-    return listen_and_serve((u_int16_t)port);
+    return listen_and_serve((u_int16_t)port, argv, reload_config);
 }
@@ -0,0 +1,202 @@
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <event2/buffer.h>
+
+#include "../include/metrics.h"
+#include "../include/log.h"
+
+struct metrics_t {
+    const struct metrics_t* draining; //mapped at the same address in the master and every worker forked after it
+    int workers_count;
+    struct worker_metrics_t workers[];
+};
+
+//Upper bounds of the histogram buckets in microseconds, the last bucket is +Inf
+static const uint64_t bucket_bounds_us[METRICS_HISTOGRAM_BUCKETS - 1] = {
+        100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000
+};
+
+static const enum http_state_t status_codes[METRICS_STATUS_CODES - 1] = {
+        OK, PARTIAL_CONTENT, NOT_MODIFIED, BAD_REQUEST, FORBIDDEN, NOT_FOUND, METHOD_NOT_ALLOWED,
+        RANGE_NOT_SATISFIABLE, REQUEST_HEADER_FIELDS_TOO_LARGE, INTERNAL_SERVER_ERROR
+};
+
+//Every counter has a single writer, the owning worker: a relaxed load and store is enough
+//and compiles to plain moves, while a reader in another process never sees a torn value
+static void add(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void observe(struct metrics_histogram_t* histogram, uint64_t value_us) {
+    size_t bucket = 0;
+    while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && value_us > bucket_bounds_us[bucket]) {
+        bucket++;
+    }
+    add(&histogram->buckets[bucket], 1);
+    add(&histogram->sum_us, value_us);
+}
+
+static void carry_histogram(struct metrics_histogram_t* to, const struct metrics_histogram_t* from) {
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        add(&to->buckets[i], load(&from->buckets[i]));
+    }
+    add(&to->sum_us, load(&from->sum_us));
+}
+
+//Every counter but the connections gauge
+static void carry(struct worker_metrics_t* to, const struct worker_metrics_t* from) {
+    for (size_t i = 0; i < METRICS_STATUS_CODES; i++) {
+        add(&to->requests[i], load(&from->requests[i]));
+    }
+    add(&to->bytes_out, load(&from->bytes_out));
+    add(&to->accepted, load(&from->accepted));
+    add(&to->response_cache_hits, load(&from->response_cache_hits));
+    carry_histogram(&to->request_duration, &from->request_duration);
+    carry_histogram(&to->loop_lag, &from->loop_lag);
+}
+
+struct metrics_t* metrics_create(int workers_count, const struct metrics_t* draining, const struct metrics_t* exited) {
+    size_t size = sizeof(struct metrics_t) + (size_t)workers_count * sizeof(struct worker_metrics_t);
+    struct metrics_t* metrics = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        log(ERROR, "Unable to map the metrics segment: %s", strerror(errno));
+        return NULL;
+    }
+    metrics->draining = draining;
+    metrics->workers_count = workers_count;
+    //Workers that are gone with a smaller generation are added to the slot of another one
+    for (int i = 0; exited != NULL && i < exited->workers_count; i++) {
+        carry(&metrics->workers[i % workers_count], &exited->workers[i]);
+    }
+    return metrics;
+}
+
+void metrics_destroy(struct metrics_t* metrics) {
+    if (metrics != NULL) {
+        munmap(metrics, sizeof(struct metrics_t) + (size_t)metrics->workers_count * sizeof(struct worker_metrics_t));
+    }
+}
+
+struct worker_metrics_t* metrics_worker(struct metrics_t* metrics, int worker_id) {
+    if (metrics == NULL || worker_id < 0 || worker_id >= metrics->workers_count) {
+        return NULL;
+    }
+    return &metrics->workers[worker_id];
+}
+
+void metrics_count_request(struct worker_metrics_t* worker, enum http_state_t status, uint64_t bytes,
+                           uint64_t duration_us) {
+    size_t index = 0;
+    while (index < METRICS_STATUS_CODES - 1 && status_codes[index] != status) {
+        index++;
+    }
+    add(&worker->requests[index], 1);
+    add(&worker->bytes_out, bytes);
+    observe(&worker->request_duration, duration_us);
+}
+
+void metrics_count_accept(struct worker_metrics_t* worker) {
+    add(&worker->accepted, 1);
+}
+
+void metrics_set_connections(struct worker_metrics_t* worker, unsigned int connections) {
+    __atomic_store_n(&worker->connections, (uint64_t)connections, __ATOMIC_RELAXED);
+}
+
+void metrics_count_response_cache_hit(struct worker_metrics_t* worker) {
+    add(&worker->response_cache_hits, 1);
+}
+
+void metrics_count_loop_lag(struct worker_metrics_t* worker, uint64_t lag_us) {
+    observe(&worker->loop_lag, lag_us);
+}
+
+//Workers of both generations with the same number count as one
+static int workers_count(const struct metrics_t* metrics) {
+    const struct metrics_t* draining = metrics->draining;
+    return draining != NULL && draining->workers_count > metrics->workers_count
+           ? draining->workers_count : metrics->workers_count;
+}
+
+static uint64_t load_worker(const struct metrics_t* metrics, int worker_id, size_t offset) {
+    const struct metrics_t* segments[] = {metrics, metrics->draining};
+    uint64_t value = 0;
+    for (size_t i = 0; i < sizeof(segments) / sizeof(segments[0]); i++) {
+        if (segments[i] != NULL && worker_id < segments[i]->workers_count) {
+            value += load((const uint64_t*)((const char*)&segments[i]->workers[worker_id] + offset));
+        }
+    }
+    return value;
+}
+
+static void write_worker_counter(const struct metrics_t* metrics, struct evbuffer* output, const char* name,
+                                 const char* type, const char* help, size_t offset) {
+    evbuffer_add_printf(output, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (int i = 0; i < workers_count(metrics); i++) {
+        evbuffer_add_printf(output, "%s{worker=\"%d\"} %lu\n", name, i, (unsigned long)load_worker(metrics, i, offset));
+    }
+}
+
+//Workers are summed up, their histograms are rarely interesting apart
+static void write_histogram(const struct metrics_t* metrics, struct evbuffer* output, const char* name,
+                            const char* help, size_t offset) {
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS] = {0};
+    uint64_t sum_us = 0;
+    for (int i = 0; i < workers_count(metrics); i++) {
+        for (size_t j = 0; j < METRICS_HISTOGRAM_BUCKETS; j++) {
+            buckets[j] += load_worker(metrics, i, offset + j * sizeof(uint64_t));
+        }
+        sum_us += load_worker(metrics, i, offset + offsetof(struct metrics_histogram_t, sum_us));
+    }
+
+    evbuffer_add_printf(output, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    for (size_t j = 0; j < METRICS_HISTOGRAM_BUCKETS - 1; j++) {
+        cumulative += buckets[j];
+        evbuffer_add_printf(output, "%s_bucket{le=\"%g\"} %lu\n", name, (double)bucket_bounds_us[j] / 1e6,
+                            (unsigned long)cumulative);
+    }
+    cumulative += buckets[METRICS_HISTOGRAM_BUCKETS - 1];
+    evbuffer_add_printf(output, "%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)cumulative);
+    evbuffer_add_printf(output, "%s_sum %.6f\n", name, (double)sum_us / 1e6);
+    evbuffer_add_printf(output, "%s_count %lu\n", name, (unsigned long)cumulative);
+}
+
+void metrics_write_prometheus(const struct metrics_t* metrics, struct evbuffer* output) {
+    evbuffer_add_printf(output, "# HELP httpd_requests_total Requests answered, by status code.\n"
+                                "# TYPE httpd_requests_total counter\n");
+    for (int i = 0; i < workers_count(metrics); i++) {
+        for (size_t j = 0; j < METRICS_STATUS_CODES; j++) {
+            uint64_t count = load_worker(metrics, i, offsetof(struct worker_metrics_t, requests) + j * sizeof(uint64_t));
+            if (j < METRICS_STATUS_CODES - 1) {
+                evbuffer_add_printf(output, "httpd_requests_total{worker=\"%d\",code=\"%d\"} %lu\n",
+                                    i, (int)status_codes[j], (unsigned long)count);
+            } else {
+                evbuffer_add_printf(output, "httpd_requests_total{worker=\"%d\",code=\"other\"} %lu\n",
+                                    i, (unsigned long)count);
+            }
+        }
+    }
+    write_worker_counter(metrics, output, "httpd_response_bytes_total", "counter",
+                         "Response heads and bodies queued for clients.", offsetof(struct worker_metrics_t, bytes_out));
+    write_worker_counter(metrics, output, "httpd_accepted_connections_total", "counter",
+                         "Connections accepted.", offsetof(struct worker_metrics_t, accepted));
+    write_worker_counter(metrics, output, "httpd_connections", "gauge",
+                         "Open client connections.", offsetof(struct worker_metrics_t, connections));
+    write_worker_counter(metrics, output, "httpd_response_cache_hits_total", "counter",
+                         "Responses served from the response cache.",
+                         offsetof(struct worker_metrics_t, response_cache_hits));
+    write_histogram(metrics, output, "httpd_request_duration_seconds",
+                    "From the complete request headers to the queued response.",
+                    offsetof(struct worker_metrics_t, request_duration));
+    write_histogram(metrics, output, "httpd_event_loop_lag_seconds",
+                    "How late a periodic timer of the worker event loops fired.",
+                    offsetof(struct worker_metrics_t, loop_lag));
+}
@@ -0,0 +1,400 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../include/mime.h"
+#include "../include/log.h"
+
+const struct mime_type_t MIME_TYPE_OCTET_STREAM = {
+        "application/octet-stream",
+        "Content-Type: application/octet-stream\r\n",
+        sizeof("Content-Type: application/octet-stream\r\n") - 1,
+        false
+};
+
+//Used when no mime.types file is configured or readable
+static const char* const builtin_mime_types[] = {
+        "text/html html",
+        "text/css css",
+        "application/javascript js",
+        "image/jpeg jpg jpeg",
+        "image/png png",
+        "image/gif gif",
+        "application/x-shockwave-flash swf",
+};
+
+struct mime_slot_t {
+    char ext[MIME_EXTENSION_MAX_LEN + 1]; //lower case
+    size_t len; //0 for a free slot
+    const struct mime_type_t* type;
+};
+
+//Perfect hash with displacement: an extension falls into bucket hash(ext, 0) % buckets_count,
+//and every bucket got a seed that sends its extensions to free, distinct slots hash(ext, seed) & slots_mask
+static struct mime_slot_t* slots = NULL;
+static uint32_t slots_mask = 0;
+static uint32_t* bucket_seeds = NULL;
+static uint32_t buckets_count = 0;
+static struct mime_type_t* types = NULL;
+static size_t types_count = 0;
+
+#define MIME_MAX_SEED (1u << 16) //tries per bucket before the table is made twice as large
+
+//Extensions and types while the file is parsed
+struct mime_key_t {
+    char ext[MIME_EXTENSION_MAX_LEN + 1];
+    size_t len;
+    size_t type_index;
+    size_t order; //the first of duplicate extensions wins
+    uint32_t bucket;
+};
+
+struct mime_parse_t {
+    struct mime_key_t* keys;
+    size_t keys_count;
+    size_t keys_capacity;
+    struct mime_type_t* types;
+    size_t types_count;
+    size_t types_capacity;
+};
+
+static uint32_t hash_extension(const char* ext, size_t len, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)ext[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+static char to_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? (char)(c | 0x20) : c;
+}
+
+static bool has_suffix(const char* str, const char* suffix) {
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+static bool is_compressible(const char* name) {
+    return strncmp(name, "text/", 5) == 0
+            || has_suffix(name, "javascript") || has_suffix(name, "ecmascript")
+            || has_suffix(name, "/json") || has_suffix(name, "+json")
+            || has_suffix(name, "/xml") || has_suffix(name, "+xml");
+}
+
+static int add_type(struct mime_parse_t* parse, const char* name) {
+    if (strlen(name) > MIME_TYPE_MAX_LEN) {
+        log(WARNING, "Skipping MIME type %.32s..., longer than %d bytes", name, MIME_TYPE_MAX_LEN);
+        return 1;
+    }
+    if (parse->types_count == parse->types_capacity) {
+        size_t capacity = parse->types_capacity ? parse->types_capacity * 2 : 64;
+        struct mime_type_t* resized = realloc(parse->types, capacity * sizeof(struct mime_type_t));
+        if (resized == NULL) {
+            return -1;
+        }
+        parse->types = resized;
+        parse->types_capacity = capacity;
+    }
+    size_t line_len = strlen("Content-Type: ") + strlen(name) + strlen("\r\n");
+    char* line = malloc(line_len + 1);
+    char* name_copy = strdup(name);
+    if (line == NULL || name_copy == NULL) {
+        free(line);
+        free(name_copy);
+        return -1;
+    }
+    snprintf(line, line_len + 1, "Content-Type: %s\r\n", name);
+    struct mime_type_t* type = &parse->types[parse->types_count++];
+    type->name = name_copy;
+    type->content_type_line = line;
+    type->content_type_line_len = line_len;
+    type->compressible = is_compressible(name);
+    return 0;
+}
+
+static int add_key(struct mime_parse_t* parse, const char* ext) {
+    size_t len = strlen(ext);
+    if (len == 0 || len > MIME_EXTENSION_MAX_LEN) {
+        log(DEBUG, "Skipping extension %s", ext);
+        return 0;
+    }
+    if (parse->keys_count == parse->keys_capacity) {
+        size_t capacity = parse->keys_capacity ? parse->keys_capacity * 2 : 256;
+        struct mime_key_t* resized = realloc(parse->keys, capacity * sizeof(struct mime_key_t));
+        if (resized == NULL) {
+            return -1;
+        }
+        parse->keys = resized;
+        parse->keys_capacity = capacity;
+    }
+    struct mime_key_t* key = &parse->keys[parse->keys_count];
+    for (size_t i = 0; i < len; i++) {
+        key->ext[i] = to_lower(ext[i]);
+    }
+    key->ext[len] = '\0';
+    key->len = len;
+    key->type_index = parse->types_count - 1;
+    key->order = parse->keys_count;
+    parse->keys_count++;
+    return 0;
+}
+
+//"type ext1 ext2 ...", types without extensions are skipped
+static int parse_line(struct mime_parse_t* parse, char* line) {
+    char* comment = strchr(line, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+    const char* const delimiters = " \t\r\n";
+    char* save = NULL;
+    char* name = strtok_r(line, delimiters, &save);
+    if (name == NULL) {
+        return 0;
+    }
+    char* ext = strtok_r(NULL, delimiters, &save);
+    if (ext == NULL) {
+        return 0;
+    }
+    int added = add_type(parse, name);
+    if (added != 0) {
+        return added < 0 ? -1 : 0;
+    }
+    for (; ext != NULL; ext = strtok_r(NULL, delimiters, &save)) {
+        if (add_key(parse, ext) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compare_keys_by_ext(const void* a, const void* b) {
+    const struct mime_key_t* left = a;
+    const struct mime_key_t* right = b;
+    int diff = strcmp(left->ext, right->ext);
+    if (diff != 0) {
+        return diff;
+    }
+    return left->order < right->order ? -1 : 1;
+}
+
+static int compare_keys_by_bucket(const void* a, const void* b) {
+    const struct mime_key_t* left = a;
+    const struct mime_key_t* right = b;
+    return left->bucket < right->bucket ? -1 : left->bucket > right->bucket;
+}
+
+//Bucket ranges of the keys sorted by bucket, largest first
+struct mime_bucket_t {
+    uint32_t bucket;
+    size_t begin;
+    size_t count;
+};
+
+static int compare_buckets_by_size(const void* a, const void* b) {
+    const struct mime_bucket_t* left = a;
+    const struct mime_bucket_t* right = b;
+    return left->count > right->count ? -1 : left->count < right->count;
+}
+
+static bool place_bucket(struct mime_slot_t* table, uint32_t mask, const struct mime_key_t* keys,
+                         size_t count, uint32_t seed, const struct mime_type_t* types_array) {
+    uint32_t positions[count];
+    for (size_t i = 0; i < count; i++) {
+        positions[i] = hash_extension(keys[i].ext, keys[i].len, seed) & mask;
+        if (table[positions[i]].len != 0) {
+            return false;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (positions[j] == positions[i]) {
+                return false;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct mime_slot_t* slot = &table[positions[i]];
+        memcpy(slot->ext, keys[i].ext, keys[i].len + 1);
+        slot->len = keys[i].len;
+        slot->type = &types_array[keys[i].type_index];
+    }
+    return true;
+}
+
+//keys are unique, returns -1 when no seed fits a bucket of a table of slots_count
+static int build_table(struct mime_key_t* keys, size_t keys_count, uint32_t slots_count, uint32_t seeds_count,
+                       const struct mime_type_t* types_array, struct mime_slot_t* table, uint32_t* seeds) {
+    for (size_t i = 0; i < keys_count; i++) {
+        keys[i].bucket = hash_extension(keys[i].ext, keys[i].len, 0) % seeds_count;
+    }
+    qsort(keys, keys_count, sizeof(struct mime_key_t), compare_keys_by_bucket);
+
+    struct mime_bucket_t* buckets = calloc(seeds_count, sizeof(struct mime_bucket_t));
+    if (buckets == NULL) {
+        return -1;
+    }
+    size_t used_buckets = 0;
+    for (size_t i = 0; i < keys_count; i++) {
+        if (i == 0 || keys[i].bucket != keys[i - 1].bucket) {
+            buckets[used_buckets++] = (struct mime_bucket_t){keys[i].bucket, i, 0};
+        }
+        buckets[used_buckets - 1].count++;
+    }
+    //Large buckets are placed while the table is still empty
+    qsort(buckets, used_buckets, sizeof(struct mime_bucket_t), compare_buckets_by_size);
+
+    int result = 0;
+    for (size_t i = 0; i < used_buckets && result == 0; i++) {
+        uint32_t seed = 1;
+        while (seed < MIME_MAX_SEED && !place_bucket(table, slots_count - 1, &keys[buckets[i].begin],
+                                                     buckets[i].count, seed, types_array)) {
+            seed++;
+        }
+        if (seed == MIME_MAX_SEED) {
+            result = -1;
+        }
+        seeds[buckets[i].bucket] = seed;
+    }
+    free(buckets);
+    return result;
+}
+
+static void free_types(struct mime_type_t* types_array, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free((char*)types_array[i].name);
+        free((char*)types_array[i].content_type_line);
+    }
+    free(types_array);
+}
+
+static int compile(struct mime_parse_t* parse) {
+    //Duplicate extensions: the first line that lists one wins
+    qsort(parse->keys, parse->keys_count, sizeof(struct mime_key_t), compare_keys_by_ext);
+    size_t unique_count = 0;
+    for (size_t i = 0; i < parse->keys_count; i++) {
+        if (unique_count > 0 && strcmp(parse->keys[i].ext, parse->keys[unique_count - 1].ext) == 0) {
+            log(DEBUG, "Duplicate extension %s", parse->keys[i].ext);
+            continue;
+        }
+        parse->keys[unique_count++] = parse->keys[i];
+    }
+
+    //About four extensions per bucket and a table at most 80% full
+    uint32_t seeds_count = unique_count / 4 + 1;
+    uint32_t slots_count = 8;
+    while (slots_count < unique_count + unique_count / 4) {
+        slots_count *= 2;
+    }
+    for (int attempt = 0; attempt < 4; attempt++, slots_count *= 2) {
+        struct mime_slot_t* table = calloc(slots_count, sizeof(struct mime_slot_t));
+        uint32_t* seeds = calloc(seeds_count, sizeof(uint32_t));
+        if (table == NULL || seeds == NULL) {
+            free(table);
+            free(seeds);
+            return -1;
+        }
+        if (build_table(parse->keys, unique_count, slots_count, seeds_count, parse->types, table, seeds) < 0) {
+            free(table);
+            free(seeds);
+            continue;
+        }
+        free(slots);
+        free(bucket_seeds);
+        free_types(types, types_count);
+        slots = table;
+        slots_mask = slots_count - 1;
+        bucket_seeds = seeds;
+        buckets_count = seeds_count;
+        types = parse->types;
+        types_count = parse->types_count;
+        parse->types = NULL;
+        parse->types_count = 0;
+        log(INFO, "MIME types: %zu types, %zu extensions in %u slots", types_count, unique_count, slots_count);
+        return 0;
+    }
+    log(ERROR, "Unable to build the MIME type hash table");
+    return -1;
+}
+
+static void free_parse(struct mime_parse_t* parse) {
+    free(parse->keys);
+    free_types(parse->types, parse->types_count);
+}
+
+static int load_builtin(void) {
+    struct mime_parse_t parse = {0};
+    int result = 0;
+    for (size_t i = 0; i < sizeof(builtin_mime_types) / sizeof(builtin_mime_types[0]) && result == 0; i++) {
+        char line[128];
+        strncpy(line, builtin_mime_types[i], sizeof(line) - 1);
+        line[sizeof(line) - 1] = '\0';
+        result = parse_line(&parse, line);
+    }
+    if (result == 0) {
+        result = compile(&parse);
+    }
+    free_parse(&parse);
+    return result;
+}
+
+int mime_types_load(const char* path) {
+    if (path == NULL || path[0] == '\0') {
+        return load_builtin();
+    }
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        log(WARNING, "Unable to open %s, using built-in MIME types: %s", path, strerror(errno));
+        load_builtin();
+        return -1;
+    }
+    struct mime_parse_t parse = {0};
+    int result = 0;
+    char line[4096];
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        result = parse_line(&parse, line);
+    }
+    fclose(file);
+    if (result == 0) {
+        result = compile(&parse);
+    } else {
+        log(ERROR, "Unable to allocate memory");
+    }
+    free_parse(&parse);
+    if (result < 0) {
+        log(WARNING, "Unable to load %s, using built-in MIME types", path);
+        load_builtin();
+    }
+    return result;
+}
+
+const struct mime_type_t* mime_type_by_extension(const char* ext, size_t len) {
+    if (slots == NULL || len == 0 || len > MIME_EXTENSION_MAX_LEN) {
+        return &MIME_TYPE_OCTET_STREAM;
+    }
+    char lower[MIME_EXTENSION_MAX_LEN];
+    for (size_t i = 0; i < len; i++) {
+        lower[i] = to_lower(ext[i]);
+    }
+    uint32_t seed = bucket_seeds[hash_extension(lower, len, 0) % buckets_count];
+    const struct mime_slot_t* slot = &slots[hash_extension(lower, len, seed) & slots_mask];
+    if (slot->len == len && memcmp(slot->ext, lower, len) == 0) {
+        return slot->type;
+    }
+    return &MIME_TYPE_OCTET_STREAM;
+}
+
+const struct mime_type_t* mime_type_by_path(const char* path) {
+    const char* name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    const char* dot = strrchr(name, '.');
+    if (dot == NULL) {
+        return &MIME_TYPE_OCTET_STREAM;
+    }
+    return mime_type_by_extension(dot + 1, strlen(dot + 1));
+}
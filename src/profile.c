@@ -0,0 +1,156 @@
+#include "../include/profile.h"
+
+#ifdef STAGE_PROFILING
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../include/log.h"
+
+//Values below 32 ns are exact, larger ones are kept with 16 sub-buckets per power of two (6%)
+#define PROFILE_SUB_BUCKET_BITS 4
+#define PROFILE_SUB_BUCKETS (1 << PROFILE_SUB_BUCKET_BITS)
+#define PROFILE_EXACT_LIMIT (2 * PROFILE_SUB_BUCKETS)
+#define PROFILE_MAX_SHIFT 40 //about 5 hours
+#define PROFILE_BUCKETS (PROFILE_EXACT_LIMIT + PROFILE_MAX_SHIFT * PROFILE_SUB_BUCKETS)
+
+struct stage_histogram_t {
+    uint64_t counts[PROFILE_BUCKETS];
+    uint64_t count;
+    uint64_t max_ns;
+};
+
+//Written only by its worker thread, profile_dump() reads it without synchronization:
+//a dump may be off by the requests finished meanwhile
+struct worker_profile_t {
+    int worker_id;
+    struct stage_histogram_t stages[PROFILE_STAGES_COUNT];
+    struct worker_profile_t* next;
+};
+
+static const char* const stage_names[PROFILE_STAGES_COUNT] = {
+        "header_search", "parse", "file_lookup", "lookup_wait", "head_build", "output_queue", "request"
+};
+
+static pthread_mutex_t profiles_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct worker_profile_t* profiles;
+
+static __thread struct worker_profile_t* profile;
+static __thread uint64_t request_start_ns;
+static __thread uint64_t stage_start_ns;
+
+static size_t bucket_index(uint64_t value) {
+    if (value < PROFILE_EXACT_LIMIT) {
+        return (size_t)value;
+    }
+    //value >> shift is in [PROFILE_SUB_BUCKETS, 2 * PROFILE_SUB_BUCKETS)
+    unsigned int shift = (unsigned int)(63 - __builtin_clzll(value)) - PROFILE_SUB_BUCKET_BITS;
+    if (shift > PROFILE_MAX_SHIFT) {
+        return PROFILE_BUCKETS - 1;
+    }
+    return PROFILE_EXACT_LIMIT + (shift - 1) * PROFILE_SUB_BUCKETS + (size_t)((value >> shift) - PROFILE_SUB_BUCKETS);
+}
+
+//Highest value counted in the bucket
+static uint64_t bucket_value(size_t index) {
+    if (index < PROFILE_EXACT_LIMIT) {
+        return index;
+    }
+    unsigned int shift = (unsigned int)((index - PROFILE_EXACT_LIMIT) / PROFILE_SUB_BUCKETS) + 1;
+    uint64_t sub_bucket = (index - PROFILE_EXACT_LIMIT) % PROFILE_SUB_BUCKETS + PROFILE_SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+static uint64_t percentile(const struct stage_histogram_t* histogram, double percent) {
+    uint64_t rank = (uint64_t)(percent / 100.0 * (double)histogram->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < PROFILE_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < histogram->max_ns ? value : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+static void record(enum profile_stage_t stage, uint64_t duration_ns) {
+    if (profile == NULL) {
+        return;
+    }
+    struct stage_histogram_t* histogram = &profile->stages[stage];
+    histogram->counts[bucket_index(duration_ns)]++;
+    histogram->count++;
+    if (duration_ns > histogram->max_ns) {
+        histogram->max_ns = duration_ns;
+    }
+}
+
+uint64_t profile_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+void profile_register_worker(int worker_id) {
+    if (profile != NULL) {
+        return;
+    }
+    profile = calloc(1, sizeof(struct worker_profile_t));
+    if (profile == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        return;
+    }
+    profile->worker_id = worker_id;
+    pthread_mutex_lock(&profiles_mutex);
+    profile->next = profiles;
+    profiles = profile;
+    pthread_mutex_unlock(&profiles_mutex);
+}
+
+void profile_start(void) {
+    request_start_ns = profile_now_ns();
+    stage_start_ns = request_start_ns;
+}
+
+void profile_mark(enum profile_stage_t stage) {
+    uint64_t now_ns = profile_now_ns();
+    record(stage, now_ns - stage_start_ns);
+    stage_start_ns = now_ns;
+}
+
+void profile_since(enum profile_stage_t stage, uint64_t start_ns) {
+    record(stage, profile_now_ns() - start_ns);
+}
+
+void profile_end(void) {
+    uint64_t now_ns = profile_now_ns();
+    record(PROFILE_REQUEST, now_ns - request_start_ns);
+    //The next pipelined request starts here
+    request_start_ns = now_ns;
+    stage_start_ns = now_ns;
+}
+
+void profile_dump(void) {
+    pthread_mutex_lock(&profiles_mutex);
+    for (struct worker_profile_t* worker = profiles; worker != NULL; worker = worker->next) {
+        for (int i = 0; i < PROFILE_STAGES_COUNT; i++) {
+            const struct stage_histogram_t* histogram = &worker->stages[i];
+            if (histogram->count == 0) {
+                continue;
+            }
+            log(IMPORTANT, "Worker %d %-13s count %lu p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu ns",
+                    worker->worker_id, stage_names[i], (unsigned long)histogram->count,
+                    (unsigned long)percentile(histogram, 50), (unsigned long)percentile(histogram, 90),
+                    (unsigned long)percentile(histogram, 99), (unsigned long)percentile(histogram, 99.9),
+                    (unsigned long)histogram->max_ns);
+        }
+    }
+    pthread_mutex_unlock(&profiles_mutex);
+}
+
+#endif //STAGE_PROFILING
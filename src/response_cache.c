@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <zconf.h>
+
+#include "../include/response_cache.h"
+#include "../include/io_pool.h"
+#include "../include/http.h"
+#include "../include/http_header.h"
+#include "../include/config.h"
+#include "../include/log.h"
+
+static struct response_cache_entry_t* buckets[RESPONSE_CACHE_BUCKETS];
+static struct response_cache_entry_t* lru_head = NULL; //most recently used
+static struct response_cache_entry_t* lru_tail = NULL;
+//Guards the table, the LRU list and refcounts. Workers share the cache in WORKER_MODE_THREAD,
+//so disk I/O on a miss is done without holding it.
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t used_memory = 0;
+//Bodies of the calling worker are compressed on this pool, on the event loop without it
+static __thread struct io_pool_t* thread_io_pool = NULL;
+
+static uint64_t hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037ULL; //FNV-1a
+    for (const char* c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t entry_memory(const struct response_cache_entry_t* entry) {
+    return sizeof(struct response_cache_entry_t) + entry->data_len;
+}
+
+static void lru_unlink(struct response_cache_entry_t* entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct response_cache_entry_t* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = entry;
+    }
+    lru_head = entry;
+    if (lru_tail == NULL) {
+        lru_tail = entry;
+    }
+}
+
+static void free_entry(struct response_cache_entry_t* entry) {
+    log(DEBUG, "Freeing response cache entry: %s", entry->path);
+    free(entry->data);
+    free(entry->path);
+    free(entry);
+}
+
+static void detach_entry(struct response_cache_entry_t* entry) {
+    struct response_cache_entry_t** link = &buckets[entry->hash & (RESPONSE_CACHE_BUCKETS - 1)];
+    while (*link != NULL && *link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    if (*link != NULL) {
+        *link = entry->bucket_next;
+    }
+    lru_unlink(entry);
+    used_memory -= entry_memory(entry);
+    entry->detached = true;
+    if (entry->refcount == 0) {
+        free_entry(entry);
+    }
+}
+
+static struct response_cache_entry_t* find_entry(const char* path, uint64_t hash,
+                                                 enum content_encoding_t encoding) {
+    struct response_cache_entry_t* entry = buckets[hash & (RESPONSE_CACHE_BUCKETS - 1)];
+    while (entry != NULL) {
+        if (entry->hash == hash && entry->encoding == encoding && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+        entry = entry->bucket_next;
+    }
+    return NULL;
+}
+
+static int read_whole_file(int fd, char* dest, int64_t len) {
+    int64_t offset = 0;
+    while (offset < len) {
+        ssize_t read_len = pread(fd, dest + offset, (size_t)(len - offset), offset);
+        if (read_len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log(ERROR, "Unable to read file: %s", strerror(errno));
+            return -1;
+        }
+        if (read_len == 0) {
+            log(ERROR, "File was truncated while reading");
+            return -1;
+        }
+        offset += read_len;
+    }
+    return 0;
+}
+
+//The file cache owns the plain bytes of small files, larger ones are only read for the compression
+static int compress_file(const struct http_response_t* resp, char** body, size_t* body_len) {
+    const struct file_t* file = &resp->file_to_send;
+    const char* plain = NULL;
+    char* read_plain = NULL;
+    if ((size_t)file->len <= FILE_BODY_COPY_MAX_SIZE && file_cache_prepare_body(resp->file_entry) == FILE_BODY_COPY) {
+        plain = resp->file_entry->body;
+    } else {
+        read_plain = malloc(file->len > 0 ? (size_t)file->len : 1);
+        if (read_plain == NULL) {
+            log(ERROR, "Unable to allocate memory");
+            return -1;
+        }
+        if (read_whole_file(file->fd, read_plain, file->len) < 0) {
+            free(read_plain);
+            return -1;
+        }
+        plain = read_plain;
+    }
+    int result = compress_buffer(resp->content_encoding, plain, (size_t)file->len, body, body_len);
+    free(read_plain);
+    if (result == 0) {
+        log(DEBUG, "Compressed %s with %s: %ld -> %zu bytes",
+                file->path, content_encoding_t_to_string(resp->content_encoding), (long)file->len, *body_len);
+    }
+    return result;
+}
+
+static struct response_cache_entry_t* create_entry(const struct http_response_t* resp, uint64_t hash) {
+    const struct file_t* file = &resp->file_to_send;
+    struct response_cache_entry_t* entry = calloc(1, sizeof(struct response_cache_entry_t));
+    if (entry == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        return NULL;
+    }
+    entry->path = strdup(file->path);
+    if (entry->path == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->encoding = resp->content_encoding;
+    entry->ino = file->ino;
+    entry->mtime = file->mtime;
+    entry->len = file->len;
+
+    char* compressed_body = NULL;
+    size_t body_len = (size_t)file->len;
+    if (resp->compress_body && compress_file(resp, &compressed_body, &body_len) < 0) {
+        free_entry(entry);
+        return NULL;
+    }
+
+    char headers[HTTP_RESPONSE_HEAD_MAX_SIZE];
+    char* cursor = headers;
+    cursor = write_content_length_header(cursor, (int64_t)body_len);
+    cursor = write_content_type_header(cursor, file->mime_type);
+    cursor = write_content_encoding_header(cursor, resp->content_encoding);
+    if (resp->accept_ranges) {
+        cursor = write_accept_ranges_header(cursor);
+    }
+    cursor = write_etag_header(cursor, file, resp->content_encoding);
+    cursor = write_last_modified_header(cursor, file->mtime);
+    if (resp->vary_accept_encoding) {
+        cursor = write_vary_header(cursor);
+    }
+    cursor = write_server_header(cursor);
+    *cursor++ = '\r';
+    *cursor++ = '\n';
+
+    entry->headers_len = cursor - headers;
+    entry->has_body = compressed_body != NULL;
+    entry->data_len = entry->headers_len + (entry->has_body ? body_len : 0);
+    entry->data = malloc(entry->data_len);
+    if (entry->data == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        free(compressed_body);
+        free_entry(entry);
+        return NULL;
+    }
+    memcpy(entry->data, headers, entry->headers_len);
+    if (entry->has_body) {
+        memcpy(entry->data + entry->headers_len, compressed_body, body_len);
+        free(compressed_body);
+    }
+    return entry;
+}
+
+static void evict_entries(size_t incoming) {
+    while (used_memory + incoming > RESPONSE_CACHE_SIZE && lru_tail != NULL) {
+        detach_entry(lru_tail);
+    }
+}
+
+static void insert_entry(struct response_cache_entry_t* entry) {
+    evict_entries(entry_memory(entry));
+    size_t bucket = entry->hash & (RESPONSE_CACHE_BUCKETS - 1);
+    entry->bucket_next = buckets[bucket];
+    buckets[bucket] = entry;
+    lru_push_front(entry);
+    used_memory += entry_memory(entry);
+}
+
+bool is_response_cacheable(const struct file_t* file) {
+    return RESPONSE_CACHE_SIZE > 0 &&
+           file->fd >= 0 &&
+           (size_t)file->len <= RESPONSE_CACHE_MAX_FILE_SIZE &&
+           (size_t)file->len + sizeof(struct response_cache_entry_t) <= RESPONSE_CACHE_SIZE;
+}
+
+struct compress_job_t {
+    struct io_job_t job; //first member, the job is the compression
+    struct response_cache_entry_t* entry; //pending, referenced by the job
+    struct http_response_t resp; //its file entry is referenced by the job
+    struct response_cache_entry_t* built; //NULL if the body could not be compressed
+};
+
+//Pool thread: the pending entry is only published by compress_job_done()
+static void compress_job_work(struct io_job_t* job) {
+    struct compress_job_t* compress = (struct compress_job_t*)job;
+    compress->built = create_entry(&compress->resp, compress->entry->hash);
+}
+
+static void compress_job_done(struct io_job_t* job) {
+    struct compress_job_t* compress = (struct compress_job_t*)job;
+    struct response_cache_entry_t* entry = compress->entry;
+    struct response_cache_entry_t* built = compress->built;
+    pthread_mutex_lock(&cache_mutex);
+    if (!entry->detached && built == NULL) {
+        detach_entry(entry); //the next request tries again
+    } else if (!entry->detached) {
+        used_memory -= entry_memory(entry);
+        entry->data = built->data;
+        entry->headers_len = built->headers_len;
+        entry->data_len = built->data_len;
+        entry->has_body = built->has_body;
+        built->data = NULL;
+        //The entry is the most recently used one, it is evicted last
+        lru_unlink(entry);
+        evict_entries(entry_memory(entry));
+        lru_push_front(entry);
+        used_memory += entry_memory(entry);
+    }
+    entry->pending = false;
+    entry->refcount--;
+    bool should_free = entry->refcount == 0 && entry->detached;
+    pthread_mutex_unlock(&cache_mutex);
+    if (should_free) {
+        free_entry(entry);
+    }
+    if (built != NULL) {
+        free_entry(built);
+    }
+    file_cache_release(compress->resp.file_entry);
+    free(compress);
+}
+
+//A pending entry is published so that concurrent misses of the same body do not compress it again
+static void start_compression(const struct http_response_t* resp, uint64_t hash) {
+    struct response_cache_entry_t* pending = calloc(1, sizeof(struct response_cache_entry_t));
+    struct compress_job_t* compress = calloc(1, sizeof(struct compress_job_t));
+    if (pending == NULL || compress == NULL || (pending->path = strdup(resp->file_to_send.path)) == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        free(pending);
+        free(compress);
+        return;
+    }
+    pending->hash = hash;
+    pending->encoding = resp->content_encoding;
+    pending->ino = resp->file_to_send.ino;
+    pending->mtime = resp->file_to_send.mtime;
+    pending->len = resp->file_to_send.len;
+    pending->pending = true;
+    pending->refcount = 1; //the job
+
+    pthread_mutex_lock(&cache_mutex);
+    if (find_entry(pending->path, hash, pending->encoding) != NULL) {
+        //Another worker thread has started the same compression meanwhile
+        pthread_mutex_unlock(&cache_mutex);
+        free_entry(pending);
+        free(compress);
+        return;
+    }
+    insert_entry(pending);
+    pthread_mutex_unlock(&cache_mutex);
+
+    log(DEBUG, "Compressing %s with %s on the I/O pool",
+            pending->path, content_encoding_t_to_string(pending->encoding));
+    compress->job.work = compress_job_work;
+    compress->job.done = compress_job_done;
+    compress->entry = pending;
+    compress->resp = *resp;
+    file_cache_retain(resp->file_entry);
+    io_pool_submit(thread_io_pool, &compress->job);
+}
+
+struct response_cache_entry_t* response_cache_acquire(const struct http_response_t* resp, bool* hit) {
+    if (resp == NULL || resp->file_entry == NULL || hit == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return NULL;
+    }
+    *hit = false;
+    const struct file_t* file = &resp->file_to_send;
+    if (!is_response_cacheable(file)) {
+        return NULL;
+    }
+
+    uint64_t hash = hash_path(file->path);
+    pthread_mutex_lock(&cache_mutex);
+    struct response_cache_entry_t* entry = find_entry(file->path, hash, resp->content_encoding);
+    if (entry != NULL && (entry->ino != file->ino || entry->mtime != file->mtime || entry->len != file->len)) {
+        log(DEBUG, "Cached response is outdated: %s", file->path);
+        detach_entry(entry);
+        entry = NULL;
+    }
+
+    if (entry != NULL && entry->pending) {
+        pthread_mutex_unlock(&cache_mutex);
+        log(DEBUG, "Response is still being compressed: %s", file->path);
+        return NULL;
+    }
+
+    if (entry == NULL) {
+        pthread_mutex_unlock(&cache_mutex);
+        log(DEBUG, "Response cache miss: %s (%s)", file->path, content_encoding_t_to_string(resp->content_encoding));
+        if (resp->compress_body && thread_io_pool != NULL) {
+            start_compression(resp, hash);
+            return NULL;
+        }
+        struct response_cache_entry_t* created = create_entry(resp, hash);
+        if (created == NULL) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&cache_mutex);
+        entry = find_entry(file->path, hash, resp->content_encoding);
+        if (entry != NULL && !entry->pending &&
+            entry->ino == created->ino && entry->mtime == created->mtime && entry->len == created->len) {
+            //Another worker thread has read the same file meanwhile
+            free_entry(created);
+        } else {
+            if (entry != NULL) {
+                detach_entry(entry);
+            }
+            entry = created;
+            insert_entry(entry);
+        }
+    } else {
+        *hit = true;
+        if (entry != lru_head) {
+            lru_unlink(entry);
+            lru_push_front(entry);
+        }
+    }
+
+    entry->refcount++;
+    pthread_mutex_unlock(&cache_mutex);
+    return entry;
+}
+
+void response_cache_use_io_pool(struct io_pool_t* pool) {
+    thread_io_pool = pool;
+}
+
+void response_cache_retain(struct response_cache_entry_t* entry) {
+    if (entry == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    entry->refcount++;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void response_cache_release(struct response_cache_entry_t* entry) {
+    if (entry == NULL) {
+        log(ERROR, "Invalid function arguments");
+        return;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    entry->refcount--;
+    bool should_free = entry->refcount == 0 && entry->detached;
+    pthread_mutex_unlock(&cache_mutex);
+    if (should_free) {
+        free_entry(entry);
+    }
+}
@@ -1,6 +1,9 @@
+#define _GNU_SOURCE //pthread_setaffinity_np
+
 #include <event2/listener.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
+#include <event2/thread.h>
 
 #include <arpa/inet.h>
 
@@ -9,119 +12,116 @@
 #include <stdio.h>
 #include <errno.h>
 #include <zconf.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <event.h>
 
 #include "../include/server.h"
 #include "../include/log.h"
 #include "../include/http.h"
+#include "../include/http_header.h"
+#include "../include/response_cache.h"
+#include "../include/http_scan.h"
+#include "../include/access_log.h"
+#include "../include/uring.h"
+#include "../include/io_pool.h"
+#include "../include/mime.h"
+#include "../include/slab.h"
+#include "../include/metrics.h"
+#include "../include/profile.h"
 
-static void socket_close_cb(struct evbuffer *buffer, const struct evbuffer_cb_info *info, void *arg) {
-    if (evbuffer_get_length(buffer) == 0) {
-        log(DEBUG, "Freeing the bufferevent");
-        struct bufferevent* bev = (struct bufferevent*)arg;
-        struct evbuffer* output = bufferevent_get_output(bev);
-        if (evbuffer_get_length(output) == 0) {
-            int fd = bufferevent_getfd(bev);
-            log(WARNING, "Closing file descriptor %d", fd);
-            bufferevent_free(bev);
-        }
-    }
-}
+//Per-worker counters of queued bodies, reported with the accept statistics
+static __thread uint64_t body_tier_responses[FILE_BODY_TIERS_COUNT];
+static __thread uint64_t body_tier_bytes[FILE_BODY_TIERS_COUNT];
+static __thread uint64_t cached_responses;
+static __thread uint64_t cached_bytes;
 
-static void respond(struct bufferevent* bev, struct evbuffer* output, struct http_response_t* resp) {
-    log(DEBUG, "HTTP response:");
-    log(DEBUG, "%s %s", http_version_t_to_string(resp->http_version), http_state_t_to_string(resp->code));
-#ifdef DEBUG_MODE
-    for (size_t i = 0; i<resp->headers_count; i++) {
-        log(DEBUG, "%.*s", resp->headers[i].len - 2, resp->headers[i].text);
-    }
-    log(DEBUG, "\n");
-#endif
+//Created before the workers are forked, every worker counts into its own slot
+static struct metrics_t* shared_metrics;
+static struct metrics_t* draining_metrics; //master only, of the previous generation
+static __thread struct worker_metrics_t* metrics; //slot of this worker, NULL when the metrics are disabled
+static __thread uint64_t loop_lag_due_us;
 
-    switch (resp->http_version) {
-        case HTTPv1_0: {
-            evbuffer_add(output, STR_HTTPv1_0, strlen(STR_HTTPv1_0));
-            break;
-        }
-        case HTTPv1_1: {
-            evbuffer_add(output, STR_HTTPv1_1, strlen(STR_HTTPv1_1));
-            break;
-        }
-        default: {
-            evbuffer_add(output, STR_HTTPv1_0, strlen(STR_HTTPv1_0));
-            break;
-        }
-    }
-    evbuffer_add(output, " ", 1);
-    switch (resp->code) {
-        case OK: {
-            evbuffer_add(output, STR_200_OK, strlen(STR_200_OK));
-            break;
-        }
-        case BAD_REQUEST: {
-            evbuffer_add(output, STR_400_BAD_REQUEST, strlen(STR_400_BAD_REQUEST));
-            break;
-        }
-        case FORBIDDEN: {
-            evbuffer_add(output, STR_403_FORBIDDEN, strlen(STR_403_FORBIDDEN));
-            break;
-        }
-        case NOT_FOUND: {
-            evbuffer_add(output, STR_404_NOT_FOUND, strlen(STR_404_NOT_FOUND));
-            break;
-        }
-        case METHOD_NOT_ALLOWED: {
-            evbuffer_add(output, STR_405_METHOD_NOT_ALLOWED, strlen(STR_405_METHOD_NOT_ALLOWED));
+//MAX_CONNECTIONS of every worker of this process, lowered to fit RLIMIT_NOFILE, 0 is unlimited
+static int max_connections;
+
+static void add_file_body(struct evbuffer* output, struct file_cache_entry_t* file_entry, int64_t offset, int64_t len) {
+    //The body is prepared once per file and shared by every response, no per-request segment is created
+    enum file_body_tier_t tier = file_cache_prepare_body(file_entry);
+    switch (tier) {
+        case FILE_BODY_COPY: {
+            if (evbuffer_add(output, file_entry->body + offset, (size_t)len) < 0) {
+                log(ERROR, "Unable to add file body to output evbuffer");
+                return;
+            }
             break;
         }
-        case INTERNAL_SERVER_ERROR: {
-            evbuffer_add(output, STR_500_INTERNAL_SERVER_ERROR, strlen(STR_500_INTERNAL_SERVER_ERROR));
+        case FILE_BODY_MMAP:
+        case FILE_BODY_SENDFILE: {
+            if (evbuffer_add_file_segment(output, file_entry->body_segment, offset, len) < 0) {
+                log(ERROR, "Unable to add file segment to output evbuffer");
+                return;
+            }
             break;
         }
         default: {
-            evbuffer_add(output, STR_500_INTERNAL_SERVER_ERROR, strlen(STR_500_INTERNAL_SERVER_ERROR));
-            break;
-        }
-    }
-    evbuffer_add(output, "\r\n", 2);
-
-    char connection_close = 1;
-    for (size_t i = 0; i < resp->headers_count; i++) {
-        if (strstr(resp->headers[i].text, STR_CONNECTION_KEEP_ALIVE_HEADER) != NULL) {
-            connection_close = 0;
+            log(ERROR, "Unable to prepare file body of %s", file_entry->file.path);
+            return;
         }
-        evbuffer_add(output, resp->headers[i].text, resp->headers[i].len);
     }
-    evbuffer_add(output, "\r\n", 2);
+    body_tier_responses[tier]++;
+    body_tier_bytes[tier] += (uint64_t)len;
+}
 
-    if (resp->file_to_send.fd > 0 && resp->file_to_send.len > 0) {
-        evbuffer_add_file(output, resp->file_to_send.fd, 0, resp->file_to_send.len);
-    }
+void respond(struct evbuffer* output, struct http_response_t* resp) {
+    char head[HTTP_RESPONSE_HEAD_MAX_SIZE];
+    size_t head_len = serialize_http_response_head(resp, head);
+    PROFILE_MARK(PROFILE_HEAD_BUILD);
+    log(DEBUG, "HTTP response:\n%.*s", (int)head_len, head);
+    evbuffer_add(output, head, head_len);
 
-    if(connection_close) {
-        evbuffer_add_cb(output, socket_close_cb, bev);
+    if (resp->file_entry != NULL && resp->file_to_send.fd >= 0 && resp->content_length > 0) {
+        add_file_body(output, resp->file_entry, resp->range_start, resp->content_length);
     }
+    PROFILE_MARK(PROFILE_OUTPUT_QUEUE);
 }
 
-static void respond_with_err(struct bufferevent* bev, struct evbuffer* output, enum http_state_t code) {
+//403, 404 and 405 keep the version and the keep-alive of req, other errors close the connection.
+//req is NULL when the request could not be parsed.
+static void respond_with_err(struct evbuffer* output, enum http_state_t code, const struct http_request_t* req) {
     if (output == NULL) {
         log(ERROR, "Invalid function arguments");
         return;
     }
 
     struct http_response_t response = HTTP_RESPONSE_INITIALIZER;
+    bool keep_alive = false;
     switch (code) {
         // NOTE: there are no default response for 200 OK
         case BAD_REQUEST: {
             break;
         }
         case FORBIDDEN: {
+            keep_alive = req != NULL && req->keep_alive;
             break;
         }
         case NOT_FOUND: {
+            keep_alive = req != NULL && req->keep_alive;
             break;
         }
         case METHOD_NOT_ALLOWED: {
+            keep_alive = req != NULL && req->keep_alive;
+            break;
+        }
+        case REQUEST_HEADER_FIELDS_TOO_LARGE: {
             break;
         }
         case INTERNAL_SERVER_ERROR: {
@@ -133,203 +133,518 @@ static void respond_with_err(struct bufferevent* bev, struct evbuffer* output, e
         }
     }
 
-    const size_t headers_count = 4;
-    struct http_header_t headers_arr[headers_count];
-    size_t header_idx = 0;
-
-    headers_arr[header_idx] = (struct http_header_t){
-            STR_CONNECTION_CLOSE_HEADER,
-            strlen(STR_CONNECTION_CLOSE_HEADER)
-    };
-    header_idx += 1;
-
-    struct http_header_t date_header = HTTP_HEADER_INITIALIZER;
-    char date_header_buffer[HTTP_HEADER_DEFAULT_BUFFER_SIZE];
-    date_header.text = date_header_buffer;
-
-    int build_result = build_date_header(&date_header);
-    if (build_result < 0) {
-        log(ERROR, "Unable to build Date header");
-        headers_arr[header_idx] = (struct http_header_t){
-                STR_DEFAULT_DATE_HEADER,
-                strlen(STR_DEFAULT_DATE_HEADER)
-        };
-    } else {
-        headers_arr[header_idx] = date_header;
-    }
-    header_idx++;
-
-    headers_arr[header_idx] = (struct http_header_t){
-        STR_CONTENT_LENGTH_ZERO_HEADER,
-        strlen(STR_CONTENT_LENGTH_ZERO_HEADER)
-    };
-    header_idx++;
-
-    headers_arr[header_idx] = (struct http_header_t){
-            STR_SERVER_HEADER,
-            strlen(STR_SERVER_HEADER)
-    };
-    header_idx++;
-
     response.code = code;
-    response.http_version = HTTPv1_0; //TODO put in the config???
-    response.file_to_send = (struct file_t)FILE_INITIALIZER;
-    response.headers = headers_arr;
-    response.headers_count = headers_count;
+    response.http_version = req != NULL && req->http_version != VERSION_UNDEFINED ? req->http_version : HTTPv1_1;
+    response.keep_alive = keep_alive;
+    response.content_length = 0;
 
     log(DEBUG, "Response successfully built");
-    respond(bev, output, &response);
+    respond(output, &response);
 }
 
-static void conn_read_cb(struct bufferevent *bev, void *ctx) {
-    /* This callback is invoked when there is data to read on bev */
-    struct evbuffer* input = bufferevent_get_input(bev);
-    struct evbuffer* output = bufferevent_get_output(bev);
+static void cached_response_cleanup_cb(const void* data, size_t datalen, void* extra) {
+    response_cache_release((struct response_cache_entry_t*)extra);
+}
 
-    struct evbuffer_ptr req_headers_end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
-    if (req_headers_end.pos < 0) {
-        log(WARNING, "Unable to find headers end, input buffer len %d bytes",evbuffer_get_length(input));
-        respond_with_err(bev, output, BAD_REQUEST);
-        return;
-    }
-    if (evbuffer_ptr_set(input, &req_headers_end, 4, EVBUFFER_PTR_ADD) < 0) {
-        log(ERROR, "Unable to move req_headers_end evbuffer_ptr");
-        respond_with_err(bev, output, INTERNAL_SERVER_ERROR);
-        return;
+static bool respond_from_cache(struct evbuffer* output, struct http_request_t* req, struct http_response_t* resp) {
+    bool hit = false;
+    struct response_cache_entry_t* entry = response_cache_acquire(resp, &hit);
+    if (entry == NULL) {
+        return false;
     }
+    log(DEBUG, "Responding from cache: %s", entry->path);
 
-    char* req_str = malloc((size_t)req_headers_end.pos + 1);
-    if (req_str == NULL) {
-        log(ERROR, "Unable to allocate memory");
-        respond_with_err(bev, output, INTERNAL_SERVER_ERROR);
-        return;
+    //Only the per-request lines are written here, the rest is pre-serialized in the entry
+    char head[HTTP_RESPONSE_HEAD_MAX_SIZE];
+    char* cursor = head;
+    cursor = write_status_line(cursor, req->http_version, OK);
+    cursor = write_connection_header(cursor, req->keep_alive);
+    cursor = write_date_header(cursor);
+    PROFILE_MARK(PROFILE_HEAD_BUILD);
+    evbuffer_add(output, head, cursor - head);
+
+    //Static headers and the empty line, then a compressed body, are referenced without copying
+    size_t data_len = req->method == HEAD ? entry->headers_len : entry->data_len;
+    evbuffer_add_reference(output, entry->data, data_len, cached_response_cleanup_cb, entry);
+    cached_responses++;
+    cached_bytes += data_len - entry->headers_len;
+    if (req->method != HEAD && !entry->has_body && resp->file_to_send.len > 0) {
+        //The file as is comes from the file cache, it is counted with its body tier
+        add_file_body(output, resp->file_entry, 0, resp->file_to_send.len);
     }
-    req_str[req_headers_end.pos] = '\0';
-    if (evbuffer_remove(input, req_str, (size_t)req_headers_end.pos) < 0) {
-        log(ERROR, "Unable to copy data from input evbuffer");
-        respond_with_err(bev, output, INTERNAL_SERVER_ERROR);
-        free(req_str);
-        return;
+    PROFILE_MARK(PROFILE_OUTPUT_QUEUE);
+    if (metrics != NULL && hit) {
+        metrics_count_response_cache_hit(metrics);
     }
-    log(DEBUG, "req_str before parsing: <%s>", req_str);
+    return true;
+}
 
-    struct http_request_t req = HTTP_REQUEST_INITIALIZER;
+//A request being answered. It is moved to the heap when the connection is parked on a file
+//lookup: the parser decoded the request in place, so it can not be parsed a second time.
+struct request_ctx_t {
+    struct http_request_t req;
+    struct http_field_t headers[HTTP_MAX_HEADERS_COUNT];
+    size_t req_len; //request bytes at the start of the input buffer, drained once answered
+    uint64_t start_us;
+    struct access_log_entry_t log_entry;
+    struct file_cache_entry_t* file_entry; //the pending lookup of a parked request
+    struct file_cache_waiter_t waiter;
+#ifdef STAGE_PROFILING
+    uint64_t parked_ns;
+#endif
+};
 
-    size_t headers_count = 0;
-    char* headers_end = strstr(req_str, "\r\n\r\n");
-    if (headers_end == NULL) {
-        log(ERROR, "Unable to find headers end");
-        respond_with_err(bev, output, BAD_REQUEST);
-        free(req_str);
-        return;
-    }
-    char* cursor = strstr(req_str, "\r\n");
-    while (cursor != headers_end) {
-        cursor += 2;
-        headers_count++;
-        cursor = strstr(cursor, "\r\n");
+//Returns false if the request was answered with an error, the connection stays open after
+//it only when req->keep_alive is set. The method, URI and status are reported in entry.
+static bool parse_request(struct evbuffer* output, char* req_str, size_t req_len, bool draining,
+                          struct http_request_t* req, struct access_log_entry_t* entry) {
+    enum http_state_t parse_result = parse_http_request(req_str, req_len, req);
+    PROFILE_MARK(PROFILE_PARSE);
+    if (draining) {
+        req->keep_alive = false; //answered with Connection: close
     }
-    req.headers = malloc(headers_count * sizeof(struct http_header_t));
-    if (req.headers == NULL) {
-        log(ERROR, "Unable to allocate memory");
-        respond_with_err(bev, output, INTERNAL_SERVER_ERROR);
-        free(req_str);
-        return;
-    }
-    req.headers_count = headers_count;
-    log(DEBUG, "Headers count: %d", headers_count);
-
-    enum http_state_t parse_result = parse_http_request(req_str, &req);
+    entry->status = parse_result;
     switch (parse_result) {
         case OK: {
-            log(INFO, "HTTP Request was parsed! METHOD: <%s>; URI: <%s>; VERSION: <%s>",
-                    request_method_t_to_string(req.method),
-                    req.URI,
-                    http_version_t_to_string(req.http_version));
+            log(DEBUG, "HTTP Request was parsed! METHOD: <%s>; URI: <%s>; VERSION: <%s>",
+                    request_method_t_to_string(req->method),
+                    req->URI,
+                    http_version_t_to_string(req->http_version));
             break;
         }
         case BAD_REQUEST: {
-            log(INFO, "HTTP Request was not parsed: BAD_REQUEST");
-            respond_with_err(bev, output, BAD_REQUEST);
-            free(req.headers);
-            free(req_str);
-            return;
+            log(DEBUG, "HTTP Request was not parsed: BAD_REQUEST");
+            respond_with_err(output, BAD_REQUEST, NULL);
+            return false;
         }
         case METHOD_NOT_ALLOWED: {
-            log(INFO, "HTTP Request was not parsed: METHOD_NOT_ALLOWED");
-            respond_with_err(bev, output, METHOD_NOT_ALLOWED);
-            free(req.headers);
-            free(req_str);
-            return;
+            log(DEBUG, "HTTP Request was not parsed: METHOD_NOT_ALLOWED");
+            respond_with_err(output, METHOD_NOT_ALLOWED, req);
+            return false;
         }
         case INTERNAL_SERVER_ERROR: {
             log(ERROR, "HTTP Request was not parsed: INTERNAL_SERVER_ERROR");
-            respond_with_err(bev, output, INTERNAL_SERVER_ERROR);
-            free(req.headers);
-            free(req_str);
-            return;
+            respond_with_err(output, INTERNAL_SERVER_ERROR, NULL);
+            return false;
         }
         default: {
             log(ERROR, "Unexpected http request parsing return code: %d", parse_result);
-            respond_with_err(bev, output, INTERNAL_SERVER_ERROR);
-            free(req.headers);
-            free(req_str);
-            return;
+            entry->status = INTERNAL_SERVER_ERROR;
+            respond_with_err(output, INTERNAL_SERVER_ERROR, NULL);
+            return false;
         }
     }
+    entry->method = req->method;
+    entry->uri = req->URI;
+    entry->uri_len = req->URI_len;
+    return true;
+}
 
+//Queues the response for a parsed request, returns whether the connection stays open.
+//Nothing is queued when the file is still being looked up: *pending_entry is set then and
+//the request has to be answered again once the lookup has finished.
+static bool answer_request(struct evbuffer* output, struct http_request_t* req,
+                           struct access_log_entry_t* entry, struct file_cache_entry_t** pending_entry) {
     struct http_response_t resp = HTTP_RESPONSE_INITIALIZER;
-    const int resp_headers_count = 5;
-    struct http_header_t headers[resp_headers_count];
-    char resp_headers_buffer[resp_headers_count][HTTP_HEADER_DEFAULT_BUFFER_SIZE];
-    for (size_t i = 0; i < resp_headers_count; i++) {
-        headers[i].text = resp_headers_buffer[i];
-    }
-    resp.headers_count = resp_headers_count;
-    resp.headers = headers;
-    enum http_state_t build_result = build_http_response(&req, &resp);
+    enum http_state_t build_result = build_http_response(req, &resp);
+    PROFILE_MARK(PROFILE_FILE_LOOKUP);
+    entry->status = build_result;
     switch (build_result) {
         case OK: {
-            log(INFO, "HTTP response was built!");
+            log(DEBUG, "HTTP response was built!");
             break;
         }
+        case STATE_PENDING: {
+            log(DEBUG, "HTTP response is waiting for a file lookup");
+            *pending_entry = resp.file_entry;
+            return true;
+        }
+        case PARTIAL_CONTENT: {
+            log(DEBUG, "HTTP response was built: partial content");
+            respond(output, &resp);
+            file_cache_release(resp.file_entry);
+            return req->keep_alive;
+        }
+        case NOT_MODIFIED:
+        case RANGE_NOT_SATISFIABLE: {
+            log(DEBUG, "HTTP response was built: %s", http_state_t_to_string(build_result));
+            resp.file_to_send.fd = -1;
+            respond(output, &resp);
+            file_cache_release(resp.file_entry);
+            return req->keep_alive;
+        }
         case FORBIDDEN: {
-            log(INFO, "Can't build http response: access to file is forbidden");
-            respond_with_err(bev, output, FORBIDDEN);
-            free(req.headers);
-            free(req_str);
-            return;
+            log(DEBUG, "Can't build http response: access to file is forbidden");
+            respond_with_err(output, FORBIDDEN, req);
+            return req->keep_alive;
         }
         case NOT_FOUND: {
-            log(INFO, "Can't build http response: file was not found");
-            respond_with_err(bev, output, NOT_FOUND);
-            free(req.headers);
-            free(req_str);
-            return;
+            log(DEBUG, "Can't build http response: file was not found");
+            respond_with_err(output, NOT_FOUND, req);
+            return req->keep_alive;
         }
         default: {
             log(ERROR, "Unexpected http response building return code: %d", build_result);
-            respond_with_err(bev, output, INTERNAL_SERVER_ERROR);
-            free(req.headers);
-            free(req_str);
-            if (resp.file_to_send.fd > 0) {
-                close(resp.file_to_send.fd);
+            entry->status = INTERNAL_SERVER_ERROR;
+            respond_with_err(output, INTERNAL_SERVER_ERROR, req);
+            if (resp.file_entry != NULL) {
+                file_cache_release(resp.file_entry);
             }
+            return false;
+        }
+    }
+
+    if (respond_from_cache(output, req, &resp)) {
+        log(DEBUG, "HTTP response was sent from cache!");
+        file_cache_release(resp.file_entry);
+        return req->keep_alive;
+    }
+    if (resp.compress_body) {
+        //Compression failed, the body goes out as is
+        resp.content_encoding = CONTENT_ENCODING_IDENTITY;
+        resp.compress_body = false;
+    }
+
+    if (req->method == HEAD) {
+        resp.file_to_send.fd = -1;
+    }
+    respond(output, &resp);
+    file_cache_release(resp.file_entry);
+    return req->keep_alive;
+}
+
+static uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void free_conn(struct conn_t* conn) {
+    log(DEBUG, "Freeing the connection, fd: %d", bufferevent_getfd(conn->bev));
+    struct worker_t* worker = conn->worker;
+    worker->conn_count--;
+    if (metrics != NULL) {
+        metrics_set_connections(metrics, worker->conn_count);
+    }
+    if (worker->draining && worker->conn_count == 0) {
+        event_base_loopexit(worker->base, NULL);
+    }
+    if (worker->accept_paused && !worker->draining && worker->conn_count < (unsigned int)max_connections) {
+        worker->accept_paused = false;
+        evconnlistener_enable(worker->listener);
+        log(INFO, "Worker %d resumed accepting connections", worker->id);
+    }
+    if (conn->parked != NULL) {
+        file_cache_cancel_wait(conn->parked->file_entry, &conn->parked->waiter);
+        file_cache_release(conn->parked->file_entry);
+    }
+    slab_free(conn->parked_storage);
+    if (conn->resume_event != NULL) {
+        event_free(conn->resume_event); //also drops an activation that raced with the cancel
+    }
+    bufferevent_free(conn->bev);
+    slab_free(conn);
+}
+
+static struct timeval* seconds_to_timeval(int seconds, struct timeval* tv) {
+    if (seconds <= 0) {
+        return NULL;
+    }
+    tv->tv_sec = seconds;
+    tv->tv_usec = 0;
+    return tv;
+}
+
+//The read timeout is the idle keep-alive timeout between requests. It starts once the responses
+//are flushed, a slow download is bounded by WRITE_TIMEOUT alone. While a request is being read
+//it is the time left until its header deadline, so trickling bytes do not extend it.
+//Returns false once the deadline has passed.
+static bool update_read_timeout(struct conn_t* conn, bool reading_request) {
+    struct timeval read_tv;
+    struct timeval write_tv;
+    struct timeval* read_timeout = NULL;
+    if (!reading_request) {
+        if (conn->idle) {
+            return true;
+        }
+        conn->idle = true;
+        conn->request_started_us = 0;
+        if (evbuffer_get_length(bufferevent_get_output(conn->bev)) == 0) {
+            read_timeout = seconds_to_timeval(KEEPALIVE_TIMEOUT, &read_tv);
+        } //otherwise conn_write_cb() arms it
+    } else {
+        bool was_idle = conn->idle;
+        conn->idle = false;
+        uint64_t now_us = monotonic_us();
+        if (conn->request_started_us == 0) {
+            conn->request_started_us = now_us;
+        }
+        if (HEADER_TIMEOUT > 0) {
+            uint64_t deadline_us = conn->request_started_us + (uint64_t)HEADER_TIMEOUT * 1000000;
+            if (now_us >= deadline_us) {
+                return false;
+            }
+            read_tv.tv_sec = (time_t)((deadline_us - now_us) / 1000000);
+            read_tv.tv_usec = (suseconds_t)((deadline_us - now_us) % 1000000);
+            read_timeout = &read_tv;
+        } else if (!was_idle) {
+            return true;
+        }
+    }
+    bufferevent_set_timeouts(conn->bev, read_timeout, seconds_to_timeval(WRITE_TIMEOUT, &write_tv));
+    return true;
+}
+
+//Stops reading pipelined requests while the client is slow to take the queued responses
+static void throttle_conn(struct conn_t* conn) {
+    log(DEBUG, "Output is above the high watermark, pausing reads, fd: %d", bufferevent_getfd(conn->bev));
+    conn->output_throttled = true;
+    bufferevent_disable(conn->bev, EV_READ);
+    //The write callback now runs once the output is below the low watermark
+    bufferevent_setwatermark(conn->bev, EV_WRITE, CONN_OUTPUT_LOW_WATERMARK, 0);
+}
+
+static void finish_request(struct conn_t* conn, struct request_ctx_t* ctx, size_t output_len, bool keep_alive) {
+    struct access_log_t* access_log = conn->worker->access_log;
+    if (access_log != NULL || metrics != NULL) {
+        ctx->log_entry.bytes_sent = evbuffer_get_length(bufferevent_get_output(conn->bev)) - output_len;
+        ctx->log_entry.latency_us = monotonic_us() - ctx->start_us;
+    }
+    if (access_log != NULL) {
+        access_log_write(access_log, &ctx->log_entry);
+    }
+    if (metrics != NULL) {
+        metrics_count_request(metrics, ctx->log_entry.status, ctx->log_entry.bytes_sent, ctx->log_entry.latency_us);
+    }
+
+    conn->worker->request_count++;
+    PROFILE_END();
+    //The request and every slice of it are invalid after this point
+    evbuffer_drain(bufferevent_get_input(conn->bev), ctx->req_len);
+    if (!keep_alive) {
+        conn->close_after_write = true;
+    }
+}
+
+static void conn_resume_cb(evutil_socket_t fd, short events, void* ctx);
+
+//Returns 1 if the connection was parked, 0 if the lookup has already finished and -1 on error
+static int park_conn(struct conn_t* conn, struct request_ctx_t* ctx, struct file_cache_entry_t* entry) {
+    if (conn->resume_event == NULL) {
+        conn->resume_event = event_new(bufferevent_get_base(conn->bev), -1, 0, conn_resume_cb, conn);
+        if (conn->resume_event == NULL) {
+            log(ERROR, "Unable to create resume event");
+            file_cache_release(entry);
+            return -1;
+        }
+    }
+    if (conn->parked_storage == NULL) {
+        conn->parked_storage = slab_malloc(sizeof(struct request_ctx_t));
+        if (conn->parked_storage == NULL) {
+            log(ERROR, "Unable to allocate memory");
+            file_cache_release(entry);
+            return -1;
+        }
+    }
+    struct request_ctx_t* parked = conn->parked_storage;
+    if (ctx != parked) {
+        memcpy(parked, ctx, sizeof(struct request_ctx_t));
+        parked->req.headers = parked->headers;
+    }
+    parked->file_entry = entry;
+    parked->waiter.wake_event = conn->resume_event;
+    if (!file_cache_wait(entry, &parked->waiter)) {
+        file_cache_release(entry);
+        return 0;
+    }
+    //The input buffer keeps the request bytes unchanged while reading is paused
+    conn->parked = parked;
+#ifdef STAGE_PROFILING
+    parked->parked_ns = profile_now_ns();
+#endif
+    bufferevent_disable(conn->bev, EV_READ);
+    return 1;
+}
+
+//Answers a parsed request, returns false if the connection was parked instead
+static bool serve_request(struct conn_t* conn, struct request_ctx_t* ctx) {
+    struct evbuffer* output = bufferevent_get_output(conn->bev);
+    size_t output_len = evbuffer_get_length(output);
+    bool keep_alive = false;
+    if (conn->worker->draining) {
+        ctx->req.keep_alive = false; //answered with Connection: close
+    }
+    while (1) {
+        struct file_cache_entry_t* pending_entry = NULL;
+        keep_alive = answer_request(output, &ctx->req, &ctx->log_entry, &pending_entry);
+        if (pending_entry == NULL) {
+            break;
+        }
+        int parked = park_conn(conn, ctx, pending_entry);
+        if (parked > 0) {
+            return false;
+        }
+        if (parked < 0) {
+            ctx->log_entry.status = INTERNAL_SERVER_ERROR;
+            respond_with_err(output, INTERNAL_SERVER_ERROR, &ctx->req);
+            keep_alive = false;
+            break;
+        }
+    }
+    finish_request(conn, ctx, output_len, keep_alive);
+    return true;
+}
+
+static void conn_read_cb(struct bufferevent *bev, void *ctx) {
+    /* This callback is invoked when there is data to read on bev */
+    struct conn_t* conn = (struct conn_t*)ctx;
+    struct evbuffer* input = bufferevent_get_input(bev);
+    struct evbuffer* output = bufferevent_get_output(bev);
+    PROFILE_START();
+
+    //Every complete request in the buffer is answered in order, the responses
+    //are queued together and written once the callback returns
+    while (!conn->close_after_write) {
+        size_t input_len = evbuffer_get_length(input);
+        if (input_len == 0) {
+            update_read_timeout(conn, false);
+            break;
+        }
+        if (evbuffer_get_length(output) > CONN_OUTPUT_HIGH_WATERMARK) {
+            throttle_conn(conn);
+            return;
+        }
+
+        //Continue searching where the previous partial search stopped
+        struct evbuffer_ptr search_start;
+        size_t search_offset = conn->searched_len > 3 ? conn->searched_len - 3 : 0;
+        evbuffer_ptr_set(input, &search_start, search_offset, EVBUFFER_PTR_SET);
+        struct evbuffer_ptr req_headers_end = evbuffer_search(input, "\r\n\r\n", 4, &search_start);
+        if (req_headers_end.pos < 0) {
+            if (input_len > HTTP_MAX_REQUEST_HEADERS_SIZE) {
+                log(WARNING, "Request headers are too large, input buffer len %zu bytes", input_len);
+                respond_with_err(output, REQUEST_HEADER_FIELDS_TOO_LARGE, NULL);
+                conn->close_after_write = true;
+                break;
+            }
+            log(DEBUG, "Request is incomplete, waiting for more data, input buffer len %zu bytes", input_len);
+            conn->searched_len = input_len;
+            if (!update_read_timeout(conn, true)) {
+                log(INFO, "Request headers were not received in %d seconds, closing the connection", HEADER_TIMEOUT);
+                free_conn(conn);
+                return;
+            }
+            break;
+        }
+        conn->searched_len = 0;
+        PROFILE_MARK(PROFILE_HEADER_SEARCH);
+        //The header deadline of the next request starts when it turns out to be incomplete
+        conn->request_started_us = 0;
+        size_t req_len = (size_t)req_headers_end.pos + 4;
+        if (req_len > HTTP_MAX_REQUEST_HEADERS_SIZE) {
+            log(WARNING, "Request headers are too large: %zu bytes", req_len);
+            respond_with_err(output, REQUEST_HEADER_FIELDS_TOO_LARGE, NULL);
+            conn->close_after_write = true;
+            break;
+        }
+
+        //The request is parsed in place: pullup only copies when it spans several chains
+        char* req_str = (char*)evbuffer_pullup(input, (ev_ssize_t)req_len);
+        if (req_str == NULL) {
+            log(ERROR, "Unable to make request contiguous in input evbuffer");
+            respond_with_err(output, INTERNAL_SERVER_ERROR, NULL);
+            conn->close_after_write = true;
+            break;
+        }
+        log(DEBUG, "req_str before parsing: <%.*s>", (int)req_len, req_str);
+
+        struct request_ctx_t req_ctx;
+        req_ctx.req = (struct http_request_t)HTTP_REQUEST_INITIALIZER;
+        req_ctx.req.headers = req_ctx.headers;
+        req_ctx.req.headers_capacity = HTTP_MAX_HEADERS_COUNT;
+        req_ctx.req_len = req_len;
+        req_ctx.start_us = conn->worker->access_log != NULL || metrics != NULL ? monotonic_us() : 0;
+        req_ctx.log_entry = (struct access_log_entry_t)ACCESS_LOG_ENTRY_INITIALIZER;
+        req_ctx.file_entry = NULL;
+        size_t output_len = evbuffer_get_length(output);
+        if (!parse_request(output, req_str, req_len, conn->worker->draining, &req_ctx.req, &req_ctx.log_entry)) {
+            finish_request(conn, &req_ctx, output_len, req_ctx.req.keep_alive);
+        } else if (!serve_request(conn, &req_ctx)) {
+            //Parked, the remaining requests are read once this one is answered
             return;
         }
     }
 
-    respond(bev, output, &resp); //TODO make correct connection header handling
+    if (conn->close_after_write) {
+        //Ignore whatever the client sends after the last answered request
+        bufferevent_disable(bev, EV_READ);
+        if (evbuffer_get_length(output) == 0) {
+            free_conn(conn);
+        }
+    }
+}
+
+static void conn_resume_cb(evutil_socket_t fd, short events, void* ctx) {
+    struct conn_t* conn = (struct conn_t*)ctx;
+    log(DEBUG, "Resuming the connection, fd: %d", bufferevent_getfd(conn->bev));
+    struct request_ctx_t* parked = conn->parked;
+    conn->parked = NULL;
+#ifdef STAGE_PROFILING
+    profile_since(PROFILE_LOOKUP_WAIT, parked->parked_ns);
+    profile_start();
+#endif
+    file_cache_release(parked->file_entry);
+    parked->file_entry = NULL;
+    if (serve_request(conn, parked)) {
+        bufferevent_enable(conn->bev, EV_READ);
+        conn_read_cb(conn->bev, conn);
+    }
+}
 
-    free(req.headers);
-    free(req_str);
+static void conn_write_cb(struct bufferevent *bev, void *ctx) {
+    /* This callback is invoked when the output buffer has been flushed (or drained below the low watermark) */
+    struct conn_t* conn = (struct conn_t*)ctx;
+    if (conn->output_throttled) {
+        conn->output_throttled = false;
+        bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+        if (!conn->close_after_write) {
+            log(DEBUG, "Output drained, resuming reads, fd: %d", bufferevent_getfd(bev));
+            bufferevent_enable(bev, EV_READ);
+            conn_read_cb(bev, conn); //requests that were already received
+            return;
+        }
+    }
+    if (evbuffer_get_length(bufferevent_get_output(bev)) > 0) {
+        return;
+    }
+    if (conn->close_after_write) {
+        free_conn(conn);
+    } else if (conn->idle) {
+        struct timeval read_tv;
+        struct timeval write_tv;
+        bufferevent_set_timeouts(bev, seconds_to_timeval(KEEPALIVE_TIMEOUT, &read_tv),
+                                 seconds_to_timeval(WRITE_TIMEOUT, &write_tv));
+    }
 }
 
 static void conn_event_cb(struct bufferevent *bev, short events, void *ctx) {
     log(DEBUG, "On conn_event_cb()");
+    struct conn_t* conn = (struct conn_t*)ctx;
     if (events & BEV_EVENT_ERROR) {
         log(ERROR, "Got some error on bufferevent: %s",strerror(errno));
-        bufferevent_free(bev);
+        free_conn(conn);
+    } else if (events & BEV_EVENT_TIMEOUT) {
+        log(INFO, "Connection %s timed out, fd: %d", events & BEV_EVENT_WRITING ? "write" : "read",
+                bufferevent_getfd(bev));
+        free_conn(conn);
+    } else if (events & BEV_EVENT_EOF) {
+        //The client will not send more requests, those already answered or parked still go out
+        if (conn->parked == NULL && evbuffer_get_length(bufferevent_get_output(bev)) == 0) {
+            free_conn(conn);
+            return;
+        }
+        conn->close_after_write = true;
+        bufferevent_disable(bev, EV_READ);
     }
 }
 
@@ -338,12 +653,48 @@ static void accept_conn_cb(struct evconnlistener *listener,
                            void *ctx) {
     /* We got a new connection! Set up a bufferevent for it */
     log(DEBUG, "On accept_conn_cb(), fd: %d", fd);
+    struct worker_t* worker = (struct worker_t*)ctx;
+    worker->accepted_count++;
+    worker->conn_count++;
+    if (metrics != NULL) {
+        metrics_count_accept(metrics);
+    }
+    if (max_connections > 0 && worker->conn_count >= (unsigned int)max_connections && !worker->accept_paused) {
+        //Further connections wait in the listen backlog until one is closed
+        worker->accept_paused = true;
+        evconnlistener_disable(listener);
+        log(WARNING, "Worker %d reached max_connections %d, accepting is paused", worker->id, max_connections);
+    }
+
+    struct conn_t* conn = slab_calloc(1, sizeof(struct conn_t));
+    if (conn == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        evutil_closesocket(fd);
+        worker->conn_count--;
+        return;
+    }
+    conn->worker = worker;
+
     struct event_base *base = evconnlistener_get_base(listener);
     struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (bev == NULL) {
+        log(ERROR, "Unable to create bufferevent");
+        evutil_closesocket(fd);
+        slab_free(conn);
+        worker->conn_count--;
+        return;
+    }
+    conn->bev = bev;
 
-    bufferevent_setcb(bev, conn_read_cb, NULL, conn_event_cb, NULL);
+    bufferevent_setcb(bev, conn_read_cb, conn_write_cb, conn_event_cb, conn);
+    //The first request has HEADER_TIMEOUT from the accept
+    conn->idle = true;
+    update_read_timeout(conn, true);
 
     bufferevent_enable(bev, EV_READ|EV_WRITE);
+    if (metrics != NULL) {
+        metrics_set_connections(metrics, worker->conn_count);
+    }
 }
 
 static void accept_error_cb(struct evconnlistener *listener, void *ctx) {
@@ -352,42 +703,78 @@ static void accept_error_cb(struct evconnlistener *listener, void *ctx) {
     log(ERROR, "Got an error %d (%s) on the listener while accepting", err, evutil_socket_error_to_string(err));
 }
 
-int listen_and_serve(u_int16_t port) {
-    struct event_base *base;
-    struct evconnlistener *listener;
-    struct sockaddr_in sin;
-
-    base = event_base_new();
-    if (!base) {
-        log(FATAL, "Unable to open event base");
-        return EXIT_FAILURE;
+static void accept_stats_cb(evutil_socket_t fd, short events, void* ctx) {
+    struct worker_t* worker = (struct worker_t*)ctx;
+    if (worker->accepted_count == worker->reported_accepted_count) {
+        return;
     }
-    log(INFO, "libevent backend: %s", event_base_get_method(base));
+    log(INFO, "Worker %d (PID=%d): accepted %lu connections, %lu since last report, %u open, %lu requests",
+            worker->id, getpid(),
+            (unsigned long)worker->accepted_count,
+            (unsigned long)(worker->accepted_count - worker->reported_accepted_count),
+            worker->conn_count,
+            (unsigned long)(worker->request_count - worker->reported_request_count));
+#ifdef DEBUG_MODE
+    static __thread struct slab_stats_t reported_slab_stats;
+    struct slab_stats_t slab_stats = slab_get_stats();
+    uint64_t requests = worker->request_count - worker->reported_request_count;
+    uint64_t heap_allocs = slab_stats.heap_allocs - reported_slab_stats.heap_allocs;
+    log(DEBUG, "Worker %d heap: %lu mallocs (%.3f per request), %lu frees, %lu blocks reused",
+            worker->id, (unsigned long)heap_allocs,
+            requests > 0 ? (double)heap_allocs / (double)requests : 0.0,
+            (unsigned long)(slab_stats.heap_frees - reported_slab_stats.heap_frees),
+            (unsigned long)(slab_stats.cached_allocs - reported_slab_stats.cached_allocs));
+    reported_slab_stats = slab_stats;
+#endif
+    worker->reported_accepted_count = worker->accepted_count;
+    worker->reported_request_count = worker->request_count;
+    log(INFO, "Worker %d bodies: cache %lu (%lu B), copy %lu (%lu B), mmap %lu (%lu B), sendfile %lu (%lu B)",
+            worker->id,
+            (unsigned long)cached_responses, (unsigned long)cached_bytes,
+            (unsigned long)body_tier_responses[FILE_BODY_COPY], (unsigned long)body_tier_bytes[FILE_BODY_COPY],
+            (unsigned long)body_tier_responses[FILE_BODY_MMAP], (unsigned long)body_tier_bytes[FILE_BODY_MMAP],
+            (unsigned long)body_tier_responses[FILE_BODY_SENDFILE], (unsigned long)body_tier_bytes[FILE_BODY_SENDFILE]);
+}
 
+static evutil_socket_t create_listen_socket(in_addr_t address, u_int16_t port) {
+    struct sockaddr_in sin;
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = htonl(0);
+    sin.sin_addr.s_addr = htonl(address);
     sin.sin_port = htons(port);
 
-    listener = evconnlistener_new_bind(
-            base,
-            accept_conn_cb,
-            NULL,
-            LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE,
-            -1,
-            (struct sockaddr*)&sin, sizeof(sin));
-    if (!listener) {
-        log(FATAL, "Couldn't create listener, ERRNO: %d %s", errno, strerror(errno));
-        return EXIT_FAILURE;
+    evutil_socket_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log(ERROR, "Unable to create socket: %s", strerror(errno));
+        return -1;
+    }
+    //Every worker binds its own socket to the same port, the kernel balances connections between them
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        log(ERROR, "Unable to set socket options: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        log(ERROR, "Unable to bind socket: %s", strerror(errno));
+        close(fd);
+        return -1;
     }
-    evconnlistener_set_error_cb(listener, accept_error_cb);
+    if (listen(fd, SOMAXCONN) < 0) {
+        log(ERROR, "Unable to listen on socket: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-#ifdef DEBUG_MODE
-    log(DEBUG, "Listening socket fd: %d", evconnlistener_get_fd(listener));
-#endif
+//Resolved once by the master, which keeps root to bind sockets on reload; worker processes drop to it
+static uid_t worker_uid;
 
-    if(getuid() == 0) {
-        log(DEBUG, "Dropping privilage");
+static int resolve_worker_uid(void) {
+    worker_uid = getuid();
+    if (worker_uid == 0) {
         FILE* pp = popen("id " DEFAULT_USER "| sed 's/uid=//; s/(.*$//g'", "r");
         if (pp == NULL) {
             log(ERROR, "Unable to open pipe");
@@ -395,32 +782,869 @@ int listen_and_serve(u_int16_t port) {
         }
         int uid = 0;
         fscanf(pp, "%d", &uid);
-        fclose(pp);
-        setuid(uid);
+        pclose(pp);
+        worker_uid = (uid_t)uid;
+    }
+    return 0;
+}
+
+static int drop_privilege(void) {
+    if(getuid() == 0) {
+        log(DEBUG, "Dropping privilage");
+        errno = 0;
+        setuid(worker_uid);
         if (errno != 0) {
             log(ERROR, "Error while dropping privilage: %s", strerror(errno));
             return -1;
         }
-        log(INFO, "Privilage dropped to uid: %d", uid);
+        log(INFO, "Privilage dropped to uid: %d", (int)worker_uid);
     }
+    return 0;
+}
 
-    pid_t pid = 0;
-    for (int i = 0; i < CPU_LIMIT - 1; i++) {
-        switch(pid=fork()) {
-            case -1: {
-                log(ERROR, "Fork caused error: %s", strerror(errno));
-            }
-            case 0 : {
-                event_base_dispatch(base);
-                event_base_free(base);
-            }
-            default : {
-                log(INFO, "Forked successfully, PID=%d", pid);
+static void pin_worker(struct worker_t* worker) {
+    if (CPU_AFFINITY_LEN == 0) {
+        return;
+    }
+    int cpu = CPU_AFFINITY[worker->id % CPU_AFFINITY_LEN];
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (err != 0) {
+        log(WARNING, "Unable to pin worker %d to CPU %d: %s", worker->id, cpu, strerror(err));
+        return;
+    }
+    log(INFO, "Worker %d pinned to CPU %d", worker->id, cpu);
+}
+
+static void date_refresh_cb(evutil_socket_t fd, short events, void* ctx) {
+    http_date_refresh();
+}
+
+static void access_log_flush_cb(evutil_socket_t fd, short events, void* ctx) {
+    struct worker_t* worker = (struct worker_t*)ctx;
+    if (worker->access_log != NULL) {
+        access_log_flush(worker->access_log);
+    }
+}
+
+static void schedule_loop_lag(struct worker_t* worker) {
+    struct timeval interval = {0, METRICS_LOOP_LAG_INTERVAL_MS * 1000};
+    loop_lag_due_us = monotonic_us() + METRICS_LOOP_LAG_INTERVAL_MS * 1000;
+    if (event_add(worker->loop_lag_event, &interval) < 0) {
+        log(WARNING, "Unable to schedule event loop lag sampling for worker %d", worker->id);
+    }
+}
+
+static void loop_lag_cb(evutil_socket_t fd, short events, void* ctx) {
+    uint64_t now_us = monotonic_us();
+    metrics_count_loop_lag(metrics, now_us > loop_lag_due_us ? now_us - loop_lag_due_us : 0);
+    schedule_loop_lag((struct worker_t*)ctx);
+}
+
+static void metrics_read_cb(struct bufferevent* bev, void* ctx) {
+    struct evbuffer* input = bufferevent_get_input(bev);
+    struct evbuffer_ptr req_headers_end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+    if (req_headers_end.pos < 0) {
+        if (evbuffer_get_length(input) > HTTP_MAX_REQUEST_HEADERS_SIZE) {
+            bufferevent_free(bev);
+        }
+        return;
+    }
+    size_t req_len = (size_t)req_headers_end.pos + 4;
+    char* req_str = (char*)evbuffer_pullup(input, (ev_ssize_t)req_len);
+    struct http_request_t req = HTTP_REQUEST_INITIALIZER;
+    struct http_field_t headers[HTTP_MAX_HEADERS_COUNT];
+    req.headers = headers;
+    req.headers_capacity = HTTP_MAX_HEADERS_COUNT;
+    bool found = req_str != NULL && parse_http_request(req_str, req_len, &req) == OK &&
+                 strcmp(req.URI, "/metrics") == 0;
+
+    struct evbuffer* body = evbuffer_new();
+    if (body == NULL) {
+        bufferevent_free(bev);
+        return;
+    }
+    if (found) {
+        metrics_write_prometheus(shared_metrics, body);
+    }
+    struct evbuffer* output = bufferevent_get_output(bev);
+    evbuffer_add_printf(output, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                        found ? STR_200_OK : STR_404_NOT_FOUND, evbuffer_get_length(body));
+    if (req.method != HEAD) {
+        evbuffer_add_buffer(output, body);
+    }
+    evbuffer_free(body);
+    bufferevent_disable(bev, EV_READ);
+    bufferevent_enable(bev, EV_WRITE);
+}
+
+static void metrics_write_cb(struct bufferevent* bev, void* ctx) {
+    if (evbuffer_get_length(bufferevent_get_output(bev)) == 0) {
+        bufferevent_free(bev);
+    }
+}
+
+static void metrics_event_cb(struct bufferevent* bev, short events, void* ctx) {
+    bufferevent_free(bev);
+}
+
+static void metrics_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* address,
+                              int socklen, void* ctx) {
+    struct bufferevent* bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+    if (bev == NULL) {
+        log(ERROR, "Unable to create bufferevent");
+        evutil_closesocket(fd);
+        return;
+    }
+    struct timeval timeout = {METRICS_REQUEST_TIMEOUT, 0};
+    bufferevent_setcb(bev, metrics_read_cb, metrics_write_cb, metrics_event_cb, NULL);
+    bufferevent_set_timeouts(bev, &timeout, &timeout);
+    //Writing is enabled with the response, the write callback frees the connection once it is flushed
+    bufferevent_enable(bev, EV_READ);
+}
+
+static void start_metrics(struct worker_t* worker) {
+    metrics = metrics_worker(shared_metrics, worker->id);
+    if (metrics == NULL) {
+        return;
+    }
+    worker->loop_lag_event = evtimer_new(worker->base, loop_lag_cb, worker);
+    if (worker->loop_lag_event != NULL) {
+        schedule_loop_lag(worker);
+    }
+    if (worker->metrics_fd >= 0) {
+        worker->metrics_listener = evconnlistener_new(worker->base, metrics_accept_cb, worker,
+                                                      LEV_OPT_CLOSE_ON_FREE, 0, worker->metrics_fd);
+        if (worker->metrics_listener == NULL) {
+            log(ERROR, "Unable to serve metrics: %s", strerror(errno));
+            close(worker->metrics_fd);
+        } else {
+            log(INFO, "Worker %d serves metrics on 127.0.0.1:%d/metrics", worker->id, METRICS_PORT);
+        }
+        worker->metrics_fd = -1;
+    }
+}
+
+//Workers run by this process, drained together on SIGQUIT
+static struct worker_t* process_workers;
+static int process_workers_count;
+static _Atomic bool process_draining;
+
+//Stops accepting and answers the next request of every connection with Connection: close. Idle
+//connections are not closed at once: a client may be sending a request on them, they end with their
+//next request or KEEPALIVE_TIMEOUT. The event loop ends with the last one, or after WORKER_DRAIN_TIMEOUT.
+static void drain_worker(struct worker_t* worker) {
+    if (worker->draining) {
+        return;
+    }
+    worker->draining = true;
+    log(INFO, "Worker %d (PID=%d) is draining %u connections", worker->id, getpid(), worker->conn_count);
+    if (worker->listener != NULL) {
+        evconnlistener_free(worker->listener); //the master keeps the socket for the next generation
+        worker->listener = NULL;
+    }
+    if (worker->metrics_listener != NULL) {
+        evconnlistener_free(worker->metrics_listener);
+        worker->metrics_listener = NULL;
+    }
+    struct timeval timeout = {WORKER_DRAIN_TIMEOUT, 0};
+    event_base_loopexit(worker->base, worker->conn_count == 0 ? NULL : &timeout);
+}
+
+static void drain_cb(evutil_socket_t fd, short events, void* ctx) {
+    drain_worker((struct worker_t*)ctx);
+}
+
+static void quit_signal_cb(evutil_socket_t fd, short events, void* ctx) {
+    if (process_draining) {
+        return;
+    }
+    process_draining = true;
+    //Every worker thread drains on its own event loop
+    for (int i = 0; i < process_workers_count; i++) {
+        struct worker_t* worker = &process_workers[i];
+        if (worker == ctx) {
+            drain_worker(worker);
+        } else if (worker->base != NULL) {
+            event_base_once(worker->base, -1, EV_TIMEOUT, drain_cb, worker, NULL);
+        }
+    }
+}
+
+#ifdef STAGE_PROFILING
+static void profile_dump_cb(evutil_socket_t fd, short events, void* ctx) {
+    profile_dump();
+}
+#endif
+
+static void handle_process_signals(struct worker_t* worker) {
+    worker->quit_event = evsignal_new(worker->base, SIGQUIT, quit_signal_cb, worker);
+    if (worker->quit_event == NULL || event_add(worker->quit_event, NULL) < 0) {
+        log(WARNING, "Unable to handle SIGQUIT in worker %d", worker->id);
+    }
+#ifdef STAGE_PROFILING
+    worker->profile_dump_event = evsignal_new(worker->base, SIGUSR1, profile_dump_cb, worker);
+    if (worker->profile_dump_event == NULL || event_add(worker->profile_dump_event, NULL) < 0) {
+        log(WARNING, "Unable to handle SIGUSR1 in worker %d", worker->id);
+    }
+#endif
+    //Blocked since fork(), the other threads of the process keep them blocked
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+static int run_worker(struct worker_t* worker) {
+    pin_worker(worker);
+
+    //The event base is created after fork(), so workers never share an epoll instance
+    worker->base = event_base_new();
+    if (!worker->base) {
+        log(FATAL, "Unable to open event base");
+        return EXIT_FAILURE;
+    }
+    log(INFO, "Worker %d (PID=%d) libevent backend: %s", worker->id, getpid(), event_base_get_method(worker->base));
+    if (IO_URING_ENABLED) {
+        worker->ring = uring_open(worker->base);
+        file_cache_use_uring(worker->ring);
+        if (worker->ring != NULL) {
+            log(INFO, "Worker %d looks up files with io_uring", worker->id);
+        }
+    }
+    if (IO_THREADS > 0) {
+        //Compression always runs on the pool, file lookups only without io_uring
+        worker->io_pool = io_pool_open(worker->base);
+        response_cache_use_io_pool(worker->io_pool);
+        if (worker->ring == NULL) {
+            file_cache_use_io_pool(worker->io_pool);
+        }
+        if (worker->io_pool != NULL) {
+            log(INFO, "Worker %d compresses%s on %d I/O threads", worker->id,
+                    worker->ring == NULL ? " and looks up files" : "", IO_THREADS);
+        }
+    }
+
+    worker->listener = evconnlistener_new(
+            worker->base,
+            accept_conn_cb,
+            worker,
+            LEV_OPT_CLOSE_ON_FREE,
+            0, //the socket is already listening
+            worker->listen_fd);
+    if (!worker->listener) {
+        log(FATAL, "Couldn't create listener, ERRNO: %d %s", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    evconnlistener_set_error_cb(worker->listener, accept_error_cb);
+#ifdef DEBUG_MODE
+    log(DEBUG, "Worker %d listening socket fd: %d", worker->id, evconnlistener_get_fd(worker->listener));
+#endif
+
+    worker->stats_event = event_new(worker->base, -1, EV_PERSIST, accept_stats_cb, worker);
+    struct timeval stats_interval = {ACCEPT_STATS_INTERVAL, 0};
+    if (worker->stats_event == NULL || event_add(worker->stats_event, &stats_interval) < 0) {
+        log(WARNING, "Unable to schedule accept statistics for worker %d", worker->id);
+    }
+
+    http_date_refresh();
+    worker->date_event = event_new(worker->base, -1, EV_PERSIST, date_refresh_cb, worker);
+    struct timeval date_interval = {1, 0};
+    if (worker->date_event == NULL || event_add(worker->date_event, &date_interval) < 0) {
+        log(WARNING, "Unable to schedule Date header refresh for worker %d", worker->id);
+    }
+
+    worker->access_log = access_log_open(worker->id);
+    if (worker->access_log != NULL) {
+        worker->access_log_event = event_new(worker->base, -1, EV_PERSIST, access_log_flush_cb, worker);
+        struct timeval access_log_interval = {ACCESS_LOG_FLUSH_INTERVAL, 0};
+        if (worker->access_log_event == NULL || event_add(worker->access_log_event, &access_log_interval) < 0) {
+            log(WARNING, "Unable to schedule access log flushes for worker %d", worker->id);
+        }
+    }
+
+    start_metrics(worker);
+#ifdef STAGE_PROFILING
+    profile_register_worker(worker->id);
+#endif
+    //Signals are delivered to one event base per process, it handles them for every worker thread
+    if (worker == &process_workers[0]) {
+        handle_process_signals(worker);
+    }
+    if (process_draining) {
+        drain_worker(worker); //SIGQUIT came while this thread was starting
+    }
+
+    event_base_dispatch(worker->base);
+
+    if (worker->metrics_listener != NULL) {
+        evconnlistener_free(worker->metrics_listener);
+    }
+#ifdef STAGE_PROFILING
+    if (worker->profile_dump_event != NULL) {
+        event_free(worker->profile_dump_event);
+    }
+#endif
+    if (worker->quit_event != NULL) {
+        event_free(worker->quit_event);
+    }
+    if (worker->loop_lag_event != NULL) {
+        event_free(worker->loop_lag_event);
+    }
+    if (worker->access_log_event != NULL) {
+        event_free(worker->access_log_event);
+    }
+    access_log_close(worker->access_log);
+    if (worker->date_event != NULL) {
+        event_free(worker->date_event);
+    }
+    if (worker->stats_event != NULL) {
+        event_free(worker->stats_event);
+    }
+    if (worker->listener != NULL) {
+        evconnlistener_free(worker->listener);
+    }
+    file_cache_use_uring(NULL);
+    uring_close(worker->ring);
+    file_cache_use_io_pool(NULL);
+    response_cache_use_io_pool(NULL);
+    io_pool_close(worker->io_pool);
+    event_base_free(worker->base);
+    return 0;
+}
+
+//Environment of a master started by SIGUSR2, removed once the sockets are adopted
+#define ENV_LISTEN_FDS "HIGHLOADSERVER_LISTEN_FDS"
+#define ENV_METRICS_FD "HIGHLOADSERVER_METRICS_FD"
+#define ENV_UPGRADE_PARENT "HIGHLOADSERVER_UPGRADE_PARENT"
+
+struct worker_process_t {
+    pid_t pid;
+    int first_worker;
+    int workers_count; //the whole generation in WORKER_MODE_THREAD, one worker otherwise
+    unsigned int generation;
+};
+
+//Master state, worker processes get a copy at fork() and never change it
+static u_int16_t listen_port;
+static int* listen_fds; //listen_fds[i] is the socket of worker i of the current generation
+static int listen_fds_count;
+static int metrics_listen_fd = -1;
+static int metrics_listen_port;
+static struct worker_process_t* worker_processes;
+static int worker_processes_count;
+static int worker_processes_capacity;
+static unsigned int generation;
+static bool quitting;
+static int master_result = EXIT_SUCCESS;
+static pid_t upgrade_pid; //the master started by SIGUSR2, until it takes over
+static char executable_path[4096];
+static char** master_argv;
+static int (*master_reload_config)(void);
+static struct event_base* master_base;
+
+static const int master_signals[] = {SIGHUP, SIGUSR2, SIGQUIT, SIGTERM, SIGINT, SIGCHLD, SIGUSR1};
+
+static void reset_master_signals(void) {
+    for (size_t i = 0; i < sizeof(master_signals) / sizeof(master_signals[0]); i++) {
+        signal(master_signals[i], SIG_DFL);
+    }
+}
+
+static void* worker_thread_routine(void* arg) {
+    run_worker((struct worker_t*)arg);
+    return NULL;
+}
+
+static void spawn_worker_threads(struct worker_t* workers, int workers_count) {
+    for (int i = 1; i < workers_count; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, worker_thread_routine, &workers[i]);
+        if (err != 0) {
+            log(ERROR, "Unable to start worker thread %d: %s", i, strerror(err));
+            close(workers[i].listen_fd);
+            workers[i].listen_fd = -1;
+            continue;
+        }
+        log(INFO, "Started worker thread %d successfully", i);
+    }
+}
+
+//The master raises the soft limit to the hard one, the workers inherit it
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        log(ERROR, "Unable to get the fd limit: %s", strerror(errno));
+        return;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+            log(WARNING, "Unable to raise the fd limit: %s", strerror(errno));
+            return;
+        }
+    }
+    log(INFO, "Open files limit: %llu", (unsigned long long)limit.rlim_cur);
+}
+
+//Connections and the file cache of this process share what RLIMIT_NOFILE leaves after
+//WORKER_RESERVED_FDS per worker. When both do not fit, the cache gets at most a quarter.
+static void fit_fd_limit(int workers_count) {
+    max_connections = MAX_CONNECTIONS;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        log(ERROR, "Unable to get the fd limit: %s", strerror(errno));
+        return;
+    }
+    if (limit.rlim_cur == RLIM_INFINITY) {
+        return;
+    }
+    uint64_t reserved = (uint64_t)workers_count * WORKER_RESERVED_FDS;
+    uint64_t available = limit.rlim_cur > reserved ? limit.rlim_cur - reserved : 0;
+    uint64_t cache_fds = 2 * (uint64_t)FILE_CACHE_MAX_ENTRIES; //the file and the dup() of its segment
+    uint64_t connection_fds = (uint64_t)max_connections * workers_count;
+    if (max_connections > 0 && connection_fds + cache_fds <= available) {
+        return;
+    }
+    if (cache_fds > available / 4) {
+        cache_fds = available / 4;
+    }
+    uint64_t connections = (available - cache_fds) / workers_count;
+    if (max_connections == 0 || connections < (uint64_t)max_connections) {
+        max_connections = connections > 0 ? (int)(connections < INT_MAX ? connections : INT_MAX) : 1;
+    }
+    file_cache_set_max_entries(cache_fds / 2);
+    log(WARNING, "Open files limit %llu: max_connections lowered to %d, file cache to %llu entries",
+            (unsigned long long)limit.rlim_cur, max_connections, (unsigned long long)(cache_fds / 2));
+}
+
+//Body of a forked worker process, never returns
+static void run_worker_process(int first_worker, int workers_count) {
+    for (int i = 0; i < listen_fds_count; i++) {
+        if (i < first_worker || i >= first_worker + workers_count) {
+            close(listen_fds[i]);
+        }
+    }
+    if (metrics_listen_fd >= 0 && first_worker != 0) {
+        close(metrics_listen_fd);
+    }
+    if (drop_privilege() < 0 || open_document_root() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    struct worker_t* workers = calloc((size_t)workers_count, sizeof(struct worker_t));
+    if (workers == NULL) {
+        log(FATAL, "Unable to allocate memory");
+    }
+    for (int i = 0; i < workers_count; i++) {
+        workers[i].id = first_worker + i;
+        workers[i].listen_fd = listen_fds[first_worker + i];
+        workers[i].metrics_fd = workers[i].id == 0 ? metrics_listen_fd : -1;
+    }
+    process_workers = workers;
+    process_workers_count = workers_count;
+    fit_fd_limit(workers_count);
+
+    if (WORKER_MODE == WORKER_MODE_THREAD) {
+        //File segments of the shared file cache are referenced from several event bases
+        if (evthread_use_pthreads() < 0) {
+            log(FATAL, "Unable to enable libevent locking");
+        }
+        spawn_worker_threads(workers, workers_count);
+    }
+
+    int result = run_worker(&workers[0]);
+    for (int i = 1; i < workers_count; i++) {
+        if (workers[i].listen_fd >= 0) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    log(INFO, "Worker process PID=%d exited", getpid());
+    exit(result);
+}
+
+static int spawn_worker_process(int first_worker, int workers_count) {
+    if (worker_processes_count == worker_processes_capacity) {
+        int capacity = worker_processes_capacity > 0 ? worker_processes_capacity * 2 : 16;
+        struct worker_process_t* processes = realloc(worker_processes, (size_t)capacity * sizeof(*processes));
+        if (processes == NULL) {
+            log(ERROR, "Unable to allocate memory");
+            return -1;
+        }
+        worker_processes = processes;
+        worker_processes_capacity = capacity;
+    }
+
+    //No signal may reach the master's handlers in the child before they are reset
+    sigset_t all_signals;
+    sigset_t saved_mask;
+    sigfillset(&all_signals);
+    sigprocmask(SIG_SETMASK, &all_signals, &saved_mask);
+    pid_t pid = fork();
+    if (pid == 0) {
+        reset_master_signals();
+        //SIGQUIT and SIGUSR1 stay pending until the first worker handles them
+        sigset_t mask = saved_mask;
+        sigaddset(&mask, SIGQUIT);
+        sigaddset(&mask, SIGUSR1);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        run_worker_process(first_worker, workers_count);
+    }
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    if (pid < 0) {
+        log(ERROR, "Fork caused error: %s", strerror(errno));
+        return -1;
+    }
+
+    struct worker_process_t* process = &worker_processes[worker_processes_count++];
+    process->pid = pid;
+    process->first_worker = first_worker;
+    process->workers_count = workers_count;
+    process->generation = generation;
+    log(INFO, "Forked worker process for workers %d-%d successfully, PID=%d",
+            first_worker, first_worker + workers_count - 1, pid);
+    return 0;
+}
+
+//Sockets are bound by the master before the workers drop privilage, a privilaged port can not be bound afterwards
+static int resize_listen_sockets(int count) {
+    if (count > listen_fds_count) {
+        int* fds = realloc(listen_fds, (size_t)count * sizeof(int));
+        if (fds == NULL) {
+            log(ERROR, "Unable to allocate memory");
+            return -1;
+        }
+        listen_fds = fds;
+        while (listen_fds_count < count) {
+            int fd = create_listen_socket(INADDR_ANY, listen_port);
+            if (fd < 0) {
+                return -1;
             }
+            listen_fds[listen_fds_count++] = fd;
         }
     }
+    //Connections still queued on a removed socket are reset when the old worker closes it
+    while (listen_fds_count > count) {
+        close(listen_fds[--listen_fds_count]);
+    }
+    return 0;
+}
 
-    event_base_dispatch(base);
-    event_base_free(base);
+static void update_metrics_socket(void) {
+    if (metrics_listen_port == METRICS_PORT) {
+        return;
+    }
+    if (metrics_listen_fd >= 0) {
+        close(metrics_listen_fd);
+        metrics_listen_fd = -1;
+    }
+    metrics_listen_port = METRICS_PORT;
+    if (METRICS_PORT > 0) {
+        metrics_listen_fd = create_listen_socket(INADDR_LOOPBACK, (u_int16_t)METRICS_PORT);
+        if (metrics_listen_fd < 0) {
+            log(ERROR, "Metrics are not served on port %d", METRICS_PORT);
+        }
+    }
+}
+
+//Starts the workers of the current configuration, then the previous generation drains.
+//Its sockets stay open in the master, so no connection waiting in a backlog is lost.
+static int spawn_generation(void) {
+    int workers_count = CPU_LIMIT > 0 ? CPU_LIMIT : 1;
+    if (resize_listen_sockets(workers_count) < 0) {
+        log(ERROR, "Couldn't create listening socket, ERRNO: %d %s", errno, strerror(errno));
+        return -1;
+    }
+    update_metrics_socket();
+    struct metrics_t* previous_metrics = shared_metrics;
+    shared_metrics = metrics_listen_fd >= 0 ? metrics_create(workers_count, previous_metrics, draining_metrics) : NULL;
+
+    generation++;
+    int started = 0;
+    if (WORKER_MODE == WORKER_MODE_THREAD) {
+        started += spawn_worker_process(0, workers_count) == 0 ? workers_count : 0;
+    } else {
+        for (int i = 0; i < workers_count; i++) {
+            started += spawn_worker_process(i, 1) == 0 ? 1 : 0;
+        }
+    }
+    if (started == 0) {
+        generation--;
+        metrics_destroy(shared_metrics);
+        shared_metrics = previous_metrics;
+        return -1;
+    }
+    //The generation before the previous one is folded into the new slots, the previous one is summed up
+    //by the new worker 0 while it drains. Forked workers keep their own mapping of both.
+    metrics_destroy(draining_metrics);
+    draining_metrics = previous_metrics;
+
+    for (int i = 0; i < worker_processes_count; i++) {
+        if (worker_processes[i].generation != generation) {
+            kill(worker_processes[i].pid, SIGQUIT);
+        }
+    }
+    log(IMPORTANT, "Generation %u started %d of %d workers", generation, started, workers_count);
     return 0;
 }
+
+static int socket_port(int fd) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    if (getsockname(fd, (struct sockaddr*)&sin, &len) < 0 || sin.sin_family != AF_INET) {
+        return -1;
+    }
+    return ntohs(sin.sin_port);
+}
+
+//A master started by SIGUSR2 takes over the sockets of its parent, returns the parent PID or 0
+static pid_t adopt_inherited_sockets(void) {
+    const char* fds = getenv(ENV_LISTEN_FDS);
+    const char* metrics_fd = getenv(ENV_METRICS_FD);
+    const char* parent = getenv(ENV_UPGRADE_PARENT);
+    if (fds == NULL || parent == NULL) {
+        return 0;
+    }
+
+    char* cursor = (char*)fds;
+    char* num_end = NULL;
+    while (*cursor != '\0') {
+        int fd = (int)strtol(cursor, &num_end, 10);
+        if (num_end == cursor) {
+            break;
+        }
+        if (socket_port(fd) == listen_port) {
+            int* grown = realloc(listen_fds, (size_t)(listen_fds_count + 1) * sizeof(int));
+            if (grown != NULL) {
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                listen_fds = grown;
+                listen_fds[listen_fds_count++] = fd;
+            }
+        } else {
+            log(WARNING, "Inherited fd %d is not a socket on port %d", fd, listen_port);
+        }
+        cursor = *num_end == ',' ? num_end + 1 : num_end;
+    }
+    if (metrics_fd != NULL) {
+        int fd = atoi(metrics_fd);
+        if (METRICS_PORT > 0 && socket_port(fd) == METRICS_PORT) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            metrics_listen_fd = fd;
+            metrics_listen_port = METRICS_PORT;
+        } else {
+            close(fd);
+        }
+    }
+    pid_t parent_pid = (pid_t)atoi(parent);
+    log(INFO, "Inherited %d listening sockets from the master PID=%d", listen_fds_count, parent_pid);
+    unsetenv(ENV_LISTEN_FDS);
+    unsetenv(ENV_METRICS_FD);
+    unsetenv(ENV_UPGRADE_PARENT);
+    return parent_pid;
+}
+
+static void master_reload_cb(evutil_socket_t fd, short events, void* ctx) {
+    if (quitting) {
+        return;
+    }
+    log(IMPORTANT, "Reloading the configuration");
+    if (master_reload_config == NULL || master_reload_config() < 0) {
+        log(ERROR, "Configuration is not reloaded, the workers keep the previous one");
+        return;
+    }
+    mime_types_load(MIME_TYPES_PATH);
+    if (spawn_generation() < 0) {
+        log(ERROR, "Unable to start new workers, the previous ones keep running");
+    }
+}
+
+static void master_upgrade_cb(evutil_socket_t fd, short events, void* ctx) {
+    if (quitting) {
+        return;
+    }
+    if (upgrade_pid > 0) {
+        log(WARNING, "An upgrade is already running, PID=%d", upgrade_pid);
+        return;
+    }
+    if (executable_path[0] == '\0') {
+        log(ERROR, "Unable to upgrade, the executable path is unknown");
+        return;
+    }
+
+    char fds[4096] = "";
+    size_t fds_len = 0;
+    for (int i = 0; i < listen_fds_count && fds_len < sizeof(fds) - 16; i++) {
+        fds_len += (size_t)snprintf(fds + fds_len, sizeof(fds) - fds_len, i == 0 ? "%d" : ",%d", listen_fds[i]);
+    }
+    char metrics_fd[16];
+    snprintf(metrics_fd, sizeof(metrics_fd), "%d", metrics_listen_fd);
+    char parent[16];
+    snprintf(parent, sizeof(parent), "%d", getpid());
+
+    sigset_t all_signals;
+    sigset_t saved_mask;
+    sigfillset(&all_signals);
+    sigprocmask(SIG_SETMASK, &all_signals, &saved_mask);
+    pid_t pid = fork();
+    if (pid == 0) {
+        reset_master_signals();
+        sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+        for (int i = 0; i < listen_fds_count; i++) {
+            fcntl(listen_fds[i], F_SETFD, 0);
+        }
+        if (metrics_listen_fd >= 0) {
+            fcntl(metrics_listen_fd, F_SETFD, 0);
+            setenv(ENV_METRICS_FD, metrics_fd, 1);
+        }
+        setenv(ENV_LISTEN_FDS, fds, 1);
+        setenv(ENV_UPGRADE_PARENT, parent, 1);
+        execv(executable_path, master_argv);
+        log(FATAL, "Unable to execute %s: %s", executable_path, strerror(errno));
+    }
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    if (pid < 0) {
+        log(ERROR, "Fork caused error: %s", strerror(errno));
+        return;
+    }
+    upgrade_pid = pid;
+    log(IMPORTANT, "Upgrading to %s, new master PID=%d", executable_path, pid);
+}
+
+static void master_quit_cb(evutil_socket_t fd, short events, void* ctx) {
+    int signal_number = (int)fd;
+    bool graceful = signal_number == SIGQUIT;
+    log(IMPORTANT, graceful ? "Shutting down gracefully" : "Shutting down");
+    quitting = true;
+    //New connections are refused, or accepted by the new master after an upgrade
+    resize_listen_sockets(0);
+    if (metrics_listen_fd >= 0) {
+        close(metrics_listen_fd);
+        metrics_listen_fd = -1;
+    }
+    for (int i = 0; i < worker_processes_count; i++) {
+        kill(worker_processes[i].pid, graceful ? SIGQUIT : SIGTERM);
+    }
+    if (worker_processes_count == 0) {
+        event_base_loopbreak(master_base);
+    }
+}
+
+static void master_child_cb(evutil_socket_t fd, short events, void* ctx) {
+    int status = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid == upgrade_pid) {
+            log(ERROR, "The new master PID=%d exited, the upgrade is cancelled", pid);
+            upgrade_pid = 0;
+            continue;
+        }
+        int index = 0;
+        while (index < worker_processes_count && worker_processes[index].pid != pid) {
+            index++;
+        }
+        if (index == worker_processes_count) {
+            continue;
+        }
+        struct worker_process_t process = worker_processes[index];
+        worker_processes[index] = worker_processes[--worker_processes_count];
+
+        if (WIFSIGNALED(status)) {
+            log(ERROR, "Worker process PID=%d was killed by signal %d", pid, WTERMSIG(status));
+        } else {
+            log(INFO, "Worker process PID=%d exited with code %d", pid, WEXITSTATUS(status));
+        }
+        //A crashed worker of the current generation is replaced, a drained or failed one is not
+        if (!quitting && process.generation == generation && WIFSIGNALED(status)) {
+            spawn_worker_process(process.first_worker, process.workers_count);
+        }
+    }
+    if (worker_processes_count == 0) {
+        if (!quitting) {
+            log(ERROR, "No worker left");
+            master_result = EXIT_FAILURE;
+        }
+        event_base_loopbreak(master_base);
+    }
+}
+
+#ifdef STAGE_PROFILING
+static void master_profile_dump_cb(evutil_socket_t fd, short events, void* ctx) {
+    for (int i = 0; i < worker_processes_count; i++) {
+        kill(worker_processes[i].pid, SIGUSR1);
+    }
+}
+#endif
+
+int listen_and_serve(u_int16_t port, char** argv, int (*reload_config)(void)) {
+    slab_use_for_libevent();
+    listen_port = port;
+    master_argv = argv;
+    master_reload_config = reload_config;
+    ssize_t path_len = readlink("/proc/self/exe", executable_path, sizeof(executable_path) - 1);
+    if (path_len < 0) {
+        log(WARNING, "Unable to resolve the executable, SIGUSR2 upgrades are disabled: %s", strerror(errno));
+        path_len = 0;
+    }
+    executable_path[path_len] = '\0';
+    pid_t upgrade_parent = adopt_inherited_sockets();
+    raise_fd_limit();
+
+    mime_types_load(MIME_TYPES_PATH);
+    if (resolve_worker_uid() < 0) {
+        return -1;
+    }
+    log(INFO, "HTTP parser delimiter search: %s", http_scan_impl_t_to_string(http_scan_get_impl()));
+
+    master_base = event_base_new();
+    if (!master_base) {
+        log(FATAL, "Unable to open event base");
+        return EXIT_FAILURE;
+    }
+    event_callback_fn callbacks[] = {master_reload_cb, master_upgrade_cb, master_quit_cb, master_quit_cb,
+                                     master_quit_cb, master_child_cb, NULL};
+#ifdef STAGE_PROFILING
+    callbacks[6] = master_profile_dump_cb;
+#endif
+    struct event* signal_events[sizeof(master_signals) / sizeof(master_signals[0])] = {NULL};
+    for (size_t i = 0; i < sizeof(master_signals) / sizeof(master_signals[0]); i++) {
+        if (callbacks[i] == NULL) {
+            continue;
+        }
+        signal_events[i] = evsignal_new(master_base, master_signals[i], callbacks[i], NULL);
+        if (signal_events[i] == NULL || event_add(signal_events[i], NULL) < 0) {
+            log(FATAL, "Unable to handle signal %d", master_signals[i]);
+        }
+    }
+
+    if (spawn_generation() < 0) {
+        log(FATAL, "Unable to start the workers");
+    }
+    if (upgrade_parent > 0) {
+        log(IMPORTANT, "Taking over from the master PID=%d", upgrade_parent);
+        kill(upgrade_parent, SIGQUIT);
+    }
+    log(INFO, "Master process PID=%d", getpid());
+
+    event_base_dispatch(master_base);
+
+    for (size_t i = 0; i < sizeof(master_signals) / sizeof(master_signals[0]); i++) {
+        if (signal_events[i] != NULL) {
+            event_free(signal_events[i]);
+        }
+    }
+    event_base_free(master_base);
+    for (int i = 0; i < listen_fds_count; i++) {
+        close(listen_fds[i]);
+    }
+    free(listen_fds);
+    if (metrics_listen_fd >= 0) {
+        close(metrics_listen_fd);
+    }
+    metrics_destroy(shared_metrics);
+    metrics_destroy(draining_metrics);
+    free(worker_processes);
+    return master_result;
+}
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <event2/event.h>
+
+#include "../include/slab.h"
+
+//Every block starts with a header holding its size class, the caller gets the memory after it.
+//16 bytes keep the alignment malloc() guarantees.
+#define SLAB_HEADER_SIZE 16
+#define SLAB_LARGE_CLASS 0xffu //above SLAB_MAX_BLOCK_SIZE, malloc() and free() directly
+#define SLAB_CLASSES_COUNT (__builtin_ctz(SLAB_MAX_BLOCK_SIZE) - __builtin_ctz(SLAB_MIN_BLOCK_SIZE) + 1)
+
+//A cached block keeps its header, the link lives in the memory after it
+struct slab_free_block_t {
+    struct slab_free_block_t* next;
+};
+
+struct slab_cache_t {
+    struct slab_free_block_t* head;
+    size_t count;
+};
+
+static __thread struct slab_cache_t caches[SLAB_CLASSES_COUNT];
+
+#ifdef DEBUG_MODE
+static __thread struct slab_stats_t stats;
+#define SLAB_COUNT(counter) (stats.counter++)
+#else
+#define SLAB_COUNT(counter) ((void)0)
+#endif
+
+static unsigned int size_class(size_t size) {
+    if (size <= SLAB_MIN_BLOCK_SIZE) {
+        return 0;
+    }
+    if (size > SLAB_MAX_BLOCK_SIZE) {
+        return SLAB_LARGE_CLASS;
+    }
+    //Rounded up to the next power of two
+    return (unsigned int)(64 - __builtin_clzl(size - 1) - __builtin_ctz(SLAB_MIN_BLOCK_SIZE));
+}
+
+static size_t class_size(unsigned int class) {
+    return (size_t)SLAB_MIN_BLOCK_SIZE << class;
+}
+
+static size_t class_cache_limit(unsigned int class) {
+    size_t limit = SLAB_CACHE_BYTES_PER_CLASS / class_size(class);
+    return limit > 8 ? limit : 8;
+}
+
+static unsigned int* block_class(void* ptr) {
+    return (unsigned int*)((char*)ptr - SLAB_HEADER_SIZE);
+}
+
+static void* heap_block(unsigned int class, size_t size) {
+    char* block = malloc(SLAB_HEADER_SIZE + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    SLAB_COUNT(heap_allocs);
+    *(unsigned int*)block = class;
+    return block + SLAB_HEADER_SIZE;
+}
+
+void* slab_malloc(size_t size) {
+    unsigned int class = size_class(size);
+    if (class == SLAB_LARGE_CLASS) {
+        return heap_block(class, size);
+    }
+    struct slab_cache_t* cache = &caches[class];
+    if (cache->head != NULL) {
+        struct slab_free_block_t* block = cache->head;
+        cache->head = block->next;
+        cache->count--;
+        SLAB_COUNT(cached_allocs);
+        return block;
+    }
+    return heap_block(class, class_size(class));
+}
+
+void* slab_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void* ptr = slab_malloc(count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void slab_free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    unsigned int class = *block_class(ptr);
+    if (class != SLAB_LARGE_CLASS) {
+        struct slab_cache_t* cache = &caches[class];
+        if (cache->count < class_cache_limit(class)) {
+            struct slab_free_block_t* block = ptr;
+            block->next = cache->head;
+            cache->head = block;
+            cache->count++;
+            return;
+        }
+    }
+    SLAB_COUNT(heap_frees);
+    free(block_class(ptr));
+}
+
+void* slab_realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return slab_malloc(size);
+    }
+    if (size == 0) {
+        slab_free(ptr);
+        return NULL;
+    }
+    unsigned int class = *block_class(ptr);
+    if (class == SLAB_LARGE_CLASS) {
+        char* block = realloc(block_class(ptr), SLAB_HEADER_SIZE + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        SLAB_COUNT(heap_allocs);
+        return block + SLAB_HEADER_SIZE;
+    }
+    if (size <= class_size(class)) {
+        return ptr;
+    }
+    void* resized = slab_malloc(size);
+    if (resized == NULL) {
+        return NULL;
+    }
+    memcpy(resized, ptr, class_size(class));
+    slab_free(ptr);
+    return resized;
+}
+
+void slab_use_for_libevent(void) {
+    event_set_mem_functions(slab_malloc, slab_realloc, slab_free);
+}
+
+#ifdef DEBUG_MODE
+struct slab_stats_t slab_get_stats(void) {
+    return stats;
+}
+#endif
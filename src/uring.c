@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zconf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+
+#include <event2/event.h>
+
+#include "../include/uring.h"
+#include "../include/config.h"
+#include "../include/log.h"
+
+struct uring_t {
+    int fd;
+    struct event* event; //the ring fd is readable while completions are waiting
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring; //same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    //Submission queue, the kernel moves the head
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail; //queued but not yet published
+    //Completion queue, the kernel moves the tail
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+static void reap_completions(struct uring_t* ring) {
+    unsigned int head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+        struct uring_op_t* op = (struct uring_op_t*)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+        //The slot is given back before the callback, which may queue new operations
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        op->done(op, result);
+    }
+}
+
+static void uring_event_cb(evutil_socket_t fd, short events, void* ctx) {
+    reap_completions((struct uring_t*)ctx);
+}
+
+static void unmap_rings(struct uring_t* ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+}
+
+static int map_rings(struct uring_t* ring, const struct io_uring_params* params) {
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params->features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    void* sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        return -1;
+    }
+    ring->sq_ring = sq_ring;
+    if (single_mmap) {
+        ring->cq_ring = sq_ring;
+    } else {
+        void* cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            return -1;
+        }
+        ring->cq_ring = cq_ring;
+    }
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return -1;
+    }
+    ring->sqes = sqes;
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned int*)(sq + params->sq_off.head);
+    ring->sq_tail = (unsigned int*)(sq + params->sq_off.tail);
+    ring->sq_mask = *(unsigned int*)(sq + params->sq_off.ring_mask);
+    ring->sq_entries = *(unsigned int*)(sq + params->sq_off.ring_entries);
+    ring->sq_array = (unsigned int*)(sq + params->sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned int*)(cq + params->cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq + params->cq_off.tail);
+    ring->cq_mask = *(unsigned int*)(cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+    return 0;
+}
+
+struct uring_t* uring_open(struct event_base* base) {
+    struct uring_t* ring = calloc(1, sizeof(struct uring_t));
+    if (ring == NULL) {
+        log(ERROR, "Unable to allocate memory");
+        return NULL;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        log(WARNING, "io_uring is not available, falling back to blocking file I/O: %s", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+    if (map_rings(ring, &params) < 0) {
+        log(ERROR, "Unable to map io_uring: %s", strerror(errno));
+        uring_close(ring);
+        return NULL;
+    }
+    ring->event = event_new(base, ring->fd, EV_READ | EV_PERSIST, uring_event_cb, ring);
+    if (ring->event == NULL || event_add(ring->event, NULL) < 0) {
+        log(ERROR, "Unable to watch io_uring completions");
+        uring_close(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void uring_close(struct uring_t* ring) {
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->event != NULL) {
+        event_free(ring->event);
+    }
+    unmap_rings(ring);
+    close(ring->fd);
+    free(ring);
+}
+
+static struct io_uring_sqe* get_sqe(struct uring_t* ring, struct uring_op_t* op) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    unsigned int index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+int uring_prep_openat(struct uring_t* ring, struct uring_op_t* op, int dirfd, const char* path, int flags) {
+    struct io_uring_sqe* sqe = get_sqe(ring, op);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->open_flags = (uint32_t)flags;
+    return 0;
+}
+
+int uring_prep_openat2(struct uring_t* ring, struct uring_op_t* op, int dirfd, const char* path,
+                       const struct open_how* how) {
+    struct io_uring_sqe* sqe = get_sqe(ring, op);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_OPENAT2;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->len = sizeof(struct open_how);
+    sqe->off = (uint64_t)(uintptr_t)how;
+    return 0;
+}
+
+int uring_submit(struct uring_t* ring) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (ring->sq_local_tail != head) {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, ring->sq_local_tail - head, 0, 0, NULL, 0);
+        if (submitted < 0 && errno == EINTR) {
+            continue;
+        }
+        if (submitted <= 0) {
+            break;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+    if (ring->sq_local_tail == head) {
+        return 0;
+    }
+
+    //The kernel only reads the queue inside io_uring_enter(), so entries it did not take can be
+    //withdrawn. Their operations are finished with -ECANCELED and the caller falls back to blocking I/O.
+    log(ERROR, "Unable to submit to io_uring: %s", strerror(errno));
+    unsigned int dropped_tail = ring->sq_local_tail;
+    ring->sq_local_tail = head;
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+    for (unsigned int i = head; i != dropped_tail; i++) {
+        struct uring_op_t* op = (struct uring_op_t*)(uintptr_t)ring->sqes[i & ring->sq_mask].user_data;
+        op->done(op, -ECANCELED);
+    }
+    return -1;
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/access_log.h"
+#include "../include/http.h"
+
+//Converts binary access logs to tab-separated text:
+//time, worker, method, status, bytes sent, latency in microseconds, URI
+//Usage: access_log_dump <access log>... (reads stdin without arguments)
+
+static int dump(FILE* file, const char* name) {
+    char magic[ACCESS_LOG_MAGIC_LEN];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, ACCESS_LOG_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s: not an access log\n", name);
+        return -1;
+    }
+
+    struct access_log_record_t record;
+    char uri[ACCESS_LOG_MAX_URI_LEN];
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.uri_len > sizeof(uri) || fread(uri, 1, record.uri_len, file) != record.uri_len) {
+            fprintf(stderr, "%s: truncated record\n", name);
+            return -1;
+        }
+        time_t seconds = (time_t)(record.timestamp_us / 1000000);
+        struct tm time_info;
+        char time_str[32];
+        gmtime_r(&seconds, &time_info);
+        strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S", &time_info);
+        printf("%s.%06luZ\t%u\t%s\t%u\t%lu\t%u\t%.*s\n",
+                time_str, (unsigned long)(record.timestamp_us % 1000000),
+                record.worker_id,
+                request_method_t_to_string((enum request_method_t)record.method),
+                record.status,
+                (unsigned long)record.bytes_sent,
+                record.latency_us,
+                (int)record.uri_len, uri);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        return dump(stdin, "stdin") < 0 ? EXIT_FAILURE : 0;
+    }
+    int result = 0;
+    for (int i = 1; i < argc; i++) {
+        FILE* file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            perror(argv[i]);
+            result = EXIT_FAILURE;
+            continue;
+        }
+        if (dump(file, argv[i]) < 0) {
+            result = EXIT_FAILURE;
+        }
+        fclose(file);
+    }
+    return result;
+}
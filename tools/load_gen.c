@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+//Event-driven HTTP/1.1 load generator, prints one JSON object with requests per second
+//and p50/p90/p99/p99.9 latencies from a log-linear (HDR-style) histogram.
+//Usage: load_gen [-a host:port] [-c connections] [-t threads] [-d seconds] [-p pipeline depth]
+//                [-r requests per second] [-k] [-u url file] [path...]
+//Without -r every connection keeps pipeline depth requests in flight (closed loop). With -r
+//requests are due at a fixed rate and their latency counts from the time they were due, so
+//a stalled server is not hidden by the generator waiting for it (no coordinated omission).
+//-k sends "Connection: close" and reconnects after every response. Paths come from the url
+//file (one per line) and the arguments, every connection cycles through them.
+
+#define MAX_PIPELINE_DEPTH 64
+#define MAX_RESPONSE_HEAD_SIZE (64 * 1024)
+#define RECONNECT_DELAY_US 100000 //after a failed connect
+
+//Values below 128 us are exact, larger ones are kept with 64 sub-buckets per power of two (1.6%)
+#define HISTOGRAM_SUB_BUCKETS 64
+#define HISTOGRAM_EXACT_LIMIT (2 * HISTOGRAM_SUB_BUCKETS)
+#define HISTOGRAM_MAX_SHIFT 36 //about 76 days
+#define HISTOGRAM_BUCKETS (HISTOGRAM_EXACT_LIMIT + HISTOGRAM_MAX_SHIFT * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram_t {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+};
+
+struct options_t {
+    struct sockaddr_storage address;
+    int address_len;
+    char host[256];
+    int connections;
+    int threads;
+    int duration;
+    int pipeline_depth;
+    double rate; //requests per second of all connections, 0 for the closed loop
+    bool keep_alive;
+    char** requests; //rendered request of every path
+    size_t* request_lens;
+    size_t requests_count;
+};
+
+struct load_thread_t;
+
+struct client_conn_t {
+    struct load_thread_t* thread;
+    struct bufferevent* bev;
+    size_t next_request; //index into options.requests
+    //Start times of the requests in flight, oldest first
+    uint64_t in_flight_us[MAX_PIPELINE_DEPTH];
+    unsigned int in_flight_head;
+    unsigned int in_flight_count;
+    bool connected;
+    //Open loop: request k is due at start_us + k * interval_us
+    struct event* due_event;
+    uint64_t start_us;
+    double interval_us;
+    uint64_t sent_index;
+    //Response being read
+    bool in_body;
+    uint64_t body_left;
+    bool server_closes;
+};
+
+struct load_thread_t {
+    pthread_t thread;
+    struct event_base* base;
+    struct client_conn_t* conns;
+    int conns_count;
+    int first_conn; //global index of conns[0], spreads the rate schedule and the paths
+    struct histogram_t latency;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t status_classes[6]; //1xx..5xx, [0] for unparsable status lines
+};
+
+static struct options_t options;
+
+static uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static size_t histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_EXACT_LIMIT) {
+        return (size_t)value;
+    }
+    //value >> shift is in [HISTOGRAM_SUB_BUCKETS, 2 * HISTOGRAM_SUB_BUCKETS)
+    unsigned int shift = (unsigned int)(63 - __builtin_clzll(value)) - 6;
+    if (shift > HISTOGRAM_MAX_SHIFT) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    return HISTOGRAM_EXACT_LIMIT + (shift - 1) * HISTOGRAM_SUB_BUCKETS
+            + (size_t)((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+//Highest value counted in the bucket
+static uint64_t histogram_bucket_value(size_t index) {
+    if (index < HISTOGRAM_EXACT_LIMIT) {
+        return index;
+    }
+    unsigned int shift = (unsigned int)((index - HISTOGRAM_EXACT_LIMIT) / HISTOGRAM_SUB_BUCKETS) + 1;
+    uint64_t sub_bucket = (index - HISTOGRAM_EXACT_LIMIT) % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+static void histogram_record(struct histogram_t* histogram, uint64_t value) {
+    histogram->counts[histogram_index(value)]++;
+    if (histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->count++;
+    histogram->sum += (double)value;
+}
+
+static void histogram_merge(struct histogram_t* dest, const struct histogram_t* src) {
+    if (src->count == 0) {
+        return;
+    }
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dest->counts[i] += src->counts[i];
+    }
+    if (dest->count == 0 || src->min < dest->min) {
+        dest->min = src->min;
+    }
+    if (src->max > dest->max) {
+        dest->max = src->max;
+    }
+    dest->count += src->count;
+    dest->sum += src->sum;
+}
+
+static uint64_t histogram_percentile(const struct histogram_t* histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)histogram->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+static void conn_connect(struct client_conn_t* conn);
+
+static uint64_t due_time_us(const struct client_conn_t* conn, uint64_t index) {
+    return conn->start_us + (uint64_t)((double)index * conn->interval_us);
+}
+
+static void send_request(struct client_conn_t* conn, uint64_t start_us) {
+    size_t index = conn->next_request;
+    conn->next_request = (conn->next_request + 1) % options.requests_count;
+    bufferevent_write(conn->bev, options.requests[index], options.request_lens[index]);
+    unsigned int slot = (conn->in_flight_head + conn->in_flight_count) % MAX_PIPELINE_DEPTH;
+    conn->in_flight_us[slot] = start_us;
+    conn->in_flight_count++;
+}
+
+static void send_requests(struct client_conn_t* conn) {
+    if (!conn->connected) {
+        return;
+    }
+    unsigned int depth = (unsigned int)options.pipeline_depth;
+    if (options.rate <= 0) {
+        while (conn->in_flight_count < depth) {
+            send_request(conn, monotonic_us());
+        }
+        return;
+    }
+    uint64_t now_us = monotonic_us();
+    while (conn->in_flight_count < depth && due_time_us(conn, conn->sent_index) <= now_us) {
+        send_request(conn, due_time_us(conn, conn->sent_index));
+        conn->sent_index++;
+    }
+}
+
+//Open loop: wakes up when the next request is due. Requests that are already due while
+//the pipeline is full go out as responses arrive.
+static void schedule_due(struct client_conn_t* conn) {
+    if (options.rate <= 0 || event_pending(conn->due_event, EV_TIMEOUT, NULL)) {
+        return;
+    }
+    uint64_t now_us = monotonic_us();
+    uint64_t next_us = due_time_us(conn, conn->sent_index);
+    uint64_t wait_us = next_us > now_us ? next_us - now_us : 0;
+    if (wait_us == 0 && (!conn->connected || conn->in_flight_count >= (unsigned int)options.pipeline_depth)) {
+        return;
+    }
+    struct timeval wait = {(time_t)(wait_us / 1000000), (suseconds_t)(wait_us % 1000000)};
+    event_add(conn->due_event, &wait);
+}
+
+static void due_cb(evutil_socket_t fd, short events, void* ctx) {
+    struct client_conn_t* conn = (struct client_conn_t*)ctx;
+    send_requests(conn);
+    schedule_due(conn);
+}
+
+static void reconnect_cb(evutil_socket_t fd, short events, void* ctx) {
+    conn_connect((struct client_conn_t*)ctx);
+}
+
+//Requests in flight are lost, those due meanwhile wait for the new connection
+static void conn_reset(struct client_conn_t* conn, bool failed) {
+    if (failed) {
+        conn->thread->errors += conn->in_flight_count;
+    }
+    bool was_connected = conn->connected;
+    conn->in_flight_count = 0;
+    conn->in_flight_head = 0;
+    conn->in_body = false;
+    conn->server_closes = false;
+    conn->connected = false;
+    bufferevent_free(conn->bev);
+    conn->bev = NULL;
+    if (was_connected) {
+        conn_connect(conn);
+        return;
+    }
+    //A refused connect is retried a little later instead of in a busy loop
+    struct timeval delay = {0, RECONNECT_DELAY_US};
+    event_base_once(conn->thread->base, -1, EV_TIMEOUT, reconnect_cb, conn, &delay);
+}
+
+static int parse_response_head(struct client_conn_t* conn, const char* head, size_t len) {
+    if (len < 12 || memcmp(head, "HTTP/1.", 7) != 0) {
+        conn->thread->status_classes[0]++;
+        return -1;
+    }
+    int status_class = head[9] - '0';
+    conn->thread->status_classes[status_class >= 1 && status_class <= 5 ? status_class : 0]++;
+
+    uint64_t content_len = 0;
+    conn->server_closes = !options.keep_alive || memcmp(head, "HTTP/1.0", 8) == 0;
+    const char* line = memchr(head, '\n', len);
+    while (line != NULL && (size_t)(line + 1 - head) < len) {
+        line++;
+        size_t line_len = len - (size_t)(line - head);
+        if (line_len > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_len = strtoull(line + 15, NULL, 10);
+        } else if (line_len > 11 && strncasecmp(line, "Connection:", 11) == 0) {
+            const char* value = line + 11;
+            while (*value == ' ') {
+                value++;
+            }
+            conn->server_closes = strncasecmp(value, "close", 5) == 0;
+        }
+        line = memchr(line, '\n', line_len);
+    }
+    conn->body_left = content_len;
+    return 0;
+}
+
+static void response_done(struct client_conn_t* conn) {
+    struct load_thread_t* thread = conn->thread;
+    uint64_t start_us = conn->in_flight_us[conn->in_flight_head];
+    conn->in_flight_head = (conn->in_flight_head + 1) % MAX_PIPELINE_DEPTH;
+    conn->in_flight_count--;
+    uint64_t now_us = monotonic_us();
+    histogram_record(&thread->latency, now_us > start_us ? now_us - start_us : 0);
+    thread->requests++;
+}
+
+static void conn_read_cb(struct bufferevent* bev, void* ctx) {
+    struct client_conn_t* conn = (struct client_conn_t*)ctx;
+    struct evbuffer* input = bufferevent_get_input(bev);
+    while (evbuffer_get_length(input) > 0) {
+        if (!conn->in_body) {
+            struct evbuffer_ptr end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+            if (end.pos < 0) {
+                if (evbuffer_get_length(input) > MAX_RESPONSE_HEAD_SIZE) {
+                    conn_reset(conn, true);
+                }
+                return;
+            }
+            size_t head_len = (size_t)end.pos + 4;
+            const char* head = (const char*)evbuffer_pullup(input, (ev_ssize_t)head_len);
+            if (conn->in_flight_count == 0 || parse_response_head(conn, head, head_len) < 0) {
+                conn_reset(conn, true);
+                return;
+            }
+            evbuffer_drain(input, head_len);
+            conn->thread->bytes += head_len;
+            conn->in_body = true;
+        }
+        size_t available = evbuffer_get_length(input);
+        size_t body_part = available < conn->body_left ? available : (size_t)conn->body_left;
+        evbuffer_drain(input, body_part);
+        conn->body_left -= body_part;
+        conn->thread->bytes += body_part;
+        if (conn->body_left > 0) {
+            return;
+        }
+        conn->in_body = false;
+        response_done(conn);
+        if (conn->server_closes) {
+            conn_reset(conn, conn->in_flight_count > 0);
+            return;
+        }
+    }
+    send_requests(conn);
+    schedule_due(conn);
+}
+
+static void conn_event_cb(struct bufferevent* bev, short events, void* ctx) {
+    struct client_conn_t* conn = (struct client_conn_t*)ctx;
+    if (events & BEV_EVENT_CONNECTED) {
+        conn->connected = true;
+        conn->thread->connects++;
+        int on = 1;
+        setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        send_requests(conn);
+        schedule_due(conn);
+        return;
+    }
+    if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+        if (!conn->connected) {
+            conn->thread->errors++; //refused, counted once per attempt
+        }
+        conn_reset(conn, true);
+    }
+}
+
+static void conn_connect(struct client_conn_t* conn) {
+    conn->bev = bufferevent_socket_new(conn->thread->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (conn->bev == NULL) {
+        fprintf(stderr, "Unable to create bufferevent\n");
+        exit(EXIT_FAILURE);
+    }
+    bufferevent_setcb(conn->bev, conn_read_cb, NULL, conn_event_cb, conn);
+    bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+    if (bufferevent_socket_connect(conn->bev, (struct sockaddr*)&options.address, options.address_len) < 0) {
+        fprintf(stderr, "Unable to connect: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void* load_thread_routine(void* arg) {
+    struct load_thread_t* thread = (struct load_thread_t*)arg;
+    uint64_t start_us = monotonic_us();
+    for (int i = 0; i < thread->conns_count; i++) {
+        struct client_conn_t* conn = &thread->conns[i];
+        int global_index = thread->first_conn + i;
+        conn->thread = thread;
+        conn->next_request = (size_t)global_index % options.requests_count;
+        if (options.rate > 0) {
+            //Connections are offset within one interval so the requests do not come in bursts
+            conn->interval_us = (double)options.connections * 1e6 / options.rate;
+            conn->start_us = start_us + (uint64_t)(conn->interval_us * global_index / options.connections);
+            conn->due_event = event_new(thread->base, -1, 0, due_cb, conn);
+        }
+        conn_connect(conn);
+    }
+    struct timeval duration = {options.duration, 0};
+    event_base_loopexit(thread->base, &duration);
+    event_base_dispatch(thread->base);
+    for (int i = 0; i < thread->conns_count; i++) {
+        if (thread->conns[i].due_event != NULL) {
+            event_free(thread->conns[i].due_event);
+        }
+        if (thread->conns[i].bev != NULL) {
+            bufferevent_free(thread->conns[i].bev);
+        }
+    }
+    return NULL;
+}
+
+static int add_path(const char* path) {
+    char** requests = realloc(options.requests, (options.requests_count + 1) * sizeof(char*));
+    size_t* lens = realloc(options.request_lens, (options.requests_count + 1) * sizeof(size_t));
+    if (requests != NULL) {
+        options.requests = requests;
+    }
+    if (lens != NULL) {
+        options.request_lens = lens;
+    }
+    if (requests == NULL || lens == NULL) {
+        return -1;
+    }
+    size_t size = strlen(path) + strlen(options.host) + 128;
+    char* request = malloc(size);
+    if (request == NULL) {
+        return -1;
+    }
+    int len = snprintf(request, size, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                       path, options.host, options.keep_alive ? "keep-alive" : "close");
+    options.requests[options.requests_count] = request;
+    options.request_lens[options.requests_count] = (size_t)len;
+    options.requests_count++;
+    return 0;
+}
+
+static int load_url_file(const char* file_path) {
+    FILE* file = fopen(file_path, "r");
+    if (file == NULL) {
+        perror(file_path);
+        return -1;
+    }
+    char line[4096];
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '/') {
+            result = add_path(line);
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: load_gen [-a host:port] [-c connections] [-t threads] [-d seconds] "
+                    "[-p pipeline depth] [-r requests per second] [-k] [-u url file] [path...]\n");
+    exit(EXIT_FAILURE);
+}
+
+static void print_results(const struct load_thread_t* threads, double elapsed) {
+    struct histogram_t* latency = calloc(1, sizeof(struct histogram_t));
+    uint64_t requests = 0, errors = 0, connects = 0, bytes = 0;
+    uint64_t status_classes[6] = {0};
+    for (int i = 0; i < options.threads; i++) {
+        histogram_merge(latency, &threads[i].latency);
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        connects += threads[i].connects;
+        bytes += threads[i].bytes;
+        for (int j = 0; j < 6; j++) {
+            status_classes[j] += threads[i].status_classes[j];
+        }
+    }
+    printf("{\"connections\": %d, \"threads\": %d, \"pipeline\": %d, \"keep_alive\": %s, \"rate\": %.0f, "
+           "\"duration_s\": %.3f, \"requests\": %lu, \"errors\": %lu, \"connects\": %lu, \"bytes\": %lu, "
+           "\"rps\": %.1f, \"status\": {\"1xx\": %lu, \"2xx\": %lu, \"3xx\": %lu, \"4xx\": %lu, \"5xx\": %lu, "
+           "\"other\": %lu}, \"latency_us\": {\"min\": %lu, \"mean\": %.1f, \"p50\": %lu, \"p90\": %lu, "
+           "\"p99\": %lu, \"p99.9\": %lu, \"max\": %lu}}\n",
+           options.connections, options.threads, options.pipeline_depth, options.keep_alive ? "true" : "false",
+           options.rate, elapsed, (unsigned long)requests, (unsigned long)errors, (unsigned long)connects,
+           (unsigned long)bytes, (double)requests / elapsed,
+           (unsigned long)status_classes[1], (unsigned long)status_classes[2], (unsigned long)status_classes[3],
+           (unsigned long)status_classes[4], (unsigned long)status_classes[5], (unsigned long)status_classes[0],
+           (unsigned long)latency->min, latency->count > 0 ? latency->sum / (double)latency->count : 0.0,
+           (unsigned long)histogram_percentile(latency, 50), (unsigned long)histogram_percentile(latency, 90),
+           (unsigned long)histogram_percentile(latency, 99), (unsigned long)histogram_percentile(latency, 99.9),
+           (unsigned long)latency->max);
+    free(latency);
+}
+
+int main(int argc, char** argv) {
+    const char* address = "127.0.0.1:80";
+    const char* url_file = NULL;
+    options.connections = 10;
+    options.threads = 1;
+    options.duration = 10;
+    options.pipeline_depth = 1;
+    options.keep_alive = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:c:t:d:p:r:ku:")) != -1) {
+        switch (opt) {
+            case 'a': {
+                address = optarg;
+                break;
+            }
+            case 'c': {
+                options.connections = atoi(optarg);
+                break;
+            }
+            case 't': {
+                options.threads = atoi(optarg);
+                break;
+            }
+            case 'd': {
+                options.duration = atoi(optarg);
+                break;
+            }
+            case 'p': {
+                options.pipeline_depth = atoi(optarg);
+                break;
+            }
+            case 'r': {
+                options.rate = atof(optarg);
+                break;
+            }
+            case 'k': {
+                options.keep_alive = false;
+                break;
+            }
+            case 'u': {
+                url_file = optarg;
+                break;
+            }
+            default: {
+                usage();
+            }
+        }
+    }
+    if (options.connections < 1 || options.threads < 1 || options.duration < 1 ||
+        options.pipeline_depth < 1 || options.pipeline_depth > MAX_PIPELINE_DEPTH) {
+        usage();
+    }
+    if (!options.keep_alive) {
+        options.pipeline_depth = 1; //the server closes after the first response
+    }
+    if (options.threads > options.connections) {
+        options.threads = options.connections;
+    }
+    options.address_len = sizeof(options.address);
+    if (evutil_parse_sockaddr_port(address, (struct sockaddr*)&options.address, &options.address_len) < 0) {
+        fprintf(stderr, "Invalid address %s\n", address);
+        return EXIT_FAILURE;
+    }
+    snprintf(options.host, sizeof(options.host), "%s", address);
+    if (url_file != NULL && load_url_file(url_file) < 0) {
+        return EXIT_FAILURE;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (add_path(argv[i]) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.requests_count == 0 && add_path("/") < 0) {
+        return EXIT_FAILURE;
+    }
+
+    struct load_thread_t* threads = calloc((size_t)options.threads, sizeof(struct load_thread_t));
+    struct client_conn_t* conns = calloc((size_t)options.connections, sizeof(struct client_conn_t));
+    if (threads == NULL || conns == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+    int first_conn = 0;
+    for (int i = 0; i < options.threads; i++) {
+        struct load_thread_t* thread = &threads[i];
+        thread->conns_count = options.connections / options.threads + (i < options.connections % options.threads);
+        thread->conns = &conns[first_conn];
+        thread->first_conn = first_conn;
+        first_conn += thread->conns_count;
+        //Open loop due times need better than the millisecond resolution of epoll_wait()
+        struct event_config* config = event_config_new();
+        event_config_set_flag(config, EVENT_BASE_FLAG_PRECISE_TIMER);
+        thread->base = event_base_new_with_config(config);
+        event_config_free(config);
+        if (thread->base == NULL) {
+            fprintf(stderr, "Unable to open event base\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t start_us = monotonic_us();
+    for (int i = 0; i < options.threads; i++) {
+        int err = pthread_create(&threads[i].thread, NULL, load_thread_routine, &threads[i]);
+        if (err != 0) {
+            fprintf(stderr, "Unable to start thread: %s\n", strerror(err));
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    print_results(threads, (double)(monotonic_us() - start_us) / 1e6);
+
+    for (int i = 0; i < options.threads; i++) {
+        event_base_free(threads[i].base);
+    }
+    for (size_t i = 0; i < options.requests_count; i++) {
+        free(options.requests[i]);
+    }
+    free(options.requests);
+    free(options.request_lens);
+    free(conns);
+    free(threads);
+    return 0;
+}